@@ -0,0 +1,667 @@
+/**
+ * @file cppotp_bench.cpp
+ *
+ * @brief Microbenchmarks of the library's hot paths.
+ *
+ * Each benchmark is run in growing batches until a batch takes long enough to
+ * time reliably; the best of several such batches is reported as
+ * nanoseconds per operation, cycles per byte (timestamp counter cycles, on
+ * x86) and one-time passwords per second on one core. The results can be
+ * written as JSON and compared against such a file from an earlier run.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#include "libcppotp/attemptlimiter.h"
+#include "libcppotp/batchverify.h"
+#include "libcppotp/bytes.h"
+#include "libcppotp/codetable.h"
+#include "libcppotp/credset.h"
+#include "libcppotp/credstore.h"
+#include "libcppotp/drifttracker.h"
+#include "libcppotp/keycache.h"
+#include "libcppotp/otp.h"
+#include "libcppotp/otptemplate.h"
+#include "libcppotp/sha1.h"
+#include "libcppotp/sha1backend.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#	include <x86intrin.h>
+#	define CPPTOTP_BENCH_TSC 1
+#endif
+
+using namespace CppTotp;
+
+/** Keeps the compiler from optimizing away a result. */
+template <typename T>
+static inline void keep(const T & value)
+{
+	asm volatile("" : : "g"(&value) : "memory");
+}
+
+static inline uint64_t cycleCount()
+{
+#ifdef CPPTOTP_BENCH_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+struct Benchmark
+{
+	std::string name;
+
+	/** The bytes processed per operation, for cycles per byte; 0 if not meaningful. */
+	size_t bytesPerOp;
+
+	/** The one-time passwords produced or checked per operation. */
+	size_t codesPerOp;
+
+	/** Runs the operation the given number of times. */
+	std::function<void(size_t)> run;
+};
+
+struct Result
+{
+	std::string name;
+	double nsPerOp;
+	double cyclesPerByte;
+	double codesPerSecond;
+};
+
+static Result measure(const Benchmark & bench, double minSeconds, size_t repetitions)
+{
+	Result ret;
+	ret.name = bench.name;
+	ret.nsPerOp = 0.0;
+	ret.cyclesPerByte = 0.0;
+	ret.codesPerSecond = 0.0;
+
+	// warm up and find a batch size taking at least the minimum time
+	size_t iterations = 1;
+	for (;;)
+	{
+		auto start = std::chrono::steady_clock::now();
+		bench.run(iterations);
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		if (elapsed.count() >= minSeconds || iterations >= (static_cast<size_t>(1) << 40))
+		{
+			break;
+		}
+		iterations *= (elapsed.count() < minSeconds / 16) ? 8 : 2;
+	}
+
+	double bestNs = 0.0;
+	double bestCycles = 0.0;
+	for (size_t r = 0; r < repetitions; ++r)
+	{
+		uint64_t startCycles = cycleCount();
+		auto start = std::chrono::steady_clock::now();
+		bench.run(iterations);
+		std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+		uint64_t cycles = cycleCount() - startCycles;
+
+		double ns = elapsed.count() / static_cast<double>(iterations);
+		if (r == 0 || ns < bestNs)
+		{
+			bestNs = ns;
+			bestCycles = static_cast<double>(cycles) / static_cast<double>(iterations);
+		}
+	}
+
+	ret.nsPerOp = bestNs;
+	if (bench.bytesPerOp > 0)
+	{
+		ret.cyclesPerByte = bestCycles / static_cast<double>(bench.bytesPerOp);
+	}
+	if (bench.codesPerOp > 0)
+	{
+		ret.codesPerSecond = 1e9 * static_cast<double>(bench.codesPerOp) / bestNs;
+	}
+	return ret;
+}
+
+/** Test data shared by the benchmarks. */
+struct Fixture
+{
+	Bytes::ByteString key;
+	Bytes::ByteString message;
+	HmacSha1Key preparedKey;
+	std::vector<HmacSha1Key> keys;
+	std::vector<const HmacSha1Key *> keyPointers;
+	std::vector<uint64_t> counters;
+	std::vector<uint32_t> codes;
+	std::string base32;
+	std::string hex;
+	std::vector<char> chars;
+	std::vector<Bytes::Byte> bytes;
+	CredentialStore store;
+	std::vector<size_t> storeIndices;
+	TotpCodeTable codeTable;
+	DriftTracker driftTracker;
+	HmacSha1Policy::Key templateKey;
+
+	Fixture()
+		: key(reinterpret_cast<const Bytes::Byte *>("12345678901234567890")),
+		message(16384, 0x5A),
+		preparedKey(key),
+		keys(1024),
+		counters(1024),
+		codes(1024),
+		chars(32768),
+		bytes(32768),
+		store(1024),
+		storeIndices(1024),
+		codeTable(store),
+		driftTracker(1024),
+		templateKey(HmacSha1Policy::prepareKey(preparedKey))
+	{
+		for (size_t i = 0; i < keys.size(); ++i)
+		{
+			Bytes::ByteString accountKey = key;
+			accountKey[0] = static_cast<Bytes::Byte>(i);
+			accountKey[1] = static_cast<Bytes::Byte>(i >> 8);
+			keys[i] = HmacSha1Key(accountKey);
+			keyPointers.push_back(&keys[i]);
+			counters[i] = 1000 + i;
+			storeIndices[i] = store.add(i, keys[i], { OtpKind::Totp, 6, 30, 0, 0 });
+		}
+		codeTable.build(1234567890);
+		base32 = Bytes::toBase32(key);
+		hex = Bytes::toHexString(Bytes::ByteString(message, 0, 1024));
+	}
+};
+
+static std::vector<Benchmark> buildBenchmarks(Fixture * f)
+{
+	std::vector<Benchmark> ret;
+	const size_t messageSizes[] = { 20, 64, 1024, 16384 };
+
+	for (size_t size : messageSizes)
+	{
+		ret.push_back({ "sha1/" + std::to_string(size), size, 0, [f, size](size_t n)
+		{
+			Sha1Digest digest;
+			for (size_t i = 0; i < n; ++i)
+			{
+				sha1(f->message.data(), size, &digest);
+				keep(digest);
+			}
+		}});
+	}
+
+	size_t backendCount = 0;
+	const Sha1Backend * backends = sha1Backends(&backendCount);
+	for (size_t b = 0; b < backendCount; ++b)
+	{
+		if (!backends[b].supported())
+		{
+			continue;
+		}
+		Sha1CompressFunc compress = backends[b].compress;
+		ret.push_back({ std::string("compress/") + backends[b].name, 1024, 0, [f, compress](size_t n)
+		{
+			uint32_t state[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+			for (size_t i = 0; i < n; ++i)
+			{
+				compress(state, f->message.data(), 1024 / Sha1BlockSize);
+				keep(state);
+			}
+		}});
+		Sha1CounterMacFunc counterMac = backends[b].counterMac;
+		ret.push_back({ std::string("counterMac/") + backends[b].name, 8, 1, [f, counterMac](size_t n)
+		{
+			uint32_t digest[5];
+			for (size_t i = 0; i < n; ++i)
+			{
+				counterMac(f->preparedKey.innerState(), f->preparedKey.outerState(), i, digest);
+				keep(digest);
+			}
+		}});
+	}
+
+	ret.push_back({ "hmacSha1/bytestring", 8, 0, [f](size_t n)
+	{
+		Bytes::ByteString msg = Bytes::u64beToByteString(1);
+		for (size_t i = 0; i < n; ++i)
+		{
+			Bytes::ByteString mac = hmacSha1(f->key, msg);
+			keep(mac);
+		}
+	}});
+	ret.push_back({ "hmacSha1/buffer", 8, 0, [f](size_t n)
+	{
+		Bytes::Byte msg[8] = {};
+		Sha1Digest digest;
+		for (size_t i = 0; i < n; ++i)
+		{
+			hmacSha1(f->key.data(), f->key.size(), msg, sizeof(msg), &digest);
+			keep(digest);
+		}
+	}});
+	ret.push_back({ "hmacSha1/prepared", 8, 0, [f](size_t n)
+	{
+		Bytes::Byte msg[8] = {};
+		Sha1Digest digest;
+		for (size_t i = 0; i < n; ++i)
+		{
+			f->preparedKey.mac(msg, sizeof(msg), &digest);
+			keep(digest);
+		}
+	}});
+
+	ret.push_back({ "hotp/bytestring", 0, 1, [f](size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			keep(hotp(f->key, i, 6));
+		}
+	}});
+	ret.push_back({ "hotp/bytestring/cached", 0, 1, [f](size_t n)
+	{
+		setHmacKeyCacheCapacity(64);
+		for (size_t i = 0; i < n; ++i)
+		{
+			keep(hotp(f->key, i, 6));
+		}
+		setHmacKeyCacheCapacity(0);
+	}});
+	ret.push_back({ "hotp/prepared", 0, 1, [f](size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			keep(hotp(f->preparedKey, i, 6));
+		}
+	}});
+	ret.push_back({ "hotp/template", 0, 1, [f](size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			keep(Hotp<HmacSha1Policy, 6>::generate(f->templateKey, i));
+		}
+	}});
+	ret.push_back({ "totp/bytestring", 0, 1, [f](size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			keep(totp(f->key, 1234567890 + 30 * i, 0, 30, 6));
+		}
+	}});
+	ret.push_back({ "totp/prepared", 0, 1, [f](size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			keep(totp(f->preparedKey, 1234567890 + 30 * i, 0, 30, 6));
+		}
+	}});
+
+	ret.push_back({ "hotpMany/1024", 0, 1024, [f](size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			hotpMany(f->keyPointers.data(), f->counters.data(), 1024, 6, f->codes.data());
+			keep(f->codes[0]);
+		}
+	}});
+	ret.push_back({ "generateMany/1024", 0, 1024, [f](size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			f->store.generateMany(f->storeIndices.data(), f->counters.data(), 1024, f->codes.data());
+			keep(f->codes[0]);
+		}
+	}});
+	ret.push_back({ "hotpSearch/1000", 0, 1001, [f](size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			// a value that does not occur, so the whole window is searched
+			keep(hotpSearch(f->preparedKey, i, 1000, 1000000));
+		}
+	}});
+	ret.push_back({ "verifyTotp/window1", 0, 3, [f](size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			keep(verifyTotp(f->preparedKey, 123456, 1234567890 + 30 * i, 0, 30, 1));
+		}
+	}});
+	ret.push_back({ "verifyTotp/store", 0, 3, [f](size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			keep(f->store.verifyTotp(f->storeIndices[i % 1024], 123456, 1234567890, 1));
+		}
+	}});
+	// batches of 4096 on one thread and on one per core; codes are counted per
+	// thread, so that near-linear scaling shows as equal columns
+	const size_t coreCount = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+	for (size_t variant = 0; variant < 2; ++variant)
+	{
+		const size_t threads = (variant == 0) ? 1 : coreCount;
+		std::shared_ptr<std::unique_ptr<BatchVerifier> > verifier(new std::unique_ptr<BatchVerifier>());
+		ret.push_back({ (variant == 0) ? "verifyBatch/1thread" : "verifyBatch/allThreads", 0, 4096 * 3 / threads, [f, threads, verifier](size_t n)
+		{
+			// started on first use, so that filtered runs don't spawn the threads
+			if (!*verifier)
+			{
+				verifier->reset(new BatchVerifier(threads));
+			}
+			std::vector<VerifyRequest> requests(4096);
+			std::vector<VerifyResult> results(4096);
+			for (size_t i = 0; i < requests.size(); ++i)
+			{
+				requests[i] = { f->storeIndices[i % 1024], 123456, 1234567890 + i };
+			}
+			for (size_t i = 0; i < n; ++i)
+			{
+				(*verifier)->verifyBatch(f->store, requests.data(), results.data(), requests.size());
+				keep(results[0].valid);
+			}
+		}});
+	}
+	ret.push_back({ "verifyTotp/window2/valid", 0, 5, [f](size_t n)
+	{
+		const uint32_t code = totp(f->preparedKey, 1234567890, 0, 30);
+		for (size_t i = 0; i < n; ++i)
+		{
+			keep(verifyTotp(f->preparedKey, code, 1234567890, 0, 30, 2));
+		}
+	}});
+	ret.push_back({ "driftTracker/verify/valid", 0, 1, [f](size_t n)
+	{
+		const uint32_t code = totp(f->preparedKey, 1234567890, 0, 30);
+		for (size_t i = 0; i < n; ++i)
+		{
+			keep(f->driftTracker.verifyTotp(0, f->preparedKey, code, 1234567890, 0, 30));
+		}
+	}});
+	ret.push_back({ "attemptLimiter/throttled", 0, 1, [f](size_t n)
+	{
+		// a guessed account: everything after the first attempt is refused
+		AttemptLimiter limiter(f->store.size(), 1, 30);
+		for (size_t i = 0; i < n; ++i)
+		{
+			keep(verifyTotpLimited(f->store, &limiter, f->storeIndices[0], 123456, 1234567890, 2));
+		}
+	}});
+	ret.push_back({ "credSet/read", 0, 0, [f](size_t n)
+	{
+		CredentialSet set;
+		for (size_t i = 0; i < n; ++i)
+		{
+			CredentialSet::Reader reader(set);
+			keep(reader->size());
+		}
+	}});
+	ret.push_back({ "credSet/update/1024", 0, 0, [f](size_t n)
+	{
+		// rotates one key of 1024 accounts; the replaced snapshot is wiped right away
+		std::unique_ptr<CredentialStore> initial(new CredentialStore(1024));
+		for (size_t i = 0; i < 1024; ++i)
+		{
+			initial->add(i, f->keys[i], { OtpKind::Totp, 6, 30, 0, 0 });
+		}
+		CredentialSet set(std::move(initial));
+		for (size_t i = 0; i < n; ++i)
+		{
+			CredentialDelta delta = { CredentialDelta::Kind::Upsert, i % 1024, f->keys[(i + 1) % 1024], { OtpKind::Totp, 6, 30, 0, 0 } };
+			set.update(&delta, 1);
+		}
+	}});
+	ret.push_back({ "codeTable/build/1024", 0, 4096, [f](size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			keep(f->codeTable.build(1234567890).codeCount);
+		}
+	}});
+	ret.push_back({ "codeTable/verify", 0, 3, [f](size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			keep(f->codeTable.verify(f->storeIndices[i % 1024], 123456, 1234567890));
+		}
+	}});
+
+	ret.push_back({ "base32/decode/32", 32, 0, [f](size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			keep(Bytes::decodeBase32(f->base32.data(), f->base32.size(), f->bytes.data()));
+		}
+	}});
+	ret.push_back({ "base32/decode/string", 32, 0, [f](size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			Bytes::ByteString decoded = Bytes::fromBase32(f->base32);
+			keep(decoded);
+		}
+	}});
+	ret.push_back({ "base32/encode/1024", 1024, 0, [f](size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			keep(Bytes::encodeBase32(f->message.data(), 1024, f->chars.data()));
+		}
+	}});
+	ret.push_back({ "hex/decode/2048", 2048, 0, [f](size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			keep(Bytes::decodeHex(f->hex.data(), f->hex.size(), f->bytes.data()));
+		}
+	}});
+	ret.push_back({ "hex/encode/1024", 1024, 0, [f](size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			keep(Bytes::encodeHex(f->message.data(), 1024, f->chars.data()));
+		}
+	}});
+
+	return ret;
+}
+
+static void writeJson(std::ostream & out, const std::vector<Result> & results)
+{
+	out << "{\n\t\"sha1_backend\": \"" << sha1Backend().name << "\",\n\t\"benchmarks\": [\n";
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const Result & r = results[i];
+		out << "\t\t{\"name\": \"" << r.name << "\""
+			<< ", \"ns_per_op\": " << r.nsPerOp
+			<< ", \"cycles_per_byte\": " << r.cyclesPerByte
+			<< ", \"codes_per_sec\": " << r.codesPerSecond
+			<< "}" << ((i + 1 < results.size()) ? "," : "") << "\n";
+	}
+	out << "\t]\n}\n";
+}
+
+/**
+ * Reads the ns/op of each benchmark from a file written by writeJson; one
+ * benchmark per line is all that is understood.
+ */
+static bool readBaseline(const std::string & path, std::map<std::string, double> * nsPerOp)
+{
+	std::ifstream in(path);
+	if (!in)
+	{
+		return false;
+	}
+
+	static const char NameKey[] = "\"name\": \"";
+	static const char NsKey[] = "\"ns_per_op\": ";
+
+	std::string line;
+	while (std::getline(in, line))
+	{
+		size_t namePos = line.find(NameKey);
+		size_t nsPos = line.find(NsKey);
+		if (namePos == std::string::npos || nsPos == std::string::npos)
+		{
+			continue;
+		}
+		namePos += sizeof(NameKey) - 1;
+		size_t nameEnd = line.find('"', namePos);
+		if (nameEnd == std::string::npos)
+		{
+			continue;
+		}
+
+		(*nsPerOp)[line.substr(namePos, nameEnd - namePos)] = std::strtod(line.c_str() + nsPos + sizeof(NsKey) - 1, nullptr);
+	}
+	return true;
+}
+
+static void usage(const char * argv0)
+{
+	std::cerr
+		<< "Usage: " << argv0 << " [OPTIONS]\n"
+		<< "  -f SUBSTRING  only run benchmarks whose name contains SUBSTRING\n"
+		<< "  -t SECONDS    minimum time per measurement (default 0.1)\n"
+		<< "  -r COUNT      measurements per benchmark, best is kept (default 3)\n"
+		<< "  -j FILE       write the results as JSON to FILE (- for stdout)\n"
+		<< "  -b FILE       compare against the JSON results in FILE\n"
+		<< "  -p PERCENT    slowdown against the baseline counted as regression (default 10)\n"
+		<< "Exits with 1 if any benchmark regressed.\n";
+}
+
+int main(int argc, char ** argv)
+{
+	std::string filter;
+	std::string jsonPath;
+	std::string baselinePath;
+	double minSeconds = 0.1;
+	size_t repetitions = 3;
+	double threshold = 10.0;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (i + 1 >= argc)
+		{
+			usage(argv[0]);
+			return 2;
+		}
+
+		std::string value = argv[++i];
+		if (arg == "-f")
+		{
+			filter = value;
+		}
+		else if (arg == "-t")
+		{
+			minSeconds = std::atof(value.c_str());
+		}
+		else if (arg == "-r")
+		{
+			repetitions = std::max(std::atoi(value.c_str()), 1);
+		}
+		else if (arg == "-j")
+		{
+			jsonPath = value;
+		}
+		else if (arg == "-b")
+		{
+			baselinePath = value;
+		}
+		else if (arg == "-p")
+		{
+			threshold = std::atof(value.c_str());
+		}
+		else
+		{
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	std::map<std::string, double> baseline;
+	if (!baselinePath.empty() && !readBaseline(baselinePath, &baseline))
+	{
+		std::cerr << "Cannot read baseline " << baselinePath << "." << std::endl;
+		return 2;
+	}
+
+	Fixture fixture;
+	std::vector<Benchmark> benchmarks = buildBenchmarks(&fixture);
+	std::vector<Result> results;
+	bool regressed = false;
+
+	std::ostream & table = (jsonPath == "-") ? std::cerr : std::cout;
+	table << "SHA-1 backend: " << sha1Backend().name << "\n";
+	table << std::left << std::setw(24) << "benchmark" << std::right
+		<< std::setw(12) << "ns/op" << std::setw(12) << "cycles/B" << std::setw(14) << "codes/s/core";
+	if (!baseline.empty())
+	{
+		table << std::setw(12) << "vs. base";
+	}
+	table << std::endl;
+
+	for (const Benchmark & bench : benchmarks)
+	{
+		if (bench.name.find(filter) == std::string::npos)
+		{
+			continue;
+		}
+
+		Result result = measure(bench, minSeconds, repetitions);
+		results.push_back(result);
+
+		table << std::left << std::setw(24) << result.name << std::right << std::fixed
+			<< std::setw(12) << std::setprecision(1) << result.nsPerOp
+			<< std::setw(12) << std::setprecision(2) << result.cyclesPerByte
+			<< std::setw(14) << std::setprecision(0) << result.codesPerSecond;
+
+		auto base = baseline.find(result.name);
+		if (base != baseline.end() && base->second > 0.0)
+		{
+			double change = 100.0 * (result.nsPerOp / base->second - 1.0);
+			bool slower = change > threshold;
+			regressed = regressed || slower;
+			table << std::setw(11) << std::setprecision(1) << std::showpos << change << "%" << std::noshowpos
+				<< (slower ? "  REGRESSION" : "");
+		}
+		table << std::endl;
+	}
+
+	if (!jsonPath.empty())
+	{
+		if (jsonPath == "-")
+		{
+			writeJson(std::cout, results);
+		}
+		else
+		{
+			std::ofstream out(jsonPath);
+			writeJson(out, results);
+			if (!out)
+			{
+				std::cerr << "Cannot write " << jsonPath << "." << std::endl;
+				return 2;
+			}
+		}
+	}
+
+	return regressed ? 1 : 0;
+}
@@ -0,0 +1,188 @@
+/**
+ * @file cppotp_compact.cpp
+ *
+ * @brief Converts a text list of accounts into a binary secrets file.
+ *
+ * Each non-empty line of the input that does not start with '#' describes one
+ * account:
+ *
+ *     <account ID> <Base32 secret> [totp|hotp] [digits] [step|counter] [start]
+ *
+ * The defaults are TOTP, six digits, a time step of 30 seconds and a start
+ * time of 0; for HOTP, the fifth field is the next expected counter (default
+ * 0).
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#include "libcppotp/bytes.h"
+#include "libcppotp/secretsfile.h"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#include <cstdio>
+#include <cstdlib>
+
+using namespace CppTotp;
+
+static uint64_t parseUnsigned(const std::string & str, const char * what)
+{
+	char * end = nullptr;
+	unsigned long long value = std::strtoull(str.c_str(), &end, 10);
+	if (str.empty() || str[0] == '-' || *end != '\0')
+	{
+		throw std::invalid_argument(std::string("invalid ") + what + ": " + str);
+	}
+	return static_cast<uint64_t>(value);
+}
+
+static SecretsFileEntry parseLine(const std::string & line)
+{
+	std::istringstream fields(line);
+	std::string idStr, secretStr, kindStr, digitsStr, stepStr, startStr;
+
+	fields >> idStr >> secretStr >> kindStr >> digitsStr >> stepStr >> startStr;
+	if (secretStr.empty())
+	{
+		throw std::invalid_argument("expected at least an account ID and a secret");
+	}
+
+	SecretsFileEntry entry;
+	entry.accountId = parseUnsigned(idStr, "account ID");
+	entry.params.kind = OtpKind::Totp;
+	entry.params.digits = 6;
+	entry.params.timeStep = 30;
+	entry.params.timeStart = 0;
+	entry.params.counter = 0;
+
+	if (kindStr == "hotp")
+	{
+		entry.params.kind = OtpKind::Hotp;
+		entry.params.timeStep = 0;
+	}
+	else if (!kindStr.empty() && kindStr != "totp")
+	{
+		throw std::invalid_argument("unknown kind: " + kindStr);
+	}
+
+	if (!digitsStr.empty())
+	{
+		uint64_t digits = parseUnsigned(digitsStr, "digit count");
+		if (digits < 1 || digits > 9)
+		{
+			throw std::invalid_argument("digit count must be between 1 and 9");
+		}
+		entry.params.digits = static_cast<uint8_t>(digits);
+	}
+
+	if (!stepStr.empty())
+	{
+		if (entry.params.kind == OtpKind::Hotp)
+		{
+			entry.params.counter = parseUnsigned(stepStr, "counter");
+		}
+		else
+		{
+			uint64_t step = parseUnsigned(stepStr, "time step");
+			if (step == 0 || step > 0xFFFFFFFFu)
+			{
+				throw std::invalid_argument("invalid time step: " + stepStr);
+			}
+			entry.params.timeStep = static_cast<uint32_t>(step);
+		}
+	}
+
+	if (!startStr.empty())
+	{
+		entry.params.timeStart = parseUnsigned(startStr, "start time");
+	}
+
+	Bytes::ByteString secret = Bytes::fromUnpaddedBase32(Bytes::normalizedBase32String(secretStr));
+	Bytes::ByteStringDestructor secretDestructor(&secret);
+	entry.key = HmacSha1Key(secret);
+
+	return entry;
+}
+
+static int readEntries(std::istream & input, const std::string & inputName, std::vector<SecretsFileEntry> * entries)
+{
+	std::string line;
+	size_t lineNumber = 0;
+	int ret = 0;
+
+	while (std::getline(input, line))
+	{
+		++lineNumber;
+
+		size_t first = line.find_first_not_of(" \t\r");
+		if (first == std::string::npos || line[first] == '#')
+		{
+			continue;
+		}
+
+		try
+		{
+			entries->push_back(parseLine(line));
+		}
+		catch (const std::invalid_argument & ex)
+		{
+			std::cerr << inputName << ":" << lineNumber << ": " << ex.what() << std::endl;
+			ret = 1;
+		}
+	}
+
+	return ret;
+}
+
+int main(int argc, char ** argv)
+{
+	if (argc != 3)
+	{
+		std::cerr << "Usage: " << argv[0] << " INPUT OUTPUT" << std::endl;
+		std::cerr << "Use - as INPUT to read from standard input." << std::endl;
+		return 2;
+	}
+
+	const std::string inputName = argv[1];
+	const std::string outputName = argv[2];
+	std::vector<SecretsFileEntry> entries;
+	int ret;
+
+	if (inputName == "-")
+	{
+		ret = readEntries(std::cin, "<stdin>", &entries);
+	}
+	else
+	{
+		std::ifstream input(inputName);
+		if (!input)
+		{
+			std::cerr << "Cannot open " << inputName << "." << std::endl;
+			return 1;
+		}
+		ret = readEntries(input, inputName, &entries);
+	}
+
+	if (ret != 0)
+	{
+		std::cerr << "Not writing " << outputName << " due to errors." << std::endl;
+		return ret;
+	}
+
+	try
+	{
+		SecretsFile::write(outputName, &entries);
+	}
+	catch (const std::exception & ex)
+	{
+		std::cerr << ex.what() << std::endl;
+		return 1;
+	}
+
+	std::cerr << "Wrote " << entries.size() << " accounts to " << outputName << "." << std::endl;
+	return 0;
+}
@@ -0,0 +1,712 @@
+/**
+ * @file cppotpd.cpp
+ *
+ * @brief Daemon verifying and generating one-time passwords on a Unix domain
+ * socket.
+ *
+ * The accounts are loaded from a secrets file once. A single thread runs the
+ * event loop; all requests read in one iteration form a batch, which is split
+ * among a fixed pool of workers, each hashing its share in SIMD lanes.
+ *
+ * @see cppotpd.h for the wire format.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#include "cppotpd.h"
+#include "libcppotp/attemptlimiter.h"
+#include "libcppotp/consttime.h"
+#include "libcppotp/counterlog.h"
+#include "libcppotp/credstore.h"
+#include "libcppotp/replaytable.h"
+#include "libcppotp/secretsfile.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace CppTotp;
+using namespace CppTotp::Daemon;
+
+/** Batches smaller than this are not worth waking up the workers for. */
+static const size_t MinJobsPerWorker = 64;
+
+/** Checkpoint the counter log once it holds this many records. */
+static const uint64_t CheckpointRecords = 1 << 20;
+
+/** Stop reading from a client that has this many response bytes pending. */
+static const size_t MaxPendingOutput = 1024 * 1024;
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void requestStop(int)
+{
+	stopRequested = 1;
+}
+
+/** A fixed set of threads that run the same task on their share of a batch. */
+class WorkerPool
+{
+private:
+	std::vector<std::thread> m_threads;
+	std::mutex m_mutex;
+	std::condition_variable m_start;
+	std::condition_variable m_done;
+	std::function<void(size_t, size_t)> m_task;
+	uint64_t m_generation;
+	size_t m_active;
+	size_t m_pending;
+	bool m_stop;
+
+	void work(size_t worker)
+	{
+		uint64_t seen = 0;
+		for (;;)
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_start.wait(lock, [&]() { return m_stop || m_generation != seen; });
+			if (m_stop)
+			{
+				return;
+			}
+			seen = m_generation;
+			const size_t active = m_active;
+			lock.unlock();
+
+			if (worker < active)
+			{
+				m_task(worker, active);
+			}
+
+			lock.lock();
+			if (--m_pending == 0)
+			{
+				m_done.notify_one();
+			}
+		}
+	}
+
+public:
+	/** Starts the given number of threads in addition to the caller's. */
+	explicit WorkerPool(size_t extraThreads)
+		: m_generation(0), m_active(0), m_pending(0), m_stop(false)
+	{
+		for (size_t i = 0; i < extraThreads; ++i)
+		{
+			m_threads.emplace_back(&WorkerPool::work, this, i + 1);
+		}
+	}
+
+	~WorkerPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_start.notify_all();
+		for (std::thread & thread : m_threads)
+		{
+			thread.join();
+		}
+	}
+
+	/** The number of threads, including the caller's. */
+	size_t size() const { return m_threads.size() + 1; }
+
+	/**
+	 * Runs task(worker, workerCount) on the given number of workers (the
+	 * calling thread being worker 0) and waits for all of them.
+	 */
+	void run(size_t workerCount, const std::function<void(size_t, size_t)> & task)
+	{
+		if (workerCount > 1)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_task = task;
+			m_active = workerCount;
+			m_pending = m_threads.size();
+			++m_generation;
+		}
+		if (workerCount > 1)
+		{
+			m_start.notify_all();
+		}
+
+		task(0, workerCount);
+
+		if (workerCount > 1)
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_done.wait(lock, [&]() { return m_pending == 0; });
+		}
+	}
+};
+
+/** A client connection. */
+struct Connection
+{
+	int fd;
+	uint32_t events;
+
+	/** The client has hung up; close once all responses are out. */
+	bool closing;
+
+	/** The connection is broken; close right away. */
+	bool failed;
+	std::vector<uint8_t> input;
+	std::vector<uint8_t> output;
+};
+
+/** A request of the current batch. */
+struct Job
+{
+	Connection * connection;
+	Request request;
+	Response response;
+
+	/** The account's index in the store. */
+	size_t index;
+
+	/** The range of this job's candidates in the worker's lanes. */
+	size_t firstCandidate;
+	size_t candidateCount;
+};
+
+/** Per-worker buffers, reused across batches. */
+struct Scratch
+{
+	std::vector<size_t> indices;
+	std::vector<uint64_t> counters;
+	std::vector<int64_t> offsets;
+	std::vector<uint32_t> codes;
+};
+
+/** Everything the workers need. */
+struct Context
+{
+	CredentialStore * store;
+	ReplayTable * replay;
+	AttemptLimiter * limiter;
+
+	/** Persists accepted counters and steps; may be null. */
+	CounterLog * log;
+};
+
+static void addCandidate(Scratch * scratch, size_t index, uint64_t counter, int64_t offset)
+{
+	scratch->indices.push_back(index);
+	scratch->counters.push_back(counter);
+	scratch->offsets.push_back(offset);
+}
+
+/** Processes a share of the batch: looks everything up, then hashes it all at once. */
+static void processJobs(const Context & context, Job * jobs, size_t count, Scratch * scratch, uint64_t now)
+{
+	scratch->indices.clear();
+	scratch->counters.clear();
+	scratch->offsets.clear();
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		Job & job = jobs[i];
+		const Request & request = job.request;
+		Response & response = job.response;
+
+		response.status = Status::BadRequest;
+		response.code = 0;
+		response.value = 0;
+		job.candidateCount = 0;
+
+		job.index = context.store->find(request.accountId);
+		if (job.index == CredentialStore::NotFound)
+		{
+			response.status = Status::UnknownAccount;
+			continue;
+		}
+
+		const CredentialParams params = context.store->params(job.index);
+
+		// refuse guesses before hashing anything; the bucket runs on our clock
+		const bool verify =
+			(request.operation == Operation::VerifyTotp && params.kind == OtpKind::Totp) ||
+			(request.operation == Operation::VerifyHotp && params.kind == OtpKind::Hotp)
+		;
+		if (verify && !context.limiter->tryAcquire(job.index, now))
+		{
+			response.status = Status::Throttled;
+			continue;
+		}
+
+		const size_t window = std::min(request.window, MaxWindow);
+		job.firstCandidate = scratch->indices.size();
+
+		if (request.operation == Operation::Generate)
+		{
+			// only generating may name a time; verification runs on our clock
+			const uint64_t timeNow = (request.time != 0) ? request.time : now;
+			uint64_t counter = (params.kind == OtpKind::Totp)
+				? (timeNow - params.timeStart) / params.timeStep
+				: request.time
+			;
+			addCandidate(scratch, job.index, counter, 0);
+			job.candidateCount = 1;
+		}
+		else if (request.operation == Operation::VerifyTotp && params.kind == OtpKind::Totp)
+		{
+			const uint64_t step = (now - params.timeStart) / params.timeStep;
+
+			// in order of preference: 0, -1, +1, -2, +2, ...
+			for (size_t j = 0; j < 2*window + 1; ++j)
+			{
+				int64_t distance = static_cast<int64_t>((j + 1) / 2);
+				int64_t offset = (j % 2 == 1) ? -distance : distance;
+				if (offset < 0 && step < static_cast<uint64_t>(-offset))
+				{
+					continue;
+				}
+				addCandidate(scratch, job.index, step + static_cast<uint64_t>(offset), offset);
+				++job.candidateCount;
+			}
+		}
+		else if (request.operation == Operation::VerifyHotp && params.kind == OtpKind::Hotp)
+		{
+			// advances the counter atomically, so it is done right here
+			uint64_t matchedCounter = 0;
+			bool valid = context.store->verifyHotp(job.index, request.code, window, &matchedCounter);
+			response.status = valid ? Status::Ok : Status::Invalid;
+			response.value = valid ? matchedCounter : 0;
+			if (valid)
+			{
+				context.limiter->refund(job.index);
+				if (context.log != nullptr)
+				{
+					context.log->logHotpCounter(request.accountId, matchedCounter + 1);
+				}
+			}
+		}
+	}
+
+	const size_t candidates = scratch->indices.size();
+	scratch->codes.resize(candidates);
+	if (candidates > 0)
+	{
+		context.store->generateMany(scratch->indices.data(), scratch->counters.data(), candidates, scratch->codes.data());
+	}
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		Job & job = jobs[i];
+		if (job.candidateCount == 0)
+		{
+			continue;
+		}
+
+		if (job.request.operation == Operation::Generate)
+		{
+			job.response.status = Status::Ok;
+			job.response.code = scratch->codes[job.firstCandidate];
+			continue;
+		}
+
+		// take the first match without exiting early
+		uint32_t found = 0;
+		size_t foundCandidate = 0;
+		for (size_t c = job.firstCandidate; c < job.firstCandidate + job.candidateCount; ++c)
+		{
+			uint32_t take = ctEqual(scratch->codes[c], job.request.code) & (found ^ 1u);
+			foundCandidate |= (0 - static_cast<size_t>(take)) & c;
+			found |= take;
+		}
+
+		if (found && context.replay->tryAdvance(job.index, scratch->counters[foundCandidate]))
+		{
+			job.response.status = Status::Ok;
+			job.response.value = static_cast<uint64_t>(scratch->offsets[foundCandidate]);
+			context.limiter->refund(job.index);
+			if (context.log != nullptr)
+			{
+				context.log->logTotpStep(job.request.accountId, scratch->counters[foundCandidate]);
+			}
+		}
+		else
+		{
+			job.response.status = Status::Invalid;
+		}
+	}
+
+	Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(scratch->codes.data()), candidates * sizeof(uint32_t));
+}
+
+/** Sets the epoll interest of the connection according to its buffers. */
+static void updateInterest(int epollFd, Connection * connection)
+{
+	uint32_t events = 0;
+	if (!connection->closing && connection->output.size() < MaxPendingOutput)
+	{
+		events |= EPOLLIN;
+	}
+	if (!connection->output.empty())
+	{
+		events |= EPOLLOUT;
+	}
+
+	if (events != connection->events)
+	{
+		struct epoll_event ev;
+		ev.events = events;
+		ev.data.ptr = connection;
+		epoll_ctl(epollFd, EPOLL_CTL_MOD, connection->fd, &ev);
+		connection->events = events;
+	}
+}
+
+/** Reads everything available; returns false if the connection failed. */
+static bool readInput(Connection * connection)
+{
+	uint8_t buffer[64 * 1024];
+	for (;;)
+	{
+		ssize_t got = recv(connection->fd, buffer, sizeof(buffer), 0);
+		if (got > 0)
+		{
+			connection->input.insert(connection->input.end(), buffer, buffer + got);
+			if (static_cast<size_t>(got) < sizeof(buffer))
+			{
+				return true;
+			}
+		}
+		else if (got == 0)
+		{
+			connection->closing = true;
+			return true;
+		}
+		else if (errno == EINTR)
+		{
+			continue;
+		}
+		else
+		{
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+	}
+}
+
+/** Writes as much as possible; returns false if the connection failed. */
+static bool writeOutput(Connection * connection)
+{
+	size_t sent = 0;
+	while (sent < connection->output.size())
+	{
+		ssize_t put = send(connection->fd, connection->output.data() + sent, connection->output.size() - sent, MSG_NOSIGNAL);
+		if (put >= 0)
+		{
+			sent += static_cast<size_t>(put);
+		}
+		else if (errno == EINTR)
+		{
+			continue;
+		}
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			break;
+		}
+		else
+		{
+			return false;
+		}
+	}
+	connection->output.erase(connection->output.begin(), connection->output.begin() + sent);
+	return true;
+}
+
+static int listenOn(const std::string & path)
+{
+	struct sockaddr_un addr;
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path))
+	{
+		std::cerr << "Socket path too long: " << path << std::endl;
+		return -1;
+	}
+	std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+	{
+		std::cerr << "Cannot create socket: " << std::strerror(errno) << std::endl;
+		return -1;
+	}
+
+	unlink(path.c_str());
+	if (bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0)
+	{
+		std::cerr << "Cannot listen on " << path << ": " << std::strerror(errno) << std::endl;
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void usage(const char * argv0)
+{
+	std::cerr << "Usage: " << argv0 << " [-t THREADS] [-b ATTEMPTS] [-i SECONDS] [-w DIRECTORY] SECRETS SOCKET" << std::endl;
+}
+
+int main(int argc, char ** argv)
+{
+	size_t threadCount = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+	uint64_t attemptBurst = 10;
+	uint64_t attemptInterval = 30;
+	std::string logDirectory;
+	int opt;
+	while ((opt = getopt(argc, argv, "t:b:i:w:")) != -1)
+	{
+		if (opt == 't' && std::atoi(optarg) > 0)
+		{
+			threadCount = static_cast<size_t>(std::atoi(optarg));
+		}
+		else if (opt == 'b' && std::atoi(optarg) > 0)
+		{
+			attemptBurst = static_cast<uint64_t>(std::atoi(optarg));
+		}
+		else if (opt == 'i' && std::atoi(optarg) > 0)
+		{
+			attemptInterval = static_cast<uint64_t>(std::atoi(optarg));
+		}
+		else if (opt == 'w')
+		{
+			logDirectory = optarg;
+		}
+		else
+		{
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (argc - optind != 2)
+	{
+		usage(argv[0]);
+		return 2;
+	}
+	const std::string secretsPath = argv[optind];
+	const std::string socketPath = argv[optind + 1];
+
+	std::unique_ptr<CredentialStore> store;
+	std::unique_ptr<ReplayTable> replay;
+	std::unique_ptr<CounterLog> log;
+	try
+	{
+		SecretsFile secrets(secretsPath);
+		store.reset(new CredentialStore(secrets.size()));
+		secrets.loadInto(store.get());
+		replay.reset(new ReplayTable(store->size()));
+
+		// pick up where the last run left off
+		if (!logDirectory.empty())
+		{
+			log.reset(new CounterLog(logDirectory));
+			log->restore(store.get(), replay.get());
+		}
+	}
+	catch (const std::exception & ex)
+	{
+		std::cerr << ex.what() << std::endl;
+		return 1;
+	}
+	AttemptLimiter limiter(store->size(), attemptBurst, attemptInterval);
+	const Context context = { store.get(), replay.get(), &limiter, log.get() };
+
+	int listenFd = listenOn(socketPath);
+	if (listenFd == -1)
+	{
+		return 1;
+	}
+
+	int epollFd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event listenEvent;
+	listenEvent.events = EPOLLIN;
+	listenEvent.data.ptr = nullptr;
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &listenEvent);
+
+	struct sigaction sa;
+	std::memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = requestStop;
+	sigaction(SIGINT, &sa, nullptr);
+	sigaction(SIGTERM, &sa, nullptr);
+
+	std::cerr << "Serving " << store->size() << " accounts on " << socketPath
+		<< " with " << threadCount << " threads." << std::endl;
+
+	WorkerPool pool(threadCount - 1);
+	std::vector<Scratch> scratches(pool.size());
+	std::unordered_map<int, std::unique_ptr<Connection> > connections;
+	std::vector<Connection *> readable;
+	std::vector<Job> jobs;
+	struct epoll_event events[256];
+
+	while (!stopRequested)
+	{
+		int eventCount = epoll_wait(epollFd, events, 256, -1);
+		if (eventCount < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			std::cerr << "epoll_wait failed: " << std::strerror(errno) << std::endl;
+			break;
+		}
+
+		readable.clear();
+		jobs.clear();
+
+		for (int e = 0; e < eventCount; ++e)
+		{
+			Connection * connection = static_cast<Connection *>(events[e].data.ptr);
+			if (connection == nullptr)
+			{
+				// new clients
+				int fd;
+				while ((fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+				{
+					std::unique_ptr<Connection> client(new Connection());
+					client->fd = fd;
+					client->events = EPOLLIN;
+					client->closing = false;
+					client->failed = false;
+
+					struct epoll_event ev;
+					ev.events = EPOLLIN;
+					ev.data.ptr = client.get();
+					epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+					connections[fd] = std::move(client);
+				}
+				continue;
+			}
+
+			bool ok = true;
+			if (events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+			{
+				ok = readInput(connection);
+			}
+			if (ok && (events[e].events & EPOLLOUT))
+			{
+				ok = writeOutput(connection);
+			}
+			connection->failed = !ok;
+			readable.push_back(connection);
+		}
+
+		// gather the complete requests of this iteration into one batch
+		for (Connection * connection : readable)
+		{
+			size_t complete = connection->input.size() / RequestSize * RequestSize;
+			for (size_t pos = 0; pos < complete; pos += RequestSize)
+			{
+				Job job;
+				job.connection = connection;
+				job.request = decodeRequest(&connection->input[pos]);
+				jobs.push_back(job);
+			}
+			connection->input.erase(connection->input.begin(), connection->input.begin() + complete);
+		}
+
+		if (!jobs.empty())
+		{
+			const uint64_t now = static_cast<uint64_t>(time(nullptr));
+			const size_t workers = std::min(pool.size(), std::max<size_t>(jobs.size() / MinJobsPerWorker, 1));
+
+			pool.run(workers, [&](size_t worker, size_t workerCount)
+			{
+				size_t first = jobs.size() * worker / workerCount;
+				size_t last = jobs.size() * (worker + 1) / workerCount;
+				processJobs(context, jobs.data() + first, last - first, &scratches[worker], now);
+			});
+
+			// one sync commits the counters and steps accepted in the whole batch
+			if (log)
+			{
+				try
+				{
+					log->syncAll();
+				}
+				catch (const std::exception & ex)
+				{
+					std::cerr << ex.what() << std::endl;
+					break;
+				}
+			}
+
+			// jobs are in arrival order, so responses are too
+			for (const Job & job : jobs)
+			{
+				uint8_t frame[ResponseSize];
+				encodeResponse(job.response, frame);
+				job.connection->output.insert(job.connection->output.end(), frame, frame + ResponseSize);
+			}
+		}
+
+		for (Connection * connection : readable)
+		{
+			if (!connection->failed && !connection->output.empty())
+			{
+				connection->failed = !writeOutput(connection);
+			}
+
+			if (connection->failed || (connection->closing && connection->output.empty()))
+			{
+				int fd = connection->fd;
+				epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+				close(fd);
+				connections.erase(fd);
+			}
+			else
+			{
+				updateInterest(epollFd, connection);
+			}
+		}
+
+		// keeps the replay at startup short; the clients have their answers by now
+		if (log && log->stats().logRecords >= CheckpointRecords)
+		{
+			try
+			{
+				log->checkpoint();
+			}
+			catch (const std::exception & ex)
+			{
+				std::cerr << ex.what() << std::endl;
+			}
+		}
+	}
+
+	for (auto & entry : connections)
+	{
+		close(entry.first);
+	}
+	close(epollFd);
+	close(listenFd);
+	unlink(socketPath.c_str());
+
+	return 0;
+}
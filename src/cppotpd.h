@@ -0,0 +1,134 @@
+/**
+ * @file cppotpd.h
+ *
+ * @brief Wire format of the verification daemon.
+ *
+ * Clients connect to the daemon's Unix domain socket and send fixed-size
+ * requests; the daemon answers each with a fixed-size response, in order.
+ * Requests may be pipelined. All integers are little-endian.
+ *
+ * Request (24 bytes):
+ * - operation (u8)
+ * - window (u8): TOTP steps before and after the current one, or HOTP
+ *   look-ahead
+ * - reserved (2 bytes, zero)
+ * - code (u32): the value to verify; ignored when generating
+ * - account ID (u64)
+ * - time (u64): when generating, the Unix time for TOTP (0 = the daemon's
+ *   clock) or the HOTP counter; ignored when verifying, which always runs on
+ *   the daemon's clock
+ *
+ * Response (16 bytes):
+ * - status (u8)
+ * - reserved (3 bytes, zero)
+ * - code (u32): the generated value
+ * - value (u64): the matched TOTP offset (two's complement) or HOTP counter
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#ifndef __CPPTOTP_CPPOTPD_H__
+#define __CPPTOTP_CPPOTPD_H__
+
+#include "libcppotp/bytes.h"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace CppTotp
+{
+namespace Daemon
+{
+
+const size_t RequestSize = 24;
+const size_t ResponseSize = 16;
+
+/** The largest accepted TOTP window or HOTP look-ahead. */
+const uint8_t MaxWindow = 16;
+
+enum class Operation : uint8_t
+{
+	VerifyTotp = 1,
+	VerifyHotp = 2,
+	Generate = 3,
+};
+
+enum class Status : uint8_t
+{
+	/** Verified or generated. */
+	Ok = 0,
+
+	/** The value is wrong or has already been used. */
+	Invalid = 1,
+
+	UnknownAccount = 2,
+
+	/** Unknown operation or an operation unsuitable for the account. */
+	BadRequest = 3,
+
+	/** Too many failed attempts for the account; try again later. */
+	Throttled = 4,
+};
+
+struct Request
+{
+	Operation operation;
+	uint8_t window;
+	uint32_t code;
+	uint64_t accountId;
+	uint64_t time;
+};
+
+struct Response
+{
+	Status status;
+	uint32_t code;
+	uint64_t value;
+};
+
+inline void encodeRequest(const Request & request, uint8_t out[RequestSize])
+{
+	out[0] = static_cast<uint8_t>(request.operation);
+	out[1] = request.window;
+	out[2] = 0;
+	out[3] = 0;
+	Bytes::u32leToBytes(request.code, out + 4);
+	Bytes::u64leToBytes(request.accountId, out + 8);
+	Bytes::u64leToBytes(request.time, out + 16);
+}
+
+inline Request decodeRequest(const uint8_t in[RequestSize])
+{
+	Request ret;
+	ret.operation = static_cast<Operation>(in[0]);
+	ret.window = in[1];
+	ret.code = Bytes::u32leFromBytes(in + 4);
+	ret.accountId = Bytes::u64leFromBytes(in + 8);
+	ret.time = Bytes::u64leFromBytes(in + 16);
+	return ret;
+}
+
+inline void encodeResponse(const Response & response, uint8_t out[ResponseSize])
+{
+	out[0] = static_cast<uint8_t>(response.status);
+	out[1] = 0;
+	out[2] = 0;
+	out[3] = 0;
+	Bytes::u32leToBytes(response.code, out + 4);
+	Bytes::u64leToBytes(response.value, out + 8);
+}
+
+inline Response decodeResponse(const uint8_t in[ResponseSize])
+{
+	Response ret;
+	ret.status = static_cast<Status>(in[0]);
+	ret.code = Bytes::u32leFromBytes(in + 4);
+	ret.value = Bytes::u64leFromBytes(in + 8);
+	return ret;
+}
+
+}
+}
+
+#endif
@@ -12,7 +12,6 @@
 
 #include <iostream>
 
-#include <cctype>
 #include <cstdio>
 #include <unistd.h>
 
@@ -78,31 +77,6 @@ static int pwfromtty(std::string * inHere, const std::string & prompt = "Passwor
 	return 0;
 }
 
-std::string normalizedBase32String(const std::string & unnorm)
-{
-	std::string ret;
-
-	for (char c : unnorm)
-	{
-		if (c == ' ' || c == '\n' || c == '-')
-		{
-			// skip separators
-		}
-		else if (std::islower(c))
-		{
-			// make uppercase
-			char u = std::toupper(c);
-			ret.push_back(u);
-		}
-		else
-		{
-			ret.push_back(c);
-		}
-	}
-
-	return ret;
-}
-
 int main(void)
 {
 	// read the key
@@ -118,7 +92,7 @@ int main(void)
 		std::getline(std::cin, key);
 	}
 
-	std::string normalizedKey = normalizedBase32String(key);
+	std::string normalizedKey = Bytes::normalizedBase32String(key);
 	Bytes::ByteString qui = Bytes::fromUnpaddedBase32(normalizedKey);
 
 	while (1)
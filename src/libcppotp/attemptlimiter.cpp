@@ -0,0 +1,225 @@
+/**
+ * @file attemptlimiter.cpp
+ *
+ * @brief Implementation of the attempt limiter.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#include "attemptlimiter.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <new>
+#include <stdexcept>
+
+namespace CppTotp
+{
+
+AttemptLimiter::AttemptLimiter(size_t size, uint64_t burst, uint64_t refillInterval)
+	: m_full(nullptr), m_size(size), m_burst(burst), m_interval(refillInterval), m_stripes(nullptr)
+{
+	if (burst == 0 || refillInterval == 0)
+	{
+		throw std::invalid_argument("attempt limiter burst and interval must not be 0");
+	}
+
+	// over-allocate to be able to align the start
+	m_stripeMemory.reset(new uint8_t[(StripeCount + 1) * sizeof(StatStripe)]);
+	uintptr_t start = reinterpret_cast<uintptr_t>(m_stripeMemory.get());
+	m_stripes = reinterpret_cast<StatStripe *>((start + alignof(StatStripe) - 1) / alignof(StatStripe) * alignof(StatStripe));
+	for (size_t i = 0; i < StripeCount; ++i)
+	{
+		StatStripe * s = new (&m_stripes[i]) StatStripe();
+		s->allowed.store(0, std::memory_order_relaxed);
+		s->rejected.store(0, std::memory_order_relaxed);
+		s->refunded.store(0, std::memory_order_relaxed);
+	}
+
+	m_full = new std::atomic<uint64_t>[size];
+	for (size_t i = 0; i < size; ++i)
+	{
+		m_full[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+AttemptLimiter::~AttemptLimiter()
+{
+	delete[] m_full;
+}
+
+bool AttemptLimiter::tryAcquire(size_t index, uint64_t timeNow)
+{
+	const uint64_t limit = timeNow + m_burst * m_interval;
+	uint64_t full = m_full[index].load(std::memory_order_relaxed);
+
+	// on failure, full is reloaded; a bucket emptied meanwhile refuses, too
+	for (;;)
+	{
+		const uint64_t next = std::max(full, timeNow) + m_interval;
+		if (next > limit)
+		{
+			stripe(index).rejected.fetch_add(1, std::memory_order_relaxed);
+			CPPTOTP_METRIC_ADD(Throttled, 1);
+			CPPTOTP_PROBE1(throttle, index);
+			return false;
+		}
+		if (m_full[index].compare_exchange_weak(full, next, std::memory_order_relaxed))
+		{
+			stripe(index).allowed.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+	}
+}
+
+void AttemptLimiter::refund(size_t index)
+{
+	uint64_t full = m_full[index].load(std::memory_order_relaxed);
+	uint64_t next;
+	do
+	{
+		next = (full > m_interval) ? full - m_interval : 0;
+	}
+	while (!m_full[index].compare_exchange_weak(full, next, std::memory_order_relaxed));
+
+	stripe(index).refunded.fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t AttemptLimiter::available(size_t index, uint64_t timeNow) const
+{
+	const uint64_t full = std::max(m_full[index].load(std::memory_order_relaxed), timeNow);
+	return (timeNow + m_burst * m_interval - full) / m_interval;
+}
+
+void AttemptLimiter::reset(size_t index)
+{
+	m_full[index].store(0, std::memory_order_relaxed);
+}
+
+AttemptLimiterStats AttemptLimiter::stats() const
+{
+	AttemptLimiterStats ret = { 0, 0, 0 };
+	for (size_t i = 0; i < StripeCount; ++i)
+	{
+		ret.allowed += m_stripes[i].allowed.load(std::memory_order_relaxed);
+		ret.rejected += m_stripes[i].rejected.load(std::memory_order_relaxed);
+		ret.refunded += m_stripes[i].refunded.load(std::memory_order_relaxed);
+	}
+	return ret;
+}
+
+bool verifyTotpLimited(
+	const CredentialStore & store, AttemptLimiter * limiter, size_t index,
+	uint32_t code, uint64_t timeNow, size_t window, int64_t * matchedOffset
+)
+{
+	if (!limiter->tryAcquire(index, timeNow))
+	{
+		return false;
+	}
+
+	if (!store.verifyTotp(index, code, timeNow, window, matchedOffset))
+	{
+		return false;
+	}
+
+	limiter->refund(index);
+	return true;
+}
+
+bool verifyHotpLimited(
+	CredentialStore * store, AttemptLimiter * limiter, size_t index,
+	uint32_t code, uint64_t timeNow, size_t lookAhead, uint64_t * matchedCounter
+)
+{
+	if (!limiter->tryAcquire(index, timeNow))
+	{
+		return false;
+	}
+
+	if (!store->verifyHotp(index, code, lookAhead, matchedCounter))
+	{
+		return false;
+	}
+
+	limiter->refund(index);
+	return true;
+}
+
+}
+
+#if TEST_ATTEMPTLIMITER
+#include <iostream>
+#include <thread>
+#include <vector>
+
+int main(void)
+{
+	using namespace CppTotp;
+
+	const Bytes::ByteString key = reinterpret_cast<const uint8_t *>("12345678901234567890");
+	CredentialStore store(2);
+	size_t totpIndex = store.add(1, HmacSha1Key(key), { OtpKind::Totp, 8, 30, 0, 0 });
+	size_t hotpIndex = store.add(2, HmacSha1Key(key), { OtpKind::Hotp, 6, 0, 0, 0 });
+	const uint64_t timeNow = 1111111109;
+
+	AttemptLimiter limiter(2, 3, 30);
+
+	// valid values are refunded and never run out...
+	bool valid = true;
+	for (size_t i = 0; i < 10; ++i)
+	{
+		valid = valid && verifyTotpLimited(store, &limiter, totpIndex, 7081804, timeNow);
+	}
+	uint64_t afterValid = limiter.available(totpIndex, timeNow);
+
+	// ...but a burst of wrong ones does, even for the right value afterwards
+	bool wrong = !verifyTotpLimited(store, &limiter, totpIndex, 1, timeNow)
+		&& !verifyTotpLimited(store, &limiter, totpIndex, 2, timeNow)
+		&& !verifyTotpLimited(store, &limiter, totpIndex, 3, timeNow);
+	bool throttled = !verifyTotpLimited(store, &limiter, totpIndex, 7081804, timeNow);
+	AttemptLimiterStats stats = limiter.stats();
+
+	// one attempt comes back per interval, up to the burst
+	bool refilled = limiter.available(totpIndex, timeNow + 29) == 0
+		&& limiter.available(totpIndex, timeNow + 30) == 1
+		&& limiter.available(totpIndex, timeNow + 3000) == 3
+		&& verifyTotpLimited(store, &limiter, totpIndex, 14050471, timeNow + 30);
+
+	// HOTP, with its own bucket
+	bool hotpValid = verifyHotpLimited(&store, &limiter, hotpIndex, 755224, timeNow)
+		&& limiter.available(hotpIndex, timeNow) == 3;
+	limiter.reset(totpIndex);
+	bool reset = limiter.available(totpIndex, timeNow) == 3;
+
+	// many threads never get more than the burst out of one bucket
+	AttemptLimiter shared(1, 100, 1000);
+	std::atomic<uint64_t> acquired(0);
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < 4; ++t)
+	{
+		threads.emplace_back([&shared, &acquired]()
+		{
+			for (size_t i = 0; i < 1000; ++i)
+			{
+				acquired.fetch_add(shared.tryAcquire(0, 5000) ? 1 : 0);
+			}
+		});
+	}
+	for (std::thread & thread : threads)
+	{
+		thread.join();
+	}
+
+	std::cout
+		<< valid << (afterValid == 3)
+		<< wrong << throttled
+		<< (stats.allowed == 13 && stats.rejected == 1 && stats.refunded == 10)
+		<< refilled << hotpValid << reset
+		<< (acquired.load() == 100 && shared.stats().rejected == 3900)
+	<< std::endl;
+
+	return 0;
+}
+#endif
@@ -0,0 +1,139 @@
+/**
+ * @file attemptlimiter.h
+ *
+ * @brief Lock-free per-account limiting of verification attempts.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#ifndef __CPPTOTP_ATTEMPTLIMITER_H__
+#define __CPPTOTP_ATTEMPTLIMITER_H__
+
+#include "credstore.h"
+
+#include <atomic>
+#include <memory>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace CppTotp
+{
+
+/** What an AttemptLimiter has decided so far. */
+struct AttemptLimiterStats
+{
+	/** Attempts let through to verification. */
+	uint64_t allowed;
+
+	/** Attempts rejected without hashing. */
+	uint64_t rejected;
+
+	/** Attempts given back after a successful verification. */
+	uint64_t refunded;
+};
+
+/**
+ * Limits the verification attempts of each account with a token bucket, so
+ * that guessing is throttled before any HMAC is calculated.
+ *
+ * Each account's bucket holds up to a burst of attempts and regains one every
+ * refill interval. The bucket is kept as a single 64-bit word: the time at
+ * which it will be full again (the generic cell rate algorithm). Taking an
+ * attempt moves that time one interval further; an attempt is refused if that
+ * would put it more than a burst of intervals ahead of now. Buckets are
+ * indexed like the CredentialStore and updated with compare-and-swap, so any
+ * number of threads may check attempts at once.
+ *
+ * Times are in seconds and should come from the server's clock; a time
+ * supplied by the client would let it refill its own bucket.
+ */
+class AttemptLimiter
+{
+private:
+	/** The decisions, spread over cache lines by account. */
+	struct alignas(64) StatStripe
+	{
+		std::atomic<uint64_t> allowed;
+		std::atomic<uint64_t> rejected;
+		std::atomic<uint64_t> refunded;
+	};
+
+	static const size_t StripeCount = 16;
+
+	/** The time at which each bucket is full again (0 = full). */
+	std::atomic<uint64_t> * m_full;
+	size_t m_size;
+	uint64_t m_burst;
+	uint64_t m_interval;
+
+	std::unique_ptr<uint8_t[]> m_stripeMemory;
+	StatStripe * m_stripes;
+
+	StatStripe & stripe(size_t index) const { return m_stripes[index % StripeCount]; }
+
+public:
+	/**
+	 * Creates a limiter for the given number of accounts, all of them with a
+	 * full bucket of the given burst of attempts, regaining one every refill
+	 * interval.
+	 *
+	 * @throw std::invalid_argument if the burst or the interval is 0.
+	 */
+	AttemptLimiter(size_t size, uint64_t burst = 5, uint64_t refillInterval = 30);
+	~AttemptLimiter();
+
+	AttemptLimiter(const AttemptLimiter &) = delete;
+	AttemptLimiter & operator=(const AttemptLimiter &) = delete;
+
+	/** The number of accounts. */
+	size_t size() const { return m_size; }
+
+	/**
+	 * Takes an attempt from the bucket of the given account.
+	 *
+	 * @return false if the bucket is empty; nothing is taken then.
+	 */
+	bool tryAcquire(size_t index, uint64_t timeNow);
+
+	/** Gives back an attempt, e.g. after it has turned out to be legitimate. */
+	void refund(size_t index);
+
+	/** The attempts the given account has left right now. */
+	uint64_t available(size_t index, uint64_t timeNow) const;
+
+	/** Fills the bucket of the given account. */
+	void reset(size_t index);
+
+	/** The decisions over all accounts. */
+	AttemptLimiterStats stats() const;
+};
+
+/**
+ * Checks a TOTP value of the account at the given index if its bucket allows
+ * an attempt; attempts with valid values are refunded, so only failures count.
+ *
+ * @return true if the attempt was allowed and the value is valid.
+ * @see CredentialStore::verifyTotp
+ */
+bool verifyTotpLimited(
+	const CredentialStore & store, AttemptLimiter * limiter, size_t index,
+	uint32_t code, uint64_t timeNow, size_t window = 1, int64_t * matchedOffset = nullptr
+);
+
+/**
+ * Checks an HOTP value of the account at the given index if its bucket allows
+ * an attempt at the given time; attempts with valid values are refunded.
+ *
+ * @return true if the attempt was allowed and the value is valid.
+ * @see CredentialStore::verifyHotp
+ */
+bool verifyHotpLimited(
+	CredentialStore * store, AttemptLimiter * limiter, size_t index,
+	uint32_t code, uint64_t timeNow, size_t lookAhead = 0, uint64_t * matchedCounter = nullptr
+);
+
+}
+
+#endif
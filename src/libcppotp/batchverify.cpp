@@ -0,0 +1,300 @@
+/**
+ * @file batchverify.cpp
+ *
+ * @brief Implementation of the parallel batch verifier.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#include "batchverify.h"
+#include "consttime.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <new>
+
+#if defined(__linux__)
+#	include <pthread.h>
+#	include <sched.h>
+#endif
+
+namespace CppTotp
+{
+
+/** Verifies up to Sha1MaxLanes requests, one lane call per window offset. */
+static void verifyChunk(const CredentialStore & store, const VerifyRequest requests[], size_t count, size_t window, VerifyResult results[])
+{
+	size_t indices[Sha1MaxLanes];
+	uint64_t timeValues[Sha1MaxLanes];
+	uint64_t counters[Sha1MaxLanes];
+	uint32_t codes[Sha1MaxLanes];
+	uint32_t usable[Sha1MaxLanes];
+	uint32_t found[Sha1MaxLanes];
+	uint64_t foundOffsets[Sha1MaxLanes];
+
+	for (size_t lane = 0; lane < count; ++lane)
+	{
+		const VerifyRequest & request = requests[lane];
+		const CredentialParams params = store.params(request.index);
+
+		indices[lane] = request.index;
+		usable[lane] = (params.kind == OtpKind::Totp && request.timeNow >= params.timeStart);
+		timeValues[lane] = usable[lane] ? (request.timeNow - params.timeStart) / params.timeStep : 0;
+		found[lane] = 0;
+		foundOffsets[lane] = 0;
+	}
+
+	// in order of preference: 0, -1, +1, -2, +2, ...
+	for (size_t i = 0; i < 2*window + 1; ++i)
+	{
+		int64_t distance = static_cast<int64_t>((i + 1) / 2);
+		int64_t offset = (i % 2 == 1) ? -distance : distance;
+
+		for (size_t lane = 0; lane < count; ++lane)
+		{
+			counters[lane] = timeValues[lane] + static_cast<uint64_t>(offset);
+		}
+		store.generateMany(indices, counters, count, codes);
+
+		for (size_t lane = 0; lane < count; ++lane)
+		{
+			// steps before the epoch (or past the end of time) don't exist
+			uint32_t valid = (offset < 0)
+				? (timeValues[lane] >= static_cast<uint64_t>(-offset))
+				: (counters[lane] >= timeValues[lane])
+			;
+
+			uint32_t take = ctEqual(codes[lane], requests[lane].code) & valid & usable[lane] & (found[lane] ^ 1u);
+			uint64_t mask = 0u - static_cast<uint64_t>(take);
+
+			foundOffsets[lane] |= mask & static_cast<uint64_t>(offset);
+			found[lane] |= take;
+		}
+	}
+
+	for (size_t lane = 0; lane < count; ++lane)
+	{
+		results[lane].matchedOffset = static_cast<int64_t>(foundOffsets[lane]);
+		results[lane].valid = (found[lane] != 0);
+	}
+
+	CPPTOTP_METRIC_ADD(Verifies, count);
+	Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(codes), sizeof(codes));
+}
+
+BatchVerifier::BatchVerifier(size_t threadCount, const std::vector<int> & cpus)
+	: m_shares(nullptr), m_generation(0), m_pending(0), m_stop(false),
+	m_store(nullptr), m_requests(nullptr), m_results(nullptr), m_count(0), m_window(0)
+{
+	if (threadCount == 0)
+	{
+		threadCount = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+	}
+
+	// over-allocate to be able to align the start
+	m_shareMemory.reset(new uint8_t[(threadCount + 1) * sizeof(Share)]);
+	uintptr_t start = reinterpret_cast<uintptr_t>(m_shareMemory.get());
+	m_shares = reinterpret_cast<Share *>((start + alignof(Share) - 1) / alignof(Share) * alignof(Share));
+	for (size_t i = 0; i < threadCount; ++i)
+	{
+		new (&m_shares[i]) Share();
+	}
+
+	for (size_t i = 1; i < threadCount; ++i)
+	{
+		int cpu = cpus.empty() ? -1 : cpus[(i - 1) % cpus.size()];
+		m_threads.emplace_back(&BatchVerifier::run, this, i, cpu);
+	}
+}
+
+BatchVerifier::~BatchVerifier()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_start.notify_all();
+
+	for (std::thread & thread : m_threads)
+	{
+		thread.join();
+	}
+}
+
+void BatchVerifier::run(size_t thread, int cpu)
+{
+#if defined(__linux__)
+	if (cpu >= 0)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+#else
+	(void)cpu;
+#endif
+
+	uint64_t seen = 0;
+	std::unique_lock<std::mutex> lock(m_mutex);
+	for (;;)
+	{
+		m_start.wait(lock, [&]() { return m_stop || m_generation != seen; });
+		if (m_stop)
+		{
+			return;
+		}
+		seen = m_generation;
+		lock.unlock();
+
+		work(thread);
+
+		lock.lock();
+		if (--m_pending == 0)
+		{
+			m_done.notify_one();
+		}
+	}
+}
+
+void BatchVerifier::work(size_t participant)
+{
+	const size_t participants = threadCount();
+
+	// the own share first, then steal from the others in turn
+	for (size_t i = 0; i < participants; ++i)
+	{
+		Share & share = m_shares[(participant + i) % participants];
+		for (;;)
+		{
+			size_t chunk = share.next.fetch_add(1, std::memory_order_relaxed);
+			if (chunk >= share.end)
+			{
+				break;
+			}
+
+			size_t first = chunk * Sha1MaxLanes;
+			size_t count = std::min(m_count - first, Sha1MaxLanes);
+			verifyChunk(*m_store, &m_requests[first], count, m_window, &m_results[first]);
+		}
+	}
+}
+
+void BatchVerifier::verifyBatch(const CredentialStore & store, const VerifyRequest requests[], VerifyResult results[], size_t count, size_t window)
+{
+	std::lock_guard<std::mutex> batchLock(m_batchMutex);
+
+	const size_t chunkCount = (count + Sha1MaxLanes - 1) / Sha1MaxLanes;
+	const size_t participants = threadCount();
+
+	for (size_t i = 0; i < participants; ++i)
+	{
+		m_shares[i].next.store(chunkCount * i / participants, std::memory_order_relaxed);
+		m_shares[i].end = chunkCount * (i + 1) / participants;
+	}
+
+	m_store = &store;
+	m_requests = requests;
+	m_results = results;
+	m_count = count;
+	m_window = window;
+
+	// not worth waking anyone up for a single chunk
+	if (m_threads.empty() || chunkCount <= 1)
+	{
+		m_shares[0].next.store(0, std::memory_order_relaxed);
+		m_shares[0].end = chunkCount;
+		for (size_t i = 1; i < participants; ++i)
+		{
+			m_shares[i].end = 0;
+		}
+		work(0);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_pending = m_threads.size();
+		++m_generation;
+	}
+	m_start.notify_all();
+
+	work(0);
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_done.wait(lock, [this]() { return m_pending == 0; });
+}
+
+}
+
+#if TEST_BATCHVERIFY
+#include "otp.h"
+
+#include <iostream>
+
+int main(void)
+{
+	using namespace CppTotp;
+
+	const Bytes::ByteString key = reinterpret_cast<const uint8_t *>("12345678901234567890");
+	CredentialStore store(1000);
+
+	for (uint64_t i = 0; i < 1000; ++i)
+	{
+		Bytes::ByteString accountKey = key;
+		accountKey[0] = static_cast<Bytes::Byte>(i);
+		CredentialParams params = { (i % 10 == 9) ? OtpKind::Hotp : OtpKind::Totp, static_cast<uint8_t>(6 + i % 3), 30, i % 7, 0 };
+		store.add(i, HmacSha1Key(accountKey), params);
+	}
+
+	// valid values at various offsets, wrong values and times before the start
+	const size_t count = 10007;
+	std::vector<VerifyRequest> requests(count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		VerifyRequest & request = requests[i];
+		request.index = (i * 7919) % 1000;
+		request.timeNow = 1111111109 + 13 * i;
+		if (i % 100 == 0)
+		{
+			request.timeNow = i % 7;
+		}
+
+		const CredentialParams params = store.params(request.index);
+		int64_t shift = static_cast<int64_t>(i % 5) - 2;
+		request.code = (i % 4 == 3) ? 12345 : hotp(store.key(request.index), (request.timeNow - params.timeStart) / 30 + static_cast<uint64_t>(shift), params.digits);
+	}
+
+	bool same = true;
+	size_t validCount = 0;
+	const size_t threadCounts[] = { 1, 3 };
+	for (size_t threads : threadCounts)
+	{
+		BatchVerifier verifier(threads, std::vector<int>(1, 0));
+		std::vector<VerifyResult> results(count);
+		verifier.verifyBatch(store, requests.data(), results.data(), count, 1);
+		verifier.verifyBatch(store, requests.data(), results.data(), 5, 1);
+
+		validCount = 0;
+		for (size_t i = 0; i < count; ++i)
+		{
+			const VerifyRequest & request = requests[i];
+			const CredentialParams params = store.params(request.index);
+			int64_t offset = 0;
+			bool expected = params.kind == OtpKind::Totp && request.timeNow >= params.timeStart
+				&& store.verifyTotp(request.index, request.code, request.timeNow, 1, &offset);
+
+			same = same && results[i].valid == expected && (!expected || results[i].matchedOffset == offset);
+			validCount += expected;
+		}
+	}
+
+	std::cout
+		<< same
+		<< (validCount > count / 3 && validCount < count)
+	<< std::endl;
+
+	return 0;
+}
+#endif
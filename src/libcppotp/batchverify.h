@@ -0,0 +1,123 @@
+/**
+ * @file batchverify.h
+ *
+ * @brief Parallel verification of large batches of TOTP values.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#ifndef __CPPTOTP_BATCHVERIFY_H__
+#define __CPPTOTP_BATCHVERIFY_H__
+
+#include "credstore.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace CppTotp
+{
+
+/** A TOTP value to check against an account of a CredentialStore. */
+struct VerifyRequest
+{
+	size_t index;
+	uint32_t code;
+	uint64_t timeNow;
+};
+
+/** The outcome of a VerifyRequest. */
+struct VerifyResult
+{
+	/** The matching time step offset, if valid. */
+	int64_t matchedOffset;
+
+	bool valid;
+};
+
+/**
+ * A pool of threads that verifies batches of TOTP values.
+ *
+ * A batch is cut into chunks of Sha1MaxLanes requests; the values of a chunk
+ * are calculated in SIMD lanes, one lane call per window offset. Each thread
+ * starts on its own contiguous share of the chunks and steals from the shares
+ * of the others once it runs out. The results of a chunk are written at once
+ * and, with a 64-byte aligned result array, fill whole cache lines, so
+ * threads don't share cache lines of the results.
+ *
+ * The calling thread works on each batch as well. Batches are verified one at
+ * a time; concurrent calls are serialized.
+ */
+class BatchVerifier
+{
+private:
+	/** A thread's share of the chunks; padded against false sharing. */
+	struct alignas(64) Share
+	{
+		std::atomic<size_t> next;
+		size_t end;
+	};
+
+	std::vector<std::thread> m_threads;
+
+	/** The shares, one per thread, aligned to cache lines within the allocation. */
+	std::unique_ptr<uint8_t[]> m_shareMemory;
+	Share * m_shares;
+
+	/** Serializes batches. */
+	std::mutex m_batchMutex;
+
+	std::mutex m_mutex;
+	std::condition_variable m_start;
+	std::condition_variable m_done;
+	uint64_t m_generation;
+	size_t m_pending;
+	bool m_stop;
+
+	/** The current batch. */
+	const CredentialStore * m_store;
+	const VerifyRequest * m_requests;
+	VerifyResult * m_results;
+	size_t m_count;
+	size_t m_window;
+
+	void run(size_t thread, int cpu);
+	void work(size_t participant);
+
+public:
+	/**
+	 * Starts the given number of threads (0 means one per core), counting the
+	 * calling thread. If CPUs are given, the pool's threads are pinned to them
+	 * in turn (on Linux); the calling thread is left alone.
+	 */
+	explicit BatchVerifier(size_t threadCount = 0, const std::vector<int> & cpus = std::vector<int>());
+
+	/** Stops the threads. */
+	~BatchVerifier();
+
+	BatchVerifier(const BatchVerifier &) = delete;
+	BatchVerifier & operator=(const BatchVerifier &) = delete;
+
+	/** The number of threads working on a batch, including the calling one. */
+	size_t threadCount() const { return m_threads.size() + 1; }
+
+	/**
+	 * Checks the TOTP values of the given requests with the given window and
+	 * stores the outcomes at the same positions in results. Requests for HOTP
+	 * accounts or times before an account's start time are invalid.
+	 *
+	 * @see CredentialStore::verifyTotp
+	 */
+	void verifyBatch(const CredentialStore & store, const VerifyRequest requests[], VerifyResult results[], size_t count, size_t window = 1);
+};
+
+}
+
+#endif
@@ -13,21 +13,44 @@
 #include <stdexcept>
 
 #include <cassert>
+#include <cctype>
 #include <cstdlib>
+#include <cstring>
+
+#if defined(__SSE2__) && defined(__x86_64__)
+#	include <emmintrin.h>
+#	define CPPTOTP_CODEC_SSE2 1
+#endif
 
 namespace CppTotp
 {
 namespace Bytes
 {
 
-void clearByteString(ByteString * bstr)
+void clearBytes(Byte * bytes, size_t size)
 {
-	volatile Byte * bs = const_cast<volatile Byte *>(bstr->data());
+	// empty vectors may hand out null
+	if (size == 0)
+	{
+		return;
+	}
 
-	for (size_t i = 0; i < bstr->size(); ++i)
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 25))
+	// as fast as memset, but never optimized away
+	explicit_bzero(bytes, size);
+#else
+	volatile Byte * bs = const_cast<volatile Byte *>(bytes);
+
+	for (size_t i = 0; i < size; ++i)
 	{
 		bs[i] = Byte(0);
 	}
+#endif
+}
+
+void clearByteString(ByteString * bstr)
+{
+	clearBytes(const_cast<Byte *>(bstr->data()), bstr->size());
 }
 
 void swizzleByteStrings(ByteString * target, ByteString * source)
@@ -37,249 +60,439 @@ void swizzleByteStrings(ByteString * target, ByteString * source)
 	clearByteString(source);
 }
 
-static char nibbleToLCHex(uint8_t nib)
+static const char LowerHexDigits[] = "0123456789abcdef";
+static const char Base32Alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567";
+
+/** The value of each hex digit; -1 for all other characters. */
+static const int8_t HexValues[256] = {
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+	-1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+/** The value of each Base32 character; -1 for all other characters. */
+static const int8_t Base32Values[256] = {
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, 26, 27, 28, 29, 30, 31, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+	15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+#ifdef CPPTOTP_CODEC_SSE2
+/** Whether each byte lies within [low, high] (ASCII only). */
+static inline __m128i bytesInRange(__m128i c, char low, char high)
 {
-	if (nib < 0xa)
-	{
-		return static_cast<char>(nib + '0');
-	}
-	else if (nib < 0x10)
-	{
-		return static_cast<char>((nib - 10) + 'a');
-	}
-	else
-	{
-		assert(0 && "not actually a nibble");
-		return '\0';
-	}
+	return _mm_and_si128(
+		_mm_cmpgt_epi8(c, _mm_set1_epi8(static_cast<char>(low - 1))),
+		_mm_cmplt_epi8(c, _mm_set1_epi8(static_cast<char>(high + 1)))
+	);
 }
 
-static uint8_t hexToNibble(char c)
+/** Encodes 16 bytes into 32 lowercase hex digits. */
+static inline void encodeHexBlock16(const Byte * bytes, char * out)
 {
-	if (c >= '0' && c <= '9')
-	{
-		return static_cast<uint8_t>(c - '0');
-	}
-	else if (c >= 'A' && c <= 'F')
-	{
-		return static_cast<uint8_t>(c - 'A' + 10);
-	}
-	else if (c >= 'a' && c <= 'f')
+	const __m128i lowNibble = _mm_set1_epi8(0x0F);
+	__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes));
+	__m128i hi = _mm_and_si128(_mm_srli_epi16(b, 4), lowNibble);
+	__m128i lo = _mm_and_si128(b, lowNibble);
+
+	// '0' + n, plus the distance from '9' + 1 to 'a' for n > 9
+	const __m128i nine = _mm_set1_epi8(9);
+	const __m128i zero = _mm_set1_epi8('0');
+	const __m128i letterGap = _mm_set1_epi8('a' - '0' - 10);
+	hi = _mm_add_epi8(_mm_add_epi8(hi, zero), _mm_and_si128(_mm_cmpgt_epi8(hi, nine), letterGap));
+	lo = _mm_add_epi8(_mm_add_epi8(lo, zero), _mm_and_si128(_mm_cmpgt_epi8(lo, nine), letterGap));
+
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(out +  0), _mm_unpacklo_epi8(hi, lo));
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(out + 16), _mm_unpackhi_epi8(hi, lo));
+}
+
+/** Decodes 16 hex digits into 8 bytes; returns false on any invalid digit. */
+static inline bool decodeHexBlock16(const char * str, Byte * out)
+{
+	__m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(str));
+	__m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+	__m128i isDigit = bytesInRange(c, '0', '9');
+	__m128i isLetter = bytesInRange(lower, 'a', 'f');
+
+	if (_mm_movemask_epi8(_mm_or_si128(isDigit, isLetter)) != 0xFFFF)
 	{
-		return static_cast<uint8_t>(c - 'a' + 10);
+		return false;
 	}
-	else
+
+	__m128i nibbles = _mm_or_si128(
+		_mm_and_si128(isDigit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+		_mm_and_si128(isLetter, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10)))
+	);
+
+	// each 16-bit word holds (first, second) digit; combine to (first << 4) | second
+	__m128i words = _mm_or_si128(
+		_mm_slli_epi16(_mm_and_si128(nibbles, _mm_set1_epi16(0x00FF)), 4),
+		_mm_srli_epi16(nibbles, 8)
+	);
+	_mm_storel_epi64(reinterpret_cast<__m128i *>(out), _mm_packus_epi16(words, words));
+	return true;
+}
+#endif
+
+/** Stores the lower 40 bits of the value as big-endian bytes. */
+static inline void u40beToBytes(uint64_t num, Byte bytes[5])
+{
+	bytes[0] = static_cast<Byte>((num >> 32) & 0xFF);
+	bytes[1] = static_cast<Byte>((num >> 24) & 0xFF);
+	bytes[2] = static_cast<Byte>((num >> 16) & 0xFF);
+	bytes[3] = static_cast<Byte>((num >>  8) & 0xFF);
+	bytes[4] = static_cast<Byte>((num >>  0) & 0xFF);
+}
+
+#ifdef CPPTOTP_CODEC_SSE2
+/**
+ * Decodes 16 Base32 characters into 10 bytes; returns false on any invalid
+ * character (including padding).
+ */
+static inline bool decodeBase32Block16(const char * str, Byte * out)
+{
+	__m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(str));
+	__m128i isLetter = bytesInRange(c, 'A', 'Z');
+	__m128i isDigit = bytesInRange(c, '2', '7');
+
+	if (_mm_movemask_epi8(_mm_or_si128(isLetter, isDigit)) != 0xFFFF)
 	{
-		assert(0 && "not actually a hex digit");
-		return 0xff;
+		return false;
 	}
+
+	__m128i values = _mm_or_si128(
+		_mm_and_si128(isLetter, _mm_sub_epi8(c, _mm_set1_epi8('A'))),
+		_mm_and_si128(isDigit, _mm_sub_epi8(c, _mm_set1_epi8('2' - 26)))
+	);
+
+	// merge neighbours: 5-bit values into 10-bit words...
+	__m128i words = _mm_or_si128(
+		_mm_slli_epi16(_mm_and_si128(values, _mm_set1_epi16(0x00FF)), 5),
+		_mm_srli_epi16(values, 8)
+	);
+	// ...into 20-bit doublewords (first * 1024 + second)...
+	__m128i dwords = _mm_madd_epi16(words, _mm_set1_epi32(0x00010400));
+	// ...and into 40-bit quadwords
+	__m128i qwords = _mm_or_si128(
+		_mm_slli_epi64(_mm_and_si128(dwords, _mm_set_epi32(0, -1, 0, -1)), 20),
+		_mm_srli_epi64(dwords, 32)
+	);
+
+	u40beToBytes(static_cast<uint64_t>(_mm_cvtsi128_si64(qwords)), &out[0]);
+	u40beToBytes(static_cast<uint64_t>(_mm_cvtsi128_si64(_mm_unpackhi_epi64(qwords, qwords))), &out[5]);
+	return true;
 }
+#endif
 
-std::string toHexString(const ByteString & bstr)
+size_t encodeHex(const Byte * bytes, size_t size, char * out)
 {
-	std::string ret;
+	size_t i = 0;
 
-	for (Byte b : bstr)
+#ifdef CPPTOTP_CODEC_SSE2
+	for (; i + 16 <= size; i += 16)
 	{
-		ret.push_back(nibbleToLCHex((b >> 4) & 0x0F));
-		ret.push_back(nibbleToLCHex((b >> 0) & 0x0F));
+		encodeHexBlock16(&bytes[i], &out[2*i]);
 	}
+#endif
 
-	return ret;
+	for (; i < size; ++i)
+	{
+		out[2*i + 0] = LowerHexDigits[(bytes[i] >> 4) & 0x0F];
+		out[2*i + 1] = LowerHexDigits[(bytes[i] >> 0) & 0x0F];
+	}
+
+	return 2 * size;
 }
 
-ByteString fromHexStringSkipUnknown(const std::string & str)
+size_t decodeHex(const char * str, size_t size, Byte * out, size_t * errorPosition)
 {
-	std::string hstr;
-	for (char c : str)
+	size_t i = 0;
+
+#ifdef CPPTOTP_CODEC_SSE2
+	for (; i + 16 <= size; i += 16)
 	{
-		if (
-			(c >= '0' && c <= '9') ||
-			(c >= 'A' && c <= 'F') ||
-			(c >= 'a' && c <= 'f')
-		)
+		if (!decodeHexBlock16(&str[i], &out[i/2]))
 		{
-			hstr.push_back(c);
+			// let the scalar loop find the culprit
+			break;
 		}
-		// ignore otherwise
 	}
+#endif
 
-	if (hstr.size() % 2 != 0)
+	for (; i + 2 <= size; i += 2)
 	{
-		throw std::invalid_argument("hex string (unknown characters ignored) length not divisible by 2");
+		int8_t top = HexValues[static_cast<uint8_t>(str[i+0])];
+		int8_t btm = HexValues[static_cast<uint8_t>(str[i+1])];
+
+		if ((top | btm) < 0)
+		{
+			if (errorPosition != nullptr)
+			{
+				*errorPosition = (top < 0) ? i : i + 1;
+			}
+			return DecodeError;
+		}
+
+		out[i/2] = static_cast<Byte>((top << 4) | btm);
 	}
 
-	ByteString ret;
-	for (size_t i = 0; i < hstr.size(); i += 2)
+	if (i != size)
 	{
-		uint8_t top = hexToNibble(hstr[i+0]);
-		uint8_t btm = hexToNibble(hstr[i+1]);
-
-		ret.push_back((top << 4) | btm);
+		// odd length
+		if (errorPosition != nullptr)
+		{
+			*errorPosition = size;
+		}
+		return DecodeError;
 	}
-	return ret;
-}
 
-Bytes::ByteString u32beToByteString(uint32_t num)
-{
-	Bytes::ByteString ret;
-	ret.push_back((num >> 24) & 0xFF);
-	ret.push_back((num >> 16) & 0xFF);
-	ret.push_back((num >>  8) & 0xFF);
-	ret.push_back((num >>  0) & 0xFF);
-	return ret;
+	return size / 2;
 }
 
-Bytes::ByteString u64beToByteString(uint64_t num)
+size_t encodeBase32(const Byte * bytes, size_t size, char * out, bool pad)
 {
-	Bytes::ByteString left  = u32beToByteString((num >> 32) & 0xFFFFFFFF);
-	Bytes::ByteString right = u32beToByteString((num >>  0) & 0xFFFFFFFF);
-	return left + right;
-}
+	// the number of characters written for a final group of 0 to 4 bytes
+	static const size_t TailChars[5] = { 0, 2, 4, 5, 7 };
 
-static ByteString b32ChunkToBytes(const std::string & str)
-{
-	ByteString ret;
-	uint64_t whole = 0x00;
-	size_t padcount = 0;
-	size_t finalcount;
+	size_t i = 0;
+	char * o = out;
 
-	if (str.length() != 8)
+	for (; i + 5 <= size; i += 5)
 	{
-		throw std::invalid_argument("incorrect length of base32 chunk");
+		uint64_t whole =
+			(static_cast<uint64_t>(bytes[i+0]) << 32) |
+			(static_cast<uint64_t>(bytes[i+1]) << 24) |
+			(static_cast<uint64_t>(bytes[i+2]) << 16) |
+			(static_cast<uint64_t>(bytes[i+3]) <<  8) |
+			(static_cast<uint64_t>(bytes[i+4]) <<  0)
+		;
+
+		for (size_t j = 0; j < 8; ++j)
+		{
+			*o++ = Base32Alphabet[(whole >> (35 - 5*j)) & 0x1F];
+		}
 	}
 
-	size_t i;
-
-	for (i = 0; i < 8; ++i)
+	size_t rest = size - i;
+	if (rest > 0)
 	{
-		char c = str[i];
-		uint64_t bits;
-
-		if (c == '=')
-		{
-			bits = 0;
-			++padcount;
-		}
-		else if (padcount > 0)
-		{
-			throw std::invalid_argument("padding character followed by non-padding character");
-		}
-		else if (c >= 'A' && c <= 'Z')
+		uint64_t whole = 0;
+		for (size_t j = 0; j < rest; ++j)
 		{
-			bits = static_cast<Byte>(c - 'A');
+			whole |= static_cast<uint64_t>(bytes[i+j]) << (32 - 8*j);
 		}
-		else if (c >= '2' && c <= '7')
+
+		size_t j;
+		for (j = 0; j < TailChars[rest]; ++j)
 		{
-			bits = static_cast<Byte>(c - '2' + 26);
+			*o++ = Base32Alphabet[(whole >> (35 - 5*j)) & 0x1F];
 		}
-		else
+		for (; pad && j < 8; ++j)
 		{
-			throw std::invalid_argument("not a base32 character: " + std::string(1, c));
+			*o++ = '=';
 		}
-
-		// shift into the chunk
-		whole |= (bits << ((7-i)*5));
-	}
-
-	switch (padcount)
-	{
-	case 0:
-		finalcount = 5;
-		break;
-	case 1:
-		finalcount = 4;
-		break;
-	case 3:
-		finalcount = 3;
-		break;
-	case 4:
-		finalcount = 2;
-		break;
-	case 6:
-		finalcount = 1;
-		break;
-	default:
-		throw std::invalid_argument("invalid number of padding characters");
 	}
 
-	for (i = 0; i < finalcount; ++i)
-	{
-		// shift out of the chunk
-		ret.push_back(static_cast<Byte>((whole >> ((4-i)*8)) & 0xFF));
-	}
-
-	return ret;
+	return static_cast<size_t>(o - out);
 }
 
-static inline uint64_t u64(uint8_t n)
+size_t decodeBase32(const char * str, size_t size, Byte * out, size_t * errorPosition)
 {
-	return static_cast<uint64_t>(n);
-}
+	// the number of bytes decoded from a final group of 0 to 7 characters
+	static const int8_t TailBytes[8] = { 0, -1, 1, -1, 2, 3, -1, 4 };
 
-static std::string bytesToB32Chunk(const ByteString & bs)
-{
-	if (bs.size() < 1 || bs.size() > 5)
+	size_t dataSize = size;
+	while (dataSize > 0 && str[dataSize-1] == '=')
 	{
-		throw std::invalid_argument("need a chunk of at least 1 and at most 5 bytes");
+		--dataSize;
 	}
 
-	uint64_t whole = 0x00;
-	size_t putchars = 2;
-	std::string ret;
-
-	// shift into the chunk
-	whole |= (u64(bs[0]) << 32);
-	if (bs.size() > 1)
-	{
-		whole |= (u64(bs[1]) << 24);
-		putchars += 2;  // at least 4
-	}
-	if (bs.size() > 2)
+	// the final group must be complete, and padding must not overshoot it
+	size_t tail = dataSize % 8;
+	if (TailBytes[tail] < 0 || size - dataSize > (8 - tail) % 8)
 	{
-		whole |= (u64(bs[2]) << 16);
-		++putchars;  // at least 5
+		if (errorPosition != nullptr)
+		{
+			*errorPosition = dataSize;
+		}
+		return DecodeError;
 	}
-	if (bs.size() > 3)
+
+	size_t group = 0;
+
+#ifdef CPPTOTP_CODEC_SSE2
+	for (; group + 2 <= dataSize / 8; group += 2)
 	{
-		whole |= (u64(bs[3]) <<  8);
-		putchars += 2;  // at least 7
+		if (!decodeBase32Block16(&str[8*group], &out[5*group]))
+		{
+			// let the scalar loop find the culprit
+			break;
+		}
 	}
-	if (bs.size() > 4)
+#endif
+
+	// the final partial group is treated as a group padded with 'A's
+	for (; group * 8 < dataSize; ++group)
 	{
-		whole |= u64(bs[4]);
-		++putchars;  // at least 8
+		const size_t first = 8 * group;
+		const size_t count = (dataSize - first < 8) ? dataSize - first : 8;
+		uint64_t whole = 0;
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			int8_t value = Base32Values[static_cast<uint8_t>(str[first + i])];
+			if (value < 0)
+			{
+				if (errorPosition != nullptr)
+				{
+					*errorPosition = first + i;
+				}
+				return DecodeError;
+			}
+			whole = (whole << 5) | static_cast<uint64_t>(value);
+		}
+		whole <<= 5 * (8 - count);
+
+		if (count == 8)
+		{
+			u40beToBytes(whole, &out[5*group]);
+		}
+		else
+		{
+			for (int8_t i = 0; i < TailBytes[count]; ++i)
+			{
+				out[5*group + i] = static_cast<Byte>((whole >> (32 - 8*i)) & 0xFF);
+			}
+		}
 	}
 
-	size_t i;
-	for (i = 0; i < putchars; ++i)
-	{
-		// shift out of the chunk
+	return 5 * (dataSize / 8) + static_cast<size_t>(TailBytes[tail]);
+}
 
-		Byte val = (whole >> ((7-i)*5)) & 0x1F;
+size_t decodeBase32Many(
+	const char * const strings[], const size_t sizes[], size_t count,
+	Byte * out, size_t outStride, size_t outSizes[], size_t errorPositions[]
+)
+{
+	size_t failures = 0;
 
-		// map bits to base32
+	for (size_t i = 0; i < count; ++i)
+	{
+		size_t errorPosition = 0;
+		size_t written;
 
-		if (val < 26)
+		if (base32DecodedSize(sizes[i]) > outStride)
 		{
-			ret.push_back(static_cast<char>(val + 'A'));
+			// the first character whose bits might not fit
+			errorPosition = outStride * 8 / 5;
+			written = DecodeError;
 		}
 		else
 		{
-			ret.push_back(static_cast<char>(val - 26 + '2'));
+			written = decodeBase32(strings[i], sizes[i], &out[i * outStride], &errorPosition);
+		}
+
+		outSizes[i] = written;
+		if (written == DecodeError)
+		{
+			++failures;
+			if (errorPositions != nullptr)
+			{
+				errorPositions[i] = errorPosition;
+			}
 		}
 	}
 
-	// pad
+	return failures;
+}
 
-	for (i = putchars; i < 8; ++i)
+std::string toHexString(const ByteString & bstr)
+{
+	std::string ret(2 * bstr.size(), '\0');
+	encodeHex(bstr.data(), bstr.size(), &ret[0]);
+	return ret;
+}
+
+ByteString fromHexStringSkipUnknown(const std::string & str)
+{
+	std::string hstr;
+	hstr.reserve(str.size());
+	for (char c : str)
+	{
+		if (HexValues[static_cast<uint8_t>(c)] >= 0)
+		{
+			hstr.push_back(c);
+		}
+		// ignore otherwise
+	}
+
+	if (hstr.size() % 2 != 0)
 	{
-		ret.push_back('=');
+		throw std::invalid_argument("hex string (unknown characters ignored) length not divisible by 2");
 	}
 
+	ByteString ret(hstr.size() / 2, 0);
+	decodeHex(hstr.data(), hstr.size(), &ret[0]);
 	return ret;
 }
 
+Bytes::ByteString u32beToByteString(uint32_t num)
+{
+	Bytes::ByteString ret;
+	ret.push_back((num >> 24) & 0xFF);
+	ret.push_back((num >> 16) & 0xFF);
+	ret.push_back((num >>  8) & 0xFF);
+	ret.push_back((num >>  0) & 0xFF);
+	return ret;
+}
+
+Bytes::ByteString u64beToByteString(uint64_t num)
+{
+	Bytes::ByteString left  = u32beToByteString((num >> 32) & 0xFFFFFFFF);
+	Bytes::ByteString right = u32beToByteString((num >>  0) & 0xFFFFFFFF);
+	return left + right;
+}
+
+void u32beToBytes(uint32_t num, Byte bytes[4])
+{
+	bytes[0] = static_cast<Byte>((num >> 24) & 0xFF);
+	bytes[1] = static_cast<Byte>((num >> 16) & 0xFF);
+	bytes[2] = static_cast<Byte>((num >>  8) & 0xFF);
+	bytes[3] = static_cast<Byte>((num >>  0) & 0xFF);
+}
+
+void u64beToBytes(uint64_t num, Byte bytes[8])
+{
+	u32beToBytes((num >> 32) & 0xFFFFFFFF, &bytes[0]);
+	u32beToBytes((num >>  0) & 0xFFFFFFFF, &bytes[4]);
+}
+
 ByteString fromBase32(const std::string & b32str)
 {
 	if (b32str.size() % 8 != 0)
@@ -287,55 +500,138 @@ ByteString fromBase32(const std::string & b32str)
 		throw std::invalid_argument("base32 string length not divisible by 8");
 	}
 
-	ByteString ret;
+	return fromUnpaddedBase32(b32str);
+}
+
+ByteString fromUnpaddedBase32(const std::string & b32str)
+{
+	ByteString ret(base32DecodedSize(b32str.size()), 0);
+	size_t errorPosition = 0;
 
-	for (size_t i = 0; i < b32str.size(); i += 8)
+	size_t size = decodeBase32(b32str.data(), b32str.size(), &ret[0], &errorPosition);
+	if (size == DecodeError)
 	{
-		std::string sub(b32str, i, 8);
-		ByteString chk = b32ChunkToBytes(sub);
-		ret.append(chk);
+		clearByteString(&ret);
+		if (errorPosition < b32str.size() && b32str[errorPosition] != '=')
+		{
+			throw std::invalid_argument(
+				"not a base32 character: " + std::string(1, b32str[errorPosition]) +
+				" (at position " + std::to_string(errorPosition) + ")"
+			);
+		}
+		throw std::invalid_argument("invalid length or number of padding characters in base32 string");
 	}
 
+	ret.resize(size);
 	return ret;
 }
 
-ByteString fromUnpaddedBase32(const std::string & b32str)
+std::string normalizedBase32String(const std::string & unnorm)
 {
-	std::string newstr = b32str;
+	std::string ret;
 
-	while (newstr.size() % 8 != 0)
+	for (char c : unnorm)
 	{
-		newstr.push_back('=');
+		if (c == ' ' || c == '\n' || c == '-')
+		{
+			// skip separators
+		}
+		else if (std::islower(c))
+		{
+			// make uppercase
+			char u = std::toupper(c);
+			ret.push_back(u);
+		}
+		else
+		{
+			ret.push_back(c);
+		}
 	}
 
-	return fromBase32(newstr);
+	return ret;
 }
 
 std::string toBase32(const ByteString & bs)
 {
-	std::string ret;
+	std::string ret(base32EncodedSize(bs.size()), '\0');
+	encodeBase32(bs.data(), bs.size(), &ret[0]);
+	return ret;
+}
 
-	size_t i, j, len;
-	for (j = 0; j < bs.size() / 5; ++j)
-	{
-		i = j * 5;
-		ByteString sub(bs, i, 5);
-		std::string chk = bytesToB32Chunk(sub);
-		ret.append(chk);
-	}
+}
+}
+
+#if TEST_BYTES
+#include <cstring>
+
+int main(void)
+{
+	using namespace CppTotp::Bytes;
+
+	// RFC 4648, section 10
+	const char * const plain[] = { "", "f", "fo", "foo", "foob", "fooba", "foobar" };
+	const char * const base32[] = { "", "MY======", "MZXQ====", "MZXW6===", "MZXW6YQ=", "MZXW6YTB", "MZXW6YTBOI======" };
+	const char * const hex[] = { "", "66", "666f", "666f6f", "666f6f62", "666f6f6261", "666f6f626172" };
 
-	i = j * 5;
-	len = bs.size() - i;
-	if (len > 0)
+	for (size_t i = 0; i < 7; ++i)
 	{
-		// block of size < 5 remains
-		ByteString sub(bs, i, std::string::npos);
-		std::string chk = bytesToB32Chunk(sub);
-		ret.append(chk);
+		ByteString bs(reinterpret_cast<const Byte *>(plain[i]));
+		std::cout
+			<< (toBase32(bs) == base32[i])
+			<< (fromBase32(base32[i]) == bs)
+			<< (fromUnpaddedBase32(std::string(base32[i], std::strcspn(base32[i], "="))) == bs)
+			<< (toHexString(bs) == hex[i])
+			<< (fromHexStringSkipUnknown(std::string("[") + hex[i] + "]") == bs)
+		;
 	}
+	std::cout << std::endl;
+
+	// round trips through the vector and scalar paths
+	bool roundTrips = true;
+	Byte bytes[100];
+	char chars[200];
+	Byte back[100];
+	for (size_t size = 0; size < 100; ++size)
+	{
+		for (size_t i = 0; i < size; ++i)
+		{
+			bytes[i] = static_cast<Byte>(i * 37 + size);
+		}
 
-	return ret;
-}
+		size_t b32Size = encodeBase32(bytes, size, chars, false);
+		roundTrips = roundTrips
+			&& b32Size == base32EncodedSize(size, false)
+			&& decodeBase32(chars, b32Size, back, nullptr) == size
+			&& std::memcmp(bytes, back, size) == 0
+		;
+
+		size_t hexSize = encodeHex(bytes, size, chars);
+		roundTrips = roundTrips
+			&& decodeHex(chars, hexSize, back, nullptr) == size
+			&& std::memcmp(bytes, back, size) == 0
+		;
+	}
 
+	// error positions
+	size_t position = 0;
+	const char * badBase32 = "MZXW6YTBOI1W6YTBMZXW6YTB";
+	const char * const many[] = { "MZXW6YTB", "MZXW6YT!", "MZXW6YTBOI" };
+	const size_t manySizes[] = { 8, 8, 10 };
+	Byte manyOut[3 * 8];
+	size_t outSizes[3];
+	size_t errorPositions[3];
+
+	std::cout
+		<< roundTrips
+		<< (decodeBase32(badBase32, 24, back, &position) == DecodeError) << (position == 10)
+		<< (decodeBase32("MZXW6Y", 6, back, &position) == DecodeError) << (position == 6)
+		<< (decodeBase32("MY=======", 9, back, &position) == DecodeError)
+		<< (decodeHex("0123456789abcdef0123456789abcdeX", 32, back, &position) == DecodeError) << (position == 31)
+		<< (decodeHex("abc", 3, back, &position) == DecodeError) << (position == 3)
+		<< (decodeBase32Many(many, manySizes, 3, manyOut, 8, outSizes, errorPositions) == 1)
+		<< (outSizes[0] == 5) << (outSizes[1] == DecodeError) << (errorPositions[1] == 7) << (outSizes[2] == 6)
+	<< std::endl;
+
+	return 0;
 }
-}
+#endif
@@ -12,8 +12,13 @@
 
 #include <string>
 
+#include <cstddef>
 #include <cstdint>
 
+#if CPPTOTP_SECURE_BYTESTRING
+#	include "securemem.h"
+#endif
+
 namespace CppTotp
 {
 namespace Bytes
@@ -22,8 +27,19 @@ namespace Bytes
 /** The type of a single byte. */
 typedef uint8_t Byte;
 
+#if CPPTOTP_SECURE_BYTESTRING
+/**
+ * The type of a byte string, kept in the secure arena. Short strings may still
+ * be stored inside the string object itself.
+ */
+typedef std::basic_string<Byte, std::char_traits<Byte>, SecureAllocator<Byte> > ByteString;
+#else
 /** The type of a byte string. */
 typedef std::basic_string<Byte> ByteString;
+#endif
+
+/** Deletes the contents of a byte buffer. */
+void clearBytes(Byte * bytes, size_t size);
 
 /** Deletes the contents of a byte string. */
 void clearByteString(ByteString * bstr);
@@ -34,12 +50,57 @@ void swizzleByteStrings(ByteString * target, ByteString * source);
 /** Converts a byte string into a hex string. */
 std::string toHexString(const ByteString & bstr);
 
+/**
+ * Converts a hex string into the corresponding byte string, skipping all
+ * characters that are not hex digits.
+ */
+ByteString fromHexStringSkipUnknown(const std::string & str);
+
 /** Converts an unsigned 32-bit integer into a corresponding byte string. */
 ByteString u32beToByteString(uint32_t num);
 
 /** Converts an unsigned 64-bit integer into a corresponding byte string. */
 ByteString u64beToByteString(uint64_t num);
 
+/** Stores an unsigned 32-bit integer as big-endian bytes in the given buffer. */
+void u32beToBytes(uint32_t num, Byte bytes[4]);
+
+/** Stores an unsigned 64-bit integer as big-endian bytes in the given buffer. */
+void u64beToBytes(uint64_t num, Byte bytes[8]);
+
+/** Stores an unsigned 32-bit integer as little-endian bytes in the given buffer. */
+inline void u32leToBytes(uint32_t num, Byte bytes[4])
+{
+	bytes[0] = static_cast<Byte>((num >>  0) & 0xFF);
+	bytes[1] = static_cast<Byte>((num >>  8) & 0xFF);
+	bytes[2] = static_cast<Byte>((num >> 16) & 0xFF);
+	bytes[3] = static_cast<Byte>((num >> 24) & 0xFF);
+}
+
+/** Stores an unsigned 64-bit integer as little-endian bytes in the given buffer. */
+inline void u64leToBytes(uint64_t num, Byte bytes[8])
+{
+	u32leToBytes(static_cast<uint32_t>(num & 0xFFFFFFFF), &bytes[0]);
+	u32leToBytes(static_cast<uint32_t>(num >> 32), &bytes[4]);
+}
+
+/** Reads an unsigned 32-bit integer from little-endian bytes. */
+inline uint32_t u32leFromBytes(const Byte bytes[4])
+{
+	return
+		(static_cast<uint32_t>(bytes[0]) <<  0) |
+		(static_cast<uint32_t>(bytes[1]) <<  8) |
+		(static_cast<uint32_t>(bytes[2]) << 16) |
+		(static_cast<uint32_t>(bytes[3]) << 24)
+	;
+}
+
+/** Reads an unsigned 64-bit integer from little-endian bytes. */
+inline uint64_t u64leFromBytes(const Byte bytes[8])
+{
+	return static_cast<uint64_t>(u32leFromBytes(&bytes[0])) | (static_cast<uint64_t>(u32leFromBytes(&bytes[4])) << 32);
+}
+
 /** Converts a Base32 string into the correspoding byte string. */
 ByteString fromBase32(const std::string & b32str);
 
@@ -49,9 +110,74 @@ ByteString fromBase32(const std::string & b32str);
  */
 ByteString fromUnpaddedBase32(const std::string & b32str);
 
+/**
+ * Removes separators (spaces, newlines and dashes) from a Base32 string as
+ * entered by a user and converts it to uppercase.
+ */
+std::string normalizedBase32String(const std::string & unnorm);
+
 /** Converts byte string into the corresponding Base32 string. */
 std::string toBase32(const ByteString & b32str);
 
+/** Returned by the buffer decoding functions if the input is invalid. */
+const size_t DecodeError = static_cast<size_t>(-1);
+
+/**
+ * Writes the lowercase hex representation of the given bytes (2 * size
+ * characters, not NUL-terminated) and returns the number of characters.
+ */
+size_t encodeHex(const Byte * bytes, size_t size, char * out);
+
+/**
+ * Decodes a string of hex digits into size / 2 bytes and returns their
+ * number.
+ *
+ * @return DecodeError if the string contains a non-hex character (whose
+ * position is stored in errorPosition) or has an odd length (errorPosition is
+ * set to size).
+ */
+size_t decodeHex(const char * str, size_t size, Byte * out, size_t * errorPosition = nullptr);
+
+/** The number of characters encodeBase32 writes for the given number of bytes. */
+inline size_t base32EncodedSize(size_t byteCount, bool pad = true)
+{
+	return pad ? (byteCount + 4) / 5 * 8 : (byteCount * 8 + 4) / 5;
+}
+
+/** The maximum number of bytes decodeBase32 writes for the given number of characters. */
+inline size_t base32DecodedSize(size_t charCount)
+{
+	return charCount * 5 / 8;
+}
+
+/**
+ * Writes the Base32 representation of the given bytes (not NUL-terminated) and
+ * returns the number of characters.
+ */
+size_t encodeBase32(const Byte * bytes, size_t size, char * out, bool pad = true);
+
+/**
+ * Decodes a padded or unpadded Base32 string (uppercase, without separators)
+ * and returns the number of bytes written.
+ *
+ * @return DecodeError if the string is invalid; errorPosition is set to the
+ * position of the first invalid character, or to the position where a
+ * character is missing or padding begins if the length is wrong.
+ */
+size_t decodeBase32(const char * str, size_t size, Byte * out, size_t * errorPosition = nullptr);
+
+/**
+ * Decodes many Base32 strings in one go. The output of string i is written at
+ * out + i * outStride; its length, or DecodeError, into outSizes[i]. Strings
+ * which might not fit into outStride bytes fail.
+ *
+ * @return The number of strings which could not be decoded.
+ */
+size_t decodeBase32Many(
+	const char * const strings[], const size_t sizes[], size_t count,
+	Byte * out, size_t outStride, size_t outSizes[], size_t errorPositions[] = nullptr
+);
+
 /** Deletes the contets of a byte string on destruction. */
 class ByteStringDestructor
 {
@@ -0,0 +1,358 @@
+/**
+ * @file codetable.cpp
+ *
+ * @brief Implementation of the pregenerated TOTP code table.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#include "codetable.h"
+#include "consttime.h"
+#include "metrics.h"
+
+#include <chrono>
+#include <stdexcept>
+
+#include <ctime>
+
+namespace CppTotp
+{
+
+/** The number of values handed to generateMany() at once. */
+static const size_t BuildBatchSize = 16 * Sha1MaxLanes;
+
+TotpCodeTable::TotpCodeTable(const CredentialStore & store, size_t window)
+	: m_store(store), m_window(window), m_codesPerAccount(2*window + 2), m_current(nullptr), m_stopping(false)
+{
+	for (size_t i = 0; i < 2; ++i)
+	{
+		m_tables[i].readers.store(0, std::memory_order_relaxed);
+		m_tables[i].time = 0;
+		m_tables[i].accountCount = 0;
+	}
+}
+
+TotpCodeTable::~TotpCodeTable()
+{
+	stop();
+}
+
+const TotpCodeTable::Table * TotpCodeTable::acquire() const
+{
+	for (;;)
+	{
+		Table * table = m_current.load(std::memory_order_seq_cst);
+		if (table == nullptr)
+		{
+			return nullptr;
+		}
+
+		// announce the read, then make sure the table wasn't swapped out meanwhile
+		table->readers.fetch_add(1, std::memory_order_seq_cst);
+		if (m_current.load(std::memory_order_seq_cst) == table)
+		{
+			return table;
+		}
+		table->readers.fetch_sub(1, std::memory_order_release);
+	}
+}
+
+void TotpCodeTable::release(const Table * table)
+{
+	const_cast<Table *>(table)->readers.fetch_sub(1, std::memory_order_release);
+}
+
+uint64_t TotpCodeTable::time() const
+{
+	const Table * table = acquire();
+	if (table == nullptr)
+	{
+		return 0;
+	}
+
+	uint64_t ret = table->time;
+	release(table);
+	return ret;
+}
+
+TotpCodeTableStats TotpCodeTable::build(uint64_t time)
+{
+	CPPTOTP_METRIC_TIMER(Pregenerate);
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	std::lock_guard<std::mutex> lock(m_buildMutex);
+
+	// fill the buffer that is not current, once the last reader has left it
+	Table * table = (m_current.load(std::memory_order_seq_cst) == &m_tables[0]) ? &m_tables[1] : &m_tables[0];
+	while (table->readers.load(std::memory_order_seq_cst) != 0)
+	{
+		std::this_thread::yield();
+	}
+
+	const size_t accountCount = m_store.size();
+	table->time = time;
+	table->accountCount = accountCount;
+	table->codes.assign(accountCount * m_codesPerAccount, 0);
+
+	size_t indices[BuildBatchSize];
+	uint64_t counters[BuildBatchSize];
+	size_t positions[BuildBatchSize];
+	uint32_t codes[BuildBatchSize];
+	size_t pending = 0;
+	size_t codeCount = 0;
+
+	for (size_t index = 0; index <= accountCount; ++index)
+	{
+		if (index < accountCount)
+		{
+			const CredentialParams params = m_store.params(index);
+			if (params.kind != OtpKind::Totp || params.timeStart > time)
+			{
+				continue;
+			}
+
+			// steps base - 1 - window up to base + window
+			const uint64_t base = (time - params.timeStart) / params.timeStep;
+			for (size_t k = 0; k < m_codesPerAccount; ++k)
+			{
+				indices[pending] = index;
+				counters[pending] = base - 1 - m_window + k;
+				positions[pending] = index * m_codesPerAccount + k;
+				++pending;
+
+				if (pending == BuildBatchSize)
+				{
+					m_store.generateMany(indices, counters, pending, codes);
+					for (size_t i = 0; i < pending; ++i)
+					{
+						table->codes[positions[i]] = codes[i];
+					}
+					codeCount += pending;
+					pending = 0;
+				}
+			}
+		}
+		else if (pending > 0)
+		{
+			m_store.generateMany(indices, counters, pending, codes);
+			for (size_t i = 0; i < pending; ++i)
+			{
+				table->codes[positions[i]] = codes[i];
+			}
+			codeCount += pending;
+		}
+	}
+	Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(codes), sizeof(codes));
+
+	m_current.store(table, std::memory_order_seq_cst);
+
+	TotpCodeTableStats stats;
+	stats.time = time;
+	stats.accountCount = accountCount;
+	stats.codeCount = codeCount;
+	stats.nanoseconds = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+	CPPTOTP_PROBE2(pregenerate, accountCount, stats.nanoseconds);
+	return stats;
+}
+
+bool TotpCodeTable::verify(size_t index, uint32_t code, uint64_t timeNow, int64_t * matchedOffset) const
+{
+	const Table * table = acquire();
+	if (table != nullptr)
+	{
+		const CredentialParams params = m_store.params(index);
+		bool covered = false;
+		uint32_t found = 0;
+		uint64_t foundOffset = 0;
+
+		if (index < table->accountCount && params.kind == OtpKind::Totp && params.timeStart <= timeNow && params.timeStart <= table->time)
+		{
+			const uint64_t base = (table->time - params.timeStart) / params.timeStep;
+			const uint64_t timeValue = (timeNow - params.timeStart) / params.timeStep;
+
+			// the table holds the window around base - 1 and base; steps before
+			// the epoch are left to the store
+			covered = (timeValue == base || timeValue + 1 == base) && timeValue >= m_window;
+			if (covered)
+			{
+				CPPTOTP_METRIC_ADD(Verifies, 1);
+				const uint32_t * codes = &table->codes[index * m_codesPerAccount + static_cast<size_t>(timeValue + 1 - base)];
+
+				// in order of preference: 0, -1, +1, -2, +2, ...
+				for (size_t i = 0; i < 2*m_window + 1; ++i)
+				{
+					int64_t distance = static_cast<int64_t>((i + 1) / 2);
+					int64_t offset = (i % 2 == 1) ? -distance : distance;
+
+					uint32_t take = ctEqual(codes[static_cast<int64_t>(m_window) + offset], code) & (found ^ 1u);
+					uint64_t mask = 0u - static_cast<uint64_t>(take);
+
+					foundOffset |= mask & static_cast<uint64_t>(offset);
+					found |= take;
+				}
+			}
+		}
+		release(table);
+
+		if (covered)
+		{
+			CPPTOTP_PROBE2(verify, found, static_cast<int64_t>(foundOffset));
+			if (found)
+			{
+				CPPTOTP_METRIC_ADD(VerifyMatches, 1);
+				CPPTOTP_METRIC_WINDOW_HIT(static_cast<int64_t>(foundOffset));
+				if (matchedOffset != nullptr)
+				{
+					*matchedOffset = static_cast<int64_t>(foundOffset);
+				}
+			}
+			return found != 0;
+		}
+	}
+
+	return m_store.verifyTotp(index, code, timeNow, m_window, matchedOffset);
+}
+
+void TotpCodeTable::start(uint64_t period, uint64_t lead, ReportFunction report)
+{
+	if (lead == 0 || lead >= period)
+	{
+		throw std::invalid_argument("the lead time must be positive and shorter than the period");
+	}
+
+	std::lock_guard<std::mutex> lock(m_threadMutex);
+	if (m_thread.joinable())
+	{
+		throw std::logic_error("code table generator already running");
+	}
+
+	m_stopping = false;
+	m_thread = std::thread(&TotpCodeTable::run, this, period, lead, report);
+}
+
+void TotpCodeTable::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_threadMutex);
+		if (!m_thread.joinable())
+		{
+			return;
+		}
+		m_stopping = true;
+	}
+	m_wakeUp.notify_all();
+	m_thread.join();
+}
+
+void TotpCodeTable::run(uint64_t period, uint64_t lead, ReportFunction report)
+{
+	std::unique_lock<std::mutex> lock(m_threadMutex);
+
+	while (!m_stopping)
+	{
+		const uint64_t now = static_cast<uint64_t>(std::time(nullptr));
+		const uint64_t boundary = (now / period + 1) * period;
+
+		// a table for the next boundary also answers everything until then
+		if (time() != boundary)
+		{
+			lock.unlock();
+			TotpCodeTableStats stats = build(boundary);
+			if (report)
+			{
+				report(stats);
+			}
+			lock.lock();
+		}
+
+		const std::time_t wakeTime = static_cast<std::time_t>(boundary + period - lead);
+		m_wakeUp.wait_until(lock, std::chrono::system_clock::from_time_t(wakeTime), [this] { return m_stopping; });
+	}
+}
+
+}
+
+#if TEST_CODETABLE
+#include "otp.h"
+
+#include <iostream>
+
+int main(void)
+{
+	using namespace CppTotp;
+
+	const Bytes::ByteString key = reinterpret_cast<const uint8_t *>("12345678901234567890");
+	CredentialStore store(100);
+
+	CredentialParams totpParams = { OtpKind::Totp, 8, 30, 0, 0 };
+	CredentialParams hotpParams = { OtpKind::Hotp, 6, 0, 0, 0 };
+	for (uint64_t i = 0; i < 99; ++i)
+	{
+		store.add(i, HmacSha1Key(key), (i == 50) ? hotpParams : totpParams);
+	}
+
+	TotpCodeTable table(store, 1);
+	bool emptyFallback = table.verify(7, 94287082, 59);
+
+	// the RFC 6238 value at 59 is for step 1; a table for 60 covers steps 1 and 2
+	TotpCodeTableStats stats = table.build(60);
+	int64_t offset = 99;
+	bool current = table.verify(7, 94287082, 59, &offset) && offset == 0;
+	bool previous = table.verify(7, 94287082, 60, &offset) && offset == -1;
+	bool next = table.verify(7, 94287082, 29, &offset) && offset == 1;
+
+	// account 99 is added after the build, and the RFC value at 1111111109 is
+	// far outside the table; both fall back to hashing
+	store.add(99, HmacSha1Key(key), totpParams);
+	bool late = table.verify(99, 94287082, 59);
+	bool outside = table.verify(7, 7081804, 1111111109);
+
+	// around a later boundary, the table agrees with hashing on every answer
+	const uint64_t boundary = 1111111110;
+	TotpCodeTable wideTable(store, 2);
+	wideTable.build(boundary);
+	bool agrees = true;
+	for (uint64_t t = boundary - 30; t < boundary + 30; t += 7)
+	{
+		for (int64_t shift = -3; shift <= 3; ++shift)
+		{
+			uint32_t code = hotp(store.key(7), t / 30 + static_cast<uint64_t>(shift), 8);
+			int64_t tableOffset = 99;
+			int64_t storeOffset = 99;
+			agrees = agrees
+				&& wideTable.verify(7, code, t, &tableOffset) == store.verifyTotp(7, code, t, 2, &storeOffset)
+				&& tableOffset == storeOffset
+			;
+		}
+	}
+
+	// a background build for the next boundary replaces the table
+	size_t reports = 0;
+	std::mutex reportMutex;
+	std::condition_variable reported;
+	table.start(30, 2, [&](const TotpCodeTableStats &) {
+		std::lock_guard<std::mutex> lock(reportMutex);
+		++reports;
+		reported.notify_all();
+	});
+	{
+		std::unique_lock<std::mutex> lock(reportMutex);
+		reported.wait(lock, [&] { return reports > 0; });
+	}
+	uint64_t now = static_cast<uint64_t>(std::time(nullptr));
+	bool background = (table.time() > now && table.time() % 30 == 0);
+	table.stop();
+
+	std::cout
+		<< emptyFallback
+		<< (stats.accountCount == 99) << (stats.codeCount == 98 * 4)
+		<< current << previous << next
+		<< !table.verify(7, 94287082, 119)
+		<< late << outside << agrees
+		<< background
+	<< std::endl;
+
+	return 0;
+}
+#endif
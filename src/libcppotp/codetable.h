@@ -0,0 +1,141 @@
+/**
+ * @file codetable.h
+ *
+ * @brief TOTP values of all accounts, pregenerated once per time step.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#ifndef __CPPTOTP_CODETABLE_H__
+#define __CPPTOTP_CODETABLE_H__
+
+#include "credstore.h"
+#include "securemem.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace CppTotp
+{
+
+/** What building a code table took. */
+struct TotpCodeTableStats
+{
+	/** The time the table was built for. */
+	uint64_t time;
+
+	/** The number of accounts covered, and the number of values generated. */
+	size_t accountCount;
+	size_t codeCount;
+
+	/** The time it took to build the table. */
+	uint64_t nanoseconds;
+};
+
+/**
+ * The TOTP values of all accounts of a store around a point in time.
+ *
+ * A table built for time T holds, for each TOTP account, the values of the
+ * time steps that a verification with the given window can ask for during the
+ * account's time step containing T and the one before it. Built shortly before
+ * a step boundary for the time of the boundary, it thus answers all
+ * verifications until the next boundary without hashing; verify() is a lookup
+ * and a constant-time comparison.
+ *
+ * The table is double-buffered: a build fills the unused buffer and swaps it in
+ * atomically, so verifications never wait for a build. Verifications the table
+ * cannot answer (HOTP accounts, accounts added after the build, times outside
+ * the table) fall back to CredentialStore::verifyTotp.
+ *
+ * Adding accounts to the store must not race with building a table. The
+ * values are kept in the secure arena.
+ */
+class TotpCodeTable
+{
+public:
+	/** Called after each build. */
+	typedef std::function<void(const TotpCodeTableStats &)> ReportFunction;
+
+private:
+	struct Table
+	{
+		std::atomic<uint64_t> readers;
+		uint64_t time;
+		size_t accountCount;
+		std::vector<uint32_t, SecureAllocator<uint32_t> > codes;
+	};
+
+	const CredentialStore & m_store;
+	size_t m_window;
+	size_t m_codesPerAccount;
+
+	Table m_tables[2];
+	std::atomic<Table *> m_current;
+
+	/** Serializes builds. */
+	std::mutex m_buildMutex;
+
+	/** The background generator. */
+	std::thread m_thread;
+	std::mutex m_threadMutex;
+	std::condition_variable m_wakeUp;
+	bool m_stopping;
+
+	const Table * acquire() const;
+	static void release(const Table * table);
+
+	void run(uint64_t period, uint64_t lead, ReportFunction report);
+
+public:
+	/**
+	 * Creates an empty table for the given store and verification window (see
+	 * verifyTotp()). The store must outlive the table.
+	 */
+	explicit TotpCodeTable(const CredentialStore & store, size_t window = 1);
+
+	/** Stops the background generator, if running. */
+	~TotpCodeTable();
+
+	TotpCodeTable(const TotpCodeTable &) = delete;
+	TotpCodeTable & operator=(const TotpCodeTable &) = delete;
+
+	/** The time of the current table, or 0 if none has been built yet. */
+	uint64_t time() const;
+
+	/** Builds a table for the given time and swaps it in. */
+	TotpCodeTableStats build(uint64_t time);
+
+	/**
+	 * Checks a TOTP value of the account at the given index, with the window
+	 * given on construction.
+	 *
+	 * @see CredentialStore::verifyTotp
+	 */
+	bool verify(size_t index, uint32_t code, uint64_t timeNow, int64_t * matchedOffset = nullptr) const;
+
+	/**
+	 * Starts a thread that builds a table for each multiple of the period (in
+	 * seconds of Unix time), the given number of seconds before it, passing
+	 * the results to the report function (if any). The first table is built
+	 * right away.
+	 *
+	 * @throw std::invalid_argument unless 0 < lead < period.
+	 * @throw std::logic_error if the generator is already running.
+	 */
+	void start(uint64_t period = 30, uint64_t lead = 2, ReportFunction report = ReportFunction());
+
+	/** Stops the background generator and waits for it to finish. */
+	void stop();
+};
+
+}
+
+#endif
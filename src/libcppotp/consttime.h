@@ -0,0 +1,30 @@
+/**
+ * @file consttime.h
+ *
+ * @brief Comparisons that take the same time whatever the values.
+ *
+ * Used when matching candidate codes against a submitted one, so that the
+ * timing does not reveal which candidate (if any) matched.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#ifndef __CPPTOTP_CONSTTIME_H__
+#define __CPPTOTP_CONSTTIME_H__
+
+#include <cstdint>
+
+namespace CppTotp
+{
+
+/** Returns 1 if the values are equal and 0 otherwise, without branching. */
+inline uint32_t ctEqual(uint32_t a, uint32_t b)
+{
+	uint32_t diff = a ^ b;
+	return ((diff | (0u - diff)) >> 31) ^ 1u;
+}
+
+}
+
+#endif
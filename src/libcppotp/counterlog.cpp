@@ -0,0 +1,663 @@
+/**
+ * @file counterlog.cpp
+ *
+ * @brief Implementation of the counter write-ahead log.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#include "counterlog.h"
+#include "hashmix.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace CppTotp
+{
+
+static const char FileMagic[8] = { 'C', 'P', 'O', 'T', 'P', 'C', 'T', 'R' };
+static const char SnapshotName[] = "counters.snap";
+static const char LogPrefix[] = "counters-";
+static const char LogSuffix[] = ".wal";
+
+/** Header field offsets. */
+static const size_t OffVersion = 8;
+static const size_t OffRecordSize = 12;
+static const size_t OffRecordCount = 16;
+static const size_t OffGeneration = 24;
+static const size_t OffChecksum = 32;
+
+/** Log record field offsets. */
+static const size_t OffAccountId = 0;
+static const size_t OffValue = 8;
+static const size_t OffKind = 16;
+static const size_t OffCheck = 20;
+
+/** Snapshot record field offsets (after the account ID). */
+static const size_t OffHotpCounter = 8;
+static const size_t OffTotpSteps = 16;
+
+/** The kinds of log records. */
+static const uint8_t KindHotpCounter = 1;
+static const uint8_t KindTotpStep = 2;
+
+static std::runtime_error fileError(const std::string & what, const std::string & path)
+{
+	return std::runtime_error(what + " " + path + ": " + std::strerror(errno));
+}
+
+/** Writes all of the buffer, retrying on partial writes. */
+static bool writeAll(int fd, const uint8_t * data, size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t written = ::write(fd, data, size);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return false;
+		}
+		data += written;
+		size -= static_cast<size_t>(written);
+	}
+	return true;
+}
+
+/** Reads the whole file; returns false if it does not exist. */
+static bool readFile(const std::string & path, std::vector<uint8_t> * contents)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		if (errno == ENOENT)
+		{
+			return false;
+		}
+		throw fileError("cannot open counter file", path);
+	}
+
+	contents->clear();
+	uint8_t buffer[64 * 1024];
+	for (;;)
+	{
+		ssize_t got = ::read(fd, buffer, sizeof(buffer));
+		if (got > 0)
+		{
+			contents->insert(contents->end(), buffer, buffer + got);
+		}
+		else if (got == 0)
+		{
+			break;
+		}
+		else if (errno != EINTR)
+		{
+			std::runtime_error err = fileError("cannot read counter file", path);
+			close(fd);
+			throw err;
+		}
+	}
+	close(fd);
+	return true;
+}
+
+/** Makes the creation, renaming and removal of files in the directory durable. */
+static void syncDirectory(const std::string & directory)
+{
+	int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1 || fsync(fd) != 0)
+	{
+		std::runtime_error err = fileError("cannot sync counter directory", directory);
+		if (fd != -1)
+		{
+			close(fd);
+		}
+		throw err;
+	}
+	close(fd);
+}
+
+static std::string logPath(const std::string & directory, uint64_t generation)
+{
+	return directory + "/" + LogPrefix + std::to_string(generation) + LogSuffix;
+}
+
+/** The generations of the log files in the directory, in ascending order. */
+static std::vector<uint64_t> logGenerations(const std::string & directory)
+{
+	DIR * dir = opendir(directory.c_str());
+	if (dir == nullptr)
+	{
+		throw fileError("cannot list counter directory", directory);
+	}
+
+	std::vector<uint64_t> ret;
+	const size_t prefixSize = sizeof(LogPrefix) - 1;
+	const size_t suffixSize = sizeof(LogSuffix) - 1;
+	while (struct dirent * entry = readdir(dir))
+	{
+		const std::string name = entry->d_name;
+		if (name.size() <= prefixSize + suffixSize
+			|| name.compare(0, prefixSize, LogPrefix) != 0
+			|| name.compare(name.size() - suffixSize, suffixSize, LogSuffix) != 0)
+		{
+			continue;
+		}
+
+		const std::string digits = name.substr(prefixSize, name.size() - prefixSize - suffixSize);
+		if (digits.find_first_not_of("0123456789") == std::string::npos)
+		{
+			ret.push_back(std::strtoull(digits.c_str(), nullptr, 10));
+		}
+	}
+	closedir(dir);
+
+	std::sort(ret.begin(), ret.end());
+	return ret;
+}
+
+/** The check value of a log record; covers the generation so stale files don't pass. */
+static uint32_t recordCheck(const uint8_t * rec, uint64_t generation)
+{
+	uint64_t h = mix64(generation ^ 0x9e3779b97f4a7c15ULL);
+	h = mix64(h ^ Bytes::u64leFromBytes(rec + OffAccountId));
+	h = mix64(h ^ Bytes::u64leFromBytes(rec + OffValue));
+	h = mix64(h ^ Bytes::u32leFromBytes(rec + OffKind));
+	return static_cast<uint32_t>(h >> 32);
+}
+
+CounterLog::CounterLog(const std::string & directory)
+	: m_directory(directory), m_appended(0), m_durable(0), m_flushing(false), m_failed(false), m_syncs(0),
+	m_fd(-1), m_generation(0), m_logRecords(0)
+{
+	std::lock_guard<std::mutex> io(m_ioMutex);
+	load();
+}
+
+CounterLog::~CounterLog()
+{
+	try
+	{
+		syncAll();
+	}
+	catch (const std::exception &)
+	{
+		// nothing more to be done about it
+	}
+	close(m_fd);
+}
+
+void CounterLog::load()
+{
+	const std::string snapshotPath = m_directory + "/" + SnapshotName;
+	std::vector<uint8_t> contents;
+	uint64_t covered = 0;
+
+	if (readFile(snapshotPath, &contents))
+	{
+		const char * problem = nullptr;
+		const uint64_t recordCount = (contents.size() >= HeaderSize) ? Bytes::u64leFromBytes(&contents[OffRecordCount]) : 0;
+		if (contents.size() < HeaderSize || std::memcmp(contents.data(), FileMagic, sizeof(FileMagic)) != 0)
+		{
+			problem = "not a counter snapshot";
+		}
+		else if (Bytes::u32leFromBytes(&contents[OffVersion]) != Version)
+		{
+			problem = "unsupported counter snapshot version";
+		}
+		else if (Bytes::u32leFromBytes(&contents[OffRecordSize]) != RecordSize)
+		{
+			problem = "unexpected counter snapshot record size";
+		}
+		else if ((contents.size() - HeaderSize) % RecordSize != 0 || recordCount != (contents.size() - HeaderSize) / RecordSize)
+		{
+			problem = "counter snapshot size does not match record count";
+		}
+		else
+		{
+			Sha1Digest digest;
+			sha1(&contents[HeaderSize], contents.size() - HeaderSize, &digest);
+			if (std::memcmp(digest.data(), &contents[OffChecksum], digest.size()) != 0)
+			{
+				problem = "counter snapshot checksum mismatch";
+			}
+		}
+		if (problem != nullptr)
+		{
+			throw std::runtime_error(std::string(problem) + ": " + snapshotPath);
+		}
+
+		covered = Bytes::u64leFromBytes(&contents[OffGeneration]);
+		m_state.reserve(static_cast<size_t>(recordCount));
+		for (size_t pos = HeaderSize; pos < contents.size(); pos += RecordSize)
+		{
+			AccountState & state = m_state[Bytes::u64leFromBytes(&contents[pos])];
+			state.hotpCounter = Bytes::u64leFromBytes(&contents[pos + OffHotpCounter]);
+			state.totpSteps = Bytes::u64leFromBytes(&contents[pos + OffTotpSteps]);
+		}
+	}
+
+	// a crash during a checkpoint may leave covered log files behind
+	const std::vector<uint64_t> generations = logGenerations(m_directory);
+	uint64_t latest = covered;
+	for (uint64_t generation : generations)
+	{
+		const std::string path = logPath(m_directory, generation);
+		if (generation <= covered)
+		{
+			unlink(path.c_str());
+			continue;
+		}
+
+		readFile(path, &contents);
+		for (size_t pos = 0; pos + RecordSize <= contents.size(); pos += RecordSize)
+		{
+			const uint8_t * rec = &contents[pos];
+			if (Bytes::u32leFromBytes(rec + OffCheck) != recordCheck(rec, generation))
+			{
+				// torn by a crash; nothing after it was committed
+				break;
+			}
+
+			AccountState & state = m_state[Bytes::u64leFromBytes(rec + OffAccountId)];
+			const uint64_t value = Bytes::u64leFromBytes(rec + OffValue);
+			if (rec[OffKind] == KindHotpCounter)
+			{
+				state.hotpCounter = std::max(state.hotpCounter, value);
+			}
+			else if (rec[OffKind] == KindTotpStep)
+			{
+				state.totpSteps = std::max(state.totpSteps, value + 1);
+			}
+			++m_logRecords;
+		}
+		latest = generation;
+	}
+
+	// never append after a torn record
+	startLogFile(latest + 1);
+}
+
+void CounterLog::startLogFile(uint64_t generation)
+{
+	const std::string path = logPath(m_directory, generation);
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+	if (fd == -1)
+	{
+		throw fileError("cannot create counter log", path);
+	}
+	try
+	{
+		syncDirectory(m_directory);
+	}
+	catch (const std::exception &)
+	{
+		close(fd);
+		throw;
+	}
+
+	if (m_fd != -1)
+	{
+		close(m_fd);
+	}
+	m_fd = fd;
+	m_generation = generation;
+}
+
+uint64_t CounterLog::append(uint64_t accountId, uint64_t value, uint8_t kind)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_pending.push_back({ accountId, value, kind });
+	return ++m_appended;
+}
+
+uint64_t CounterLog::logHotpCounter(uint64_t accountId, uint64_t counter)
+{
+	return append(accountId, counter, KindHotpCounter);
+}
+
+uint64_t CounterLog::logTotpStep(uint64_t accountId, uint64_t step)
+{
+	return append(accountId, step, KindTotpStep);
+}
+
+void CounterLog::flush(std::unique_lock<std::mutex> & lock)
+{
+	// take everything appended so far; later changes go into the next group
+	std::vector<Change> changes;
+	changes.swap(m_pending);
+	const uint64_t target = m_appended;
+	m_flushing = true;
+	lock.unlock();
+
+	bool ok = true;
+	{
+		std::lock_guard<std::mutex> io(m_ioMutex);
+
+		std::vector<uint8_t> buffer(changes.size() * RecordSize, 0);
+		for (size_t i = 0; i < changes.size(); ++i)
+		{
+			uint8_t * rec = &buffer[i * RecordSize];
+			Bytes::u64leToBytes(changes[i].accountId, rec + OffAccountId);
+			Bytes::u64leToBytes(changes[i].value, rec + OffValue);
+			rec[OffKind] = changes[i].kind;
+			Bytes::u32leToBytes(recordCheck(rec, m_generation), rec + OffCheck);
+		}
+
+		ok = writeAll(m_fd, buffer.data(), buffer.size()) && fdatasync(m_fd) == 0;
+		if (ok)
+		{
+			for (const Change & change : changes)
+			{
+				AccountState & state = m_state[change.accountId];
+				if (change.kind == KindHotpCounter)
+				{
+					state.hotpCounter = std::max(state.hotpCounter, change.value);
+				}
+				else
+				{
+					state.totpSteps = std::max(state.totpSteps, change.value + 1);
+				}
+			}
+			m_logRecords += changes.size();
+		}
+	}
+
+	lock.lock();
+	m_flushing = false;
+	if (ok)
+	{
+		m_durable = std::max(m_durable, target);
+		++m_syncs;
+	}
+	else
+	{
+		m_failed = true;
+	}
+	m_flushed.notify_all();
+}
+
+void CounterLog::sync(uint64_t sequence)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (m_durable < sequence)
+	{
+		if (m_failed)
+		{
+			throw std::runtime_error("cannot write counter log in " + m_directory);
+		}
+
+		// lead the next group, or wait for the one being written
+		if (!m_flushing)
+		{
+			flush(lock);
+		}
+		else
+		{
+			m_flushed.wait(lock);
+		}
+	}
+}
+
+void CounterLog::syncAll()
+{
+	uint64_t sequence;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		sequence = m_appended;
+	}
+	sync(sequence);
+}
+
+void CounterLog::checkpoint()
+{
+	std::lock_guard<std::mutex> checkpointLock(m_checkpointMutex);
+
+	// the state matches the log files up to the current one exactly; switch
+	// to a new one so the snapshot can cover those
+	std::vector<std::pair<uint64_t, AccountState> > states;
+	uint64_t covered;
+	{
+		std::lock_guard<std::mutex> io(m_ioMutex);
+		states.assign(m_state.begin(), m_state.end());
+		covered = m_generation;
+		startLogFile(covered + 1);
+		m_logRecords = 0;
+	}
+
+	std::sort(states.begin(), states.end(), [](const std::pair<uint64_t, AccountState> & left, const std::pair<uint64_t, AccountState> & right)
+	{
+		return left.first < right.first;
+	});
+
+	std::vector<uint8_t> contents(HeaderSize + states.size() * RecordSize, 0);
+	for (size_t i = 0; i < states.size(); ++i)
+	{
+		uint8_t * rec = &contents[HeaderSize + i * RecordSize];
+		Bytes::u64leToBytes(states[i].first, rec);
+		Bytes::u64leToBytes(states[i].second.hotpCounter, rec + OffHotpCounter);
+		Bytes::u64leToBytes(states[i].second.totpSteps, rec + OffTotpSteps);
+	}
+
+	Sha1Digest digest;
+	sha1(&contents[HeaderSize], contents.size() - HeaderSize, &digest);
+	std::memcpy(&contents[0], FileMagic, sizeof(FileMagic));
+	Bytes::u32leToBytes(Version, &contents[OffVersion]);
+	Bytes::u32leToBytes(RecordSize, &contents[OffRecordSize]);
+	Bytes::u64leToBytes(states.size(), &contents[OffRecordCount]);
+	Bytes::u64leToBytes(covered, &contents[OffGeneration]);
+	std::memcpy(&contents[OffChecksum], digest.data(), digest.size());
+
+	const std::string path = m_directory + "/" + SnapshotName;
+	const std::string tempPath = path + ".tmp";
+	int fd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1)
+	{
+		throw fileError("cannot create counter snapshot", tempPath);
+	}
+
+	bool ok = writeAll(fd, contents.data(), contents.size()) && fsync(fd) == 0;
+	if (close(fd) != 0)
+	{
+		ok = false;
+	}
+	if (!ok || rename(tempPath.c_str(), path.c_str()) != 0)
+	{
+		std::runtime_error err = fileError("cannot write counter snapshot", path);
+		unlink(tempPath.c_str());
+		throw err;
+	}
+	syncDirectory(m_directory);
+
+	// the snapshot is in place; the log files it covers are no longer needed
+	for (uint64_t generation : logGenerations(m_directory))
+	{
+		if (generation <= covered)
+		{
+			unlink(logPath(m_directory, generation).c_str());
+		}
+	}
+}
+
+bool CounterLog::hotpCounter(uint64_t accountId, uint64_t * counter) const
+{
+	std::lock_guard<std::mutex> io(m_ioMutex);
+	std::unordered_map<uint64_t, AccountState>::const_iterator it = m_state.find(accountId);
+	if (it == m_state.end() || it->second.hotpCounter == 0)
+	{
+		return false;
+	}
+	*counter = it->second.hotpCounter;
+	return true;
+}
+
+bool CounterLog::lastTotpStep(uint64_t accountId, uint64_t * step) const
+{
+	std::lock_guard<std::mutex> io(m_ioMutex);
+	std::unordered_map<uint64_t, AccountState>::const_iterator it = m_state.find(accountId);
+	if (it == m_state.end() || it->second.totpSteps == 0)
+	{
+		return false;
+	}
+	*step = it->second.totpSteps - 1;
+	return true;
+}
+
+void CounterLog::restore(CredentialStore * store, ReplayTable * replay) const
+{
+	std::lock_guard<std::mutex> io(m_ioMutex);
+	for (size_t i = 0; i < store->size(); ++i)
+	{
+		std::unordered_map<uint64_t, AccountState>::const_iterator it = m_state.find(store->accountId(i));
+		if (it == m_state.end())
+		{
+			continue;
+		}
+
+		if (it->second.hotpCounter != 0 && store->params(i).kind == OtpKind::Hotp)
+		{
+			store->raiseCounter(i, it->second.hotpCounter);
+		}
+		if (it->second.totpSteps != 0 && replay != nullptr)
+		{
+			replay->tryAdvance(i, it->second.totpSteps - 1);
+		}
+	}
+}
+
+CounterLogStats CounterLog::stats() const
+{
+	CounterLogStats ret;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		ret.appended = m_appended;
+		ret.syncs = m_syncs;
+	}
+	{
+		std::lock_guard<std::mutex> io(m_ioMutex);
+		ret.logRecords = m_logRecords;
+		ret.generation = m_generation;
+	}
+	return ret;
+}
+
+}
+
+#if TEST_COUNTERLOG
+#include <iostream>
+#include <thread>
+
+int main(void)
+{
+	using namespace CppTotp;
+
+	char directoryTemplate[] = "test_counterlog.XXXXXX";
+	const std::string directory = mkdtemp(directoryTemplate);
+
+	uint64_t value = 0;
+	bool replayed = false;
+	bool grouped = false;
+	bool threaded = false;
+	{
+		CounterLog log(directory);
+
+		// many records, one sync
+		for (uint64_t i = 0; i < 100; ++i)
+		{
+			log.logHotpCounter(i, i + 10);
+		}
+		log.logTotpStep(500, 1000);
+		log.logTotpStep(500, 999);
+		log.syncAll();
+		grouped = log.stats().syncs == 1 && log.stats().logRecords == 102;
+
+		// waiting threads share the syncs
+		std::vector<std::thread> threads;
+		for (uint64_t t = 0; t < 4; ++t)
+		{
+			threads.emplace_back([&log, t]()
+			{
+				for (uint64_t i = 0; i < 50; ++i)
+				{
+					log.sync(log.logTotpStep(1000 + t, i));
+				}
+			});
+		}
+		for (std::thread & thread : threads)
+		{
+			thread.join();
+		}
+		threaded = log.stats().syncs <= 201 && log.lastTotpStep(1003, &value) && value == 49;
+	}
+	{
+		CounterLog log(directory);
+		replayed = log.hotpCounter(42, &value) && value == 52
+			&& log.lastTotpStep(500, &value) && value == 1000
+			&& !log.hotpCounter(500, &value)
+			&& log.stats().logRecords == 302 && log.stats().generation == 2;
+	}
+
+	// a checkpoint covers the log files, later records go into a new one
+	bool checkpointed = false;
+	{
+		CounterLog log(directory);
+		log.checkpoint();
+		log.sync(log.logHotpCounter(42, 60));
+		checkpointed = log.stats().logRecords == 1 && log.stats().generation == 4;
+	}
+
+	// a write torn by a crash is ignored
+	{
+		CounterLog log(directory);
+		log.sync(log.logHotpCounter(43, 70));
+		uint8_t garbage[CounterLog::RecordSize + 5] = { 1, 2, 3 };
+		int fd = open(logPath(directory, log.stats().generation).c_str(), O_WRONLY | O_APPEND);
+		checkpointed = checkpointed && writeAll(fd, garbage, sizeof(garbage));
+		close(fd);
+	}
+
+	const Bytes::ByteString key = reinterpret_cast<const uint8_t *>("12345678901234567890");
+	CredentialStore store(3);
+	store.add(42, HmacSha1Key(key), { OtpKind::Hotp, 6, 0, 0, 0 });
+	store.add(43, HmacSha1Key(key), { OtpKind::Hotp, 6, 0, 0, 100 });
+	store.add(500, HmacSha1Key(key), { OtpKind::Totp, 6, 30, 0, 0 });
+	ReplayTable replay(3);
+
+	bool restored = false;
+	{
+		CounterLog log(directory);
+		log.restore(&store, &replay);
+		restored = store.params(0).counter == 60
+			&& store.params(1).counter == 100
+			&& replay.lastAccepted(2, &value) && value == 1000
+			&& log.hotpCounter(43, &value) && value == 70;
+	}
+
+	std::cout
+		<< grouped << threaded << replayed << checkpointed << restored
+	<< std::endl;
+
+	for (uint64_t generation : logGenerations(directory))
+	{
+		unlink(logPath(directory, generation).c_str());
+	}
+	unlink((directory + "/" + SnapshotName).c_str());
+	rmdir(directory.c_str());
+
+	return 0;
+}
+#endif
@@ -0,0 +1,205 @@
+/**
+ * @file counterlog.h
+ *
+ * @brief Write-ahead log of HOTP counters and accepted TOTP steps.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#ifndef __CPPTOTP_COUNTERLOG_H__
+#define __CPPTOTP_COUNTERLOG_H__
+
+#include "credstore.h"
+#include "replaytable.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace CppTotp
+{
+
+/** What a CounterLog has done since it was opened. */
+struct CounterLogStats
+{
+	/** Records appended. */
+	uint64_t appended;
+
+	/** Calls to fdatasync() on the log, each committing a group of records. */
+	uint64_t syncs;
+
+	/** Records in the log files since the last checkpoint. */
+	uint64_t logRecords;
+
+	/** The generation of the log file being appended to. */
+	uint64_t generation;
+};
+
+/**
+ * Persists the per-account counter state (the next expected HOTP counter and
+ * the last accepted TOTP step) in a directory, so that it survives restarts.
+ *
+ * Changes are appended to a log file and committed in groups: sync() waits
+ * until a record is on disk, and whichever caller finds no write in progress
+ * writes everything appended so far with a single fdatasync() while the others
+ * wait for it. The rate of commits is thus bounded by the number of syncs the
+ * device manages, not the number of records.
+ *
+ * A checkpoint writes the whole state into a snapshot file and starts a new
+ * log file; the log files it covers are deleted. Opening the directory loads
+ * the snapshot and replays the log files after it, stopping at the first
+ * damaged record of each (a write torn by a crash), and starts a new log file.
+ * States only ever move forward and are merged by taking the maximum, so
+ * replaying a record twice is harmless.
+ *
+ * The files, all little-endian:
+ *
+ * - counters.snap: a 64-byte header (magic "CPOTPCTR", version (u32), record
+ *   size (u32), record count (u64), the generation of the last log file it
+ *   covers (u64), SHA-1 of all records (20 bytes), zero padding) followed by
+ *   24-byte records sorted by account ID: account ID (u64), next HOTP counter
+ *   (u64, 0 = none), last accepted TOTP step + 1 (u64, 0 = none)
+ * - counters-GENERATION.wal: 24-byte records: account ID (u64), value (u64),
+ *   kind (u8: 1 = next HOTP counter, 2 = accepted TOTP step), zero padding (3
+ *   bytes), check value of the rest and the generation (u32)
+ *
+ * All member functions may be called from multiple threads at once.
+ */
+class CounterLog
+{
+private:
+	/** An appended change waiting to be written. */
+	struct Change
+	{
+		uint64_t accountId;
+		uint64_t value;
+		uint8_t kind;
+	};
+
+	/** The state of an account; both fields move forward only. */
+	struct AccountState
+	{
+		uint64_t hotpCounter;
+		uint64_t totpSteps;
+	};
+
+	std::string m_directory;
+
+	/** Guards the appended changes and the progress of the commits. */
+	mutable std::mutex m_mutex;
+	std::condition_variable m_flushed;
+	std::vector<Change> m_pending;
+	uint64_t m_appended;
+	uint64_t m_durable;
+	bool m_flushing;
+	bool m_failed;
+	uint64_t m_syncs;
+
+	/** Guards the log file and the state it holds. */
+	mutable std::mutex m_ioMutex;
+	int m_fd;
+	uint64_t m_generation;
+	uint64_t m_logRecords;
+	std::unordered_map<uint64_t, AccountState> m_state;
+
+	/** Serializes checkpoints. */
+	std::mutex m_checkpointMutex;
+
+	uint64_t append(uint64_t accountId, uint64_t value, uint8_t kind);
+
+	/** Writes and syncs the pending changes; called with lock held and no flush in progress. */
+	void flush(std::unique_lock<std::mutex> & lock);
+
+	/** Creates the log file of the given generation and makes it current; needs m_ioMutex. */
+	void startLogFile(uint64_t generation);
+
+	void load();
+
+public:
+	/** The current version of the snapshot format. */
+	static const uint32_t Version = 1;
+
+	/** The size of the snapshot header and of each record, in bytes. */
+	static const size_t HeaderSize = 64;
+	static const size_t RecordSize = 24;
+
+	/**
+	 * Opens the log in the given (existing) directory and replays it.
+	 *
+	 * @throw std::runtime_error if a file cannot be read or written, or the
+	 * snapshot is malformed.
+	 */
+	explicit CounterLog(const std::string & directory);
+
+	/** Commits what is still pending, if possible, and closes the log. */
+	~CounterLog();
+
+	CounterLog(const CounterLog &) = delete;
+	CounterLog & operator=(const CounterLog &) = delete;
+
+	/**
+	 * Appends the next expected HOTP counter of the given account.
+	 *
+	 * @return the sequence number to pass to sync().
+	 */
+	uint64_t logHotpCounter(uint64_t accountId, uint64_t counter);
+
+	/**
+	 * Appends the last accepted TOTP step of the given account.
+	 *
+	 * @return the sequence number to pass to sync().
+	 */
+	uint64_t logTotpStep(uint64_t accountId, uint64_t step);
+
+	/**
+	 * Waits until the record with the given sequence number (and all before
+	 * it) is on disk.
+	 *
+	 * @throw std::runtime_error if the log cannot be written; the log stays
+	 * broken then.
+	 */
+	void sync(uint64_t sequence);
+
+	/** Waits until everything appended so far is on disk. */
+	void syncAll();
+
+	/**
+	 * Writes the committed state into a new snapshot and deletes the log files
+	 * it covers. Appending and syncing go on meanwhile.
+	 *
+	 * @throw std::runtime_error if the snapshot cannot be written.
+	 */
+	void checkpoint();
+
+	/**
+	 * Fetches the committed next expected HOTP counter of the given account.
+	 *
+	 * @return false if none has been logged.
+	 */
+	bool hotpCounter(uint64_t accountId, uint64_t * counter) const;
+
+	/**
+	 * Fetches the committed last accepted TOTP step of the given account.
+	 *
+	 * @return false if none has been logged.
+	 */
+	bool lastTotpStep(uint64_t accountId, uint64_t * step) const;
+
+	/**
+	 * Raises the HOTP counters of the store's accounts and advances their
+	 * steps in the replay table (if any) to the committed state.
+	 */
+	void restore(CredentialStore * store, ReplayTable * replay) const;
+
+	CounterLogStats stats() const;
+};
+
+}
+
+#endif
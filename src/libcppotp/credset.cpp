@@ -0,0 +1,471 @@
+/**
+ * @file credset.cpp
+ *
+ * @brief Implementation of the replaceable credential snapshots.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#include "credset.h"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+
+#include <cstring>
+
+namespace CppTotp
+{
+
+namespace
+{
+	/** A reading thread's pinned epoch, alone on its cache line. */
+	struct alignas(64) ReaderSlot
+	{
+		/** The epoch the thread's outermost Reader started in (0 = none). */
+		std::atomic<uint64_t> epoch;
+
+		std::atomic<bool> taken;
+	};
+
+	const size_t MaxReaderSlots = 1024;
+
+	/** The slots, shared by all sets; zeroed before any code runs. */
+	ReaderSlot g_slots[MaxReaderSlots];
+
+	/** The number of slots ever taken; writers only look at those. */
+	std::atomic<size_t> g_slotsUsed(0);
+
+	std::atomic<uint64_t> g_epoch(1);
+
+	/** Takes a free slot. */
+	ReaderSlot * takeSlot()
+	{
+		for (size_t i = 0; i < MaxReaderSlots; ++i)
+		{
+			bool expected = false;
+			if (!g_slots[i].taken.load(std::memory_order_relaxed) && g_slots[i].taken.compare_exchange_strong(expected, true, std::memory_order_acquire))
+			{
+				size_t used = g_slotsUsed.load(std::memory_order_relaxed);
+				while (used < i + 1 && !g_slotsUsed.compare_exchange_weak(used, i + 1, std::memory_order_seq_cst))
+				{
+				}
+				return &g_slots[i];
+			}
+		}
+		throw std::length_error("too many threads reading credential sets");
+	}
+
+	/** The slot of this thread, given back when it exits. */
+	struct ThreadReader
+	{
+		ReaderSlot * slot;
+		size_t depth;
+
+		ThreadReader()
+			: slot(nullptr), depth(0)
+		{
+		}
+
+		~ThreadReader()
+		{
+			if (slot != nullptr)
+			{
+				slot->epoch.store(0, std::memory_order_release);
+				slot->taken.store(false, std::memory_order_release);
+			}
+		}
+	};
+
+	thread_local ThreadReader t_reader;
+}
+
+/** Whether two keys have the same midstates. */
+static bool sameKey(const HmacSha1Key & a, const HmacSha1Key & b)
+{
+	return
+		std::memcmp(a.innerState(), b.innerState(), 5 * sizeof(uint32_t)) == 0 &&
+		std::memcmp(a.outerState(), b.outerState(), 5 * sizeof(uint32_t)) == 0
+	;
+}
+
+/** An HOTP counter to carry from one snapshot into the next. */
+struct CarriedCounter
+{
+	size_t from;
+	size_t to;
+
+	/** The next expected counter the account was added to the new snapshot with. */
+	uint64_t counter;
+};
+
+/**
+ * Holds the HOTP counters of the accounts in to that are unchanged from from,
+ * and returns where each of them comes from.
+ */
+static std::vector<CarriedCounter> holdCarriedCounters(const CredentialStore & from, CredentialStore * to)
+{
+	std::vector<CarriedCounter> ret;
+	for (size_t i = 0; i < from.size(); ++i)
+	{
+		if (from.params(i).kind != OtpKind::Hotp)
+		{
+			continue;
+		}
+
+		const size_t j = to->find(from.accountId(i));
+		if (j != CredentialStore::NotFound && to->params(j).kind == OtpKind::Hotp && sameKey(from.key(i), to->key(j)))
+		{
+			ret.push_back({ i, j, to->holdCounter(j) });
+		}
+	}
+	return ret;
+}
+
+/**
+ * Moves the held counters over, one account at a time: freezes the counter in
+ * from, so that no value is accepted there any more, and releases the one in
+ * to where it stopped.
+ */
+static void carryCounters(CredentialStore * from, CredentialStore * to, const std::vector<CarriedCounter> & carried)
+{
+	for (const CarriedCounter & c : carried)
+	{
+		const uint64_t counter = from->freezeCounter(c.from);
+		to->releaseCounter(c.to, (counter != CredentialStore::FrozenCounter) ? std::max(counter, c.counter) : c.counter);
+	}
+}
+
+CredentialSet::Reader::Reader(const CredentialSet & set)
+{
+	ThreadReader & reader = t_reader;
+	if (reader.depth == 0)
+	{
+		if (reader.slot == nullptr)
+		{
+			reader.slot = takeSlot();
+		}
+
+		// the epoch is visible before the pointer is looked at (both sequentially consistent)
+		reader.slot->epoch.store(g_epoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+	}
+	++reader.depth;
+
+	m_store = set.m_current.load(std::memory_order_seq_cst);
+}
+
+CredentialSet::Reader::~Reader()
+{
+	ThreadReader & reader = t_reader;
+	if (--reader.depth == 0)
+	{
+		reader.slot->epoch.store(0, std::memory_order_release);
+	}
+}
+
+CredentialSet::CredentialSet(std::unique_ptr<CredentialStore> initial)
+	: m_current(initial ? initial.release() : new CredentialStore(0))
+{
+}
+
+CredentialSet::~CredentialSet()
+{
+	for (const Retired & retired : m_retired)
+	{
+		delete retired.store;
+	}
+	delete m_current.load(std::memory_order_relaxed);
+}
+
+size_t CredentialSet::reclaimLocked()
+{
+	if (m_retired.empty())
+	{
+		return 0;
+	}
+
+	uint64_t oldest = std::numeric_limits<uint64_t>::max();
+	const size_t used = g_slotsUsed.load(std::memory_order_seq_cst);
+	for (size_t i = 0; i < used; ++i)
+	{
+		const uint64_t epoch = g_slots[i].epoch.load(std::memory_order_seq_cst);
+		if (epoch != 0)
+		{
+			oldest = std::min(oldest, epoch);
+		}
+	}
+
+	// readers that started in the retiring epoch or later got a newer snapshot
+	std::vector<Retired>::iterator kept = std::remove_if(m_retired.begin(), m_retired.end(), [&](const Retired & retired)
+	{
+		if (retired.epoch > oldest)
+		{
+			return false;
+		}
+
+		// the store wipes itself
+		delete retired.store;
+		return true;
+	});
+	m_retired.erase(kept, m_retired.end());
+
+	return m_retired.size();
+}
+
+void CredentialSet::publishLocked(std::unique_ptr<CredentialStore> store)
+{
+	// the new snapshot's readers wait for the carried counters instead of
+	// accepting a value the old one still can
+	CredentialStore * old = m_current.load(std::memory_order_relaxed);
+	const std::vector<CarriedCounter> carried = holdCarriedCounters(*old, store.get());
+
+	CredentialStore * current = store.release();
+	m_current.store(current, std::memory_order_seq_cst);
+	const uint64_t epoch = g_epoch.fetch_add(1, std::memory_order_seq_cst) + 1;
+	carryCounters(old, current, carried);
+	m_retired.push_back({ old, epoch });
+
+	reclaimLocked();
+}
+
+void CredentialSet::publish(std::unique_ptr<CredentialStore> store)
+{
+	std::lock_guard<std::mutex> lock(m_writeMutex);
+	publishLocked(std::move(store));
+}
+
+void CredentialSet::update(const CredentialDelta deltas[], size_t count)
+{
+	std::lock_guard<std::mutex> lock(m_writeMutex);
+	const CredentialStore & current = *m_current.load(std::memory_order_relaxed);
+
+	// only the last change to an account counts
+	std::unordered_map<uint64_t, size_t> last;
+	last.reserve(count);
+	size_t upserts = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		last[deltas[i].accountId] = i;
+		upserts += (deltas[i].kind == CredentialDelta::Kind::Upsert);
+	}
+
+	// the remaining accounts keep their order, the new ones go last
+	std::unique_ptr<CredentialStore> store(new CredentialStore(current.size() + upserts));
+	for (size_t i = 0; i < current.size(); ++i)
+	{
+		const uint64_t accountId = current.accountId(i);
+		std::unordered_map<uint64_t, size_t>::iterator change = last.find(accountId);
+		if (change == last.end())
+		{
+			store->add(accountId, current.key(i), current.params(i));
+			continue;
+		}
+
+		const CredentialDelta & delta = deltas[change->second];
+		if (delta.kind == CredentialDelta::Kind::Upsert)
+		{
+			store->add(accountId, delta.key, delta.params);
+		}
+		last.erase(change);
+	}
+	for (size_t i = 0; i < count; ++i)
+	{
+		std::unordered_map<uint64_t, size_t>::iterator change = last.find(deltas[i].accountId);
+		if (change != last.end() && change->second == i && deltas[i].kind == CredentialDelta::Kind::Upsert)
+		{
+			store->add(deltas[i].accountId, deltas[i].key, deltas[i].params);
+		}
+	}
+
+	publishLocked(std::move(store));
+}
+
+size_t CredentialSet::reclaim()
+{
+	std::lock_guard<std::mutex> lock(m_writeMutex);
+	return reclaimLocked();
+}
+
+void CredentialSet::synchronize()
+{
+	while (reclaim() > 0)
+	{
+		std::this_thread::yield();
+	}
+}
+
+}
+
+#if TEST_CREDSET
+#include "otp.h"
+
+#include <iostream>
+
+int main(void)
+{
+	using namespace CppTotp;
+
+	const Bytes::ByteString keyA = reinterpret_cast<const uint8_t *>("12345678901234567890");
+	const Bytes::ByteString keyB = reinterpret_cast<const uint8_t *>("abcdefghijabcdefghij");
+	const CredentialParams totpParams = { OtpKind::Totp, 8, 30, 0, 0 };
+	const CredentialParams hotpParams = { OtpKind::Hotp, 6, 0, 0, 0 };
+
+	std::unique_ptr<CredentialStore> initial(new CredentialStore(3));
+	initial->add(1, HmacSha1Key(keyA), totpParams);
+	initial->add(2, HmacSha1Key(keyA), hotpParams);
+	initial->add(3, HmacSha1Key(keyA), totpParams);
+	CredentialSet set(std::move(initial));
+
+	// a reader keeps its snapshot across an update and holds up its reclamation
+	bool pinned = true;
+	size_t stillPinned = 0;
+	{
+		CredentialSet::Reader reader(set);
+		pinned = pinned && reader->verifyHotp(reader->find(2), 755224, 0);
+
+		CredentialDelta deltas[] = {
+			{ CredentialDelta::Kind::Remove, 1, HmacSha1Key(), totpParams },
+			{ CredentialDelta::Kind::Upsert, 3, HmacSha1Key(keyB), totpParams },
+			{ CredentialDelta::Kind::Upsert, 4, HmacSha1Key(keyA), totpParams },
+		};
+		set.update(deltas, 3);
+
+		// the old snapshot refuses HOTP values after the update, so none is accepted twice
+		pinned = pinned && reader->find(1) != CredentialStore::NotFound && !reader->verifyHotp(reader->find(2), 287082, 0);
+		stillPinned = set.reclaim();
+
+		// nested readers see the pinned snapshot's successor, but pin nothing new
+		CredentialSet::Reader nested(set);
+		pinned = pinned && nested->find(1) == CredentialStore::NotFound;
+	}
+	size_t afterReaders = set.reclaim();
+
+	bool updated = false;
+	{
+		CredentialSet::Reader reader(set);
+		CredentialStore & store = reader.store();
+		updated = store.size() == 3
+			&& store.find(2) == 0 && store.find(3) == 1 && store.find(4) == 2
+			&& store.verifyTotp(store.find(4), 94287082, 59)
+			&& !store.verifyTotp(store.find(3), 94287082, 59)
+			&& store.params(store.find(2)).counter == 1
+			&& store.verifyHotp(store.find(2), 287082, 0)
+			&& !store.verifyHotp(store.find(2), 287082, 0);
+	}
+
+	// invalid changes publish nothing
+	CredentialDelta bad = { CredentialDelta::Kind::Upsert, 5, HmacSha1Key(keyA), { OtpKind::Totp, 0, 30, 0, 0 } };
+	bool rejected = false;
+	try
+	{
+		set.update(&bad, 1);
+	}
+	catch (const std::invalid_argument &)
+	{
+		rejected = true;
+	}
+
+	// readers on other threads during a stream of publications
+	std::atomic<bool> stop(false);
+	std::atomic<size_t> reads(0);
+	std::atomic<bool> consistent(true);
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < 3; ++t)
+	{
+		threads.emplace_back([&]()
+		{
+			while (!stop.load())
+			{
+				CredentialSet::Reader r(set);
+				size_t index = r->find(4);
+				if (index == CredentialStore::NotFound || !r->verifyTotp(index, 94287082, 59))
+				{
+					consistent.store(false);
+				}
+				reads.fetch_add(1);
+			}
+		});
+	}
+	for (uint64_t i = 0; i < 200; ++i)
+	{
+		CredentialDelta delta = { CredentialDelta::Kind::Upsert, 100 + i, HmacSha1Key(keyB), totpParams };
+		set.update(&delta, 1);
+	}
+	stop.store(true);
+	for (std::thread & thread : threads)
+	{
+		thread.join();
+	}
+	set.synchronize();
+
+	// HOTP values verified on another thread while large updates carry the
+	// counters over: each is accepted exactly once, and the account is never
+	// out of service for longer than its own carry
+	const size_t largeCount = 100000;
+	std::unique_ptr<CredentialStore> large(new CredentialStore(largeCount));
+	for (size_t i = 0; i < largeCount; ++i)
+	{
+		large->add(1000 + i, HmacSha1Key(keyA), hotpParams);
+	}
+	CredentialSet largeSet(std::move(large));
+	const uint64_t lastId = 1000 + largeCount - 1;
+
+	std::atomic<bool> updating(true);
+	std::atomic<bool> largeStop(false);
+	uint64_t next = 0;
+	size_t acceptedDuring = 0;
+	size_t accepted = 0;
+	size_t twice = 0;
+	std::thread verifier([&]()
+	{
+		while (!largeStop.load())
+		{
+			const bool during = updating.load();
+			const uint32_t code = hotp(keyA, next, 6);
+			uint64_t matched = 0;
+			bool valid;
+			{
+				CredentialSet::Reader r(largeSet);
+				valid = r->verifyHotp(r->find(lastId), code, 0, &matched) && matched == next;
+			}
+			if (!valid)
+			{
+				continue;
+			}
+
+			++accepted;
+			acceptedDuring += during;
+			++next;
+			CredentialSet::Reader again(largeSet);
+			twice += again->verifyHotp(again->find(lastId), code, 0);
+		}
+	});
+	for (uint64_t i = 0; i < 3; ++i)
+	{
+		CredentialDelta delta = { CredentialDelta::Kind::Upsert, i, HmacSha1Key(keyB), totpParams };
+		largeSet.update(&delta, 1);
+	}
+	updating.store(false);
+	largeStop.store(true);
+	verifier.join();
+	largeSet.synchronize();
+
+	bool carried = false;
+	{
+		CredentialSet::Reader reader(largeSet);
+		carried = reader->size() == largeCount + 3 && reader->params(reader->find(lastId)).counter == next;
+	}
+
+	std::cout
+		<< pinned << (stillPinned == 1) << (afterReaders == 0)
+		<< updated << rejected
+		<< consistent.load() << (reads.load() > 0) << (set.reclaim() == 0)
+		<< (accepted > 0 && acceptedDuring > 0 && twice == 0) << carried
+	<< std::endl;
+
+	return 0;
+}
+#endif
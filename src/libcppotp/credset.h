@@ -0,0 +1,153 @@
+/**
+ * @file credset.h
+ *
+ * @brief Snapshots of a credential store that can be replaced while in use.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#ifndef __CPPTOTP_CREDSET_H__
+#define __CPPTOTP_CREDSET_H__
+
+#include "credstore.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace CppTotp
+{
+
+/** A change to the accounts of a CredentialSet. */
+struct CredentialDelta
+{
+	enum class Kind : uint8_t
+	{
+		/** Adds the account, or replaces its key and parameters. */
+		Upsert = 0,
+
+		/** Removes the account, if it exists. */
+		Remove = 1,
+	};
+
+	Kind kind;
+	uint64_t accountId;
+
+	/** The key and parameters of an upserted account. */
+	HmacSha1Key key;
+	CredentialParams params;
+};
+
+/**
+ * The current snapshot of a set of accounts, replaceable without stopping the
+ * threads that verify against it (read-copy-update).
+ *
+ * A snapshot is a CredentialStore that is never added to once published.
+ * Readers take a Reader, which pins the snapshot current at that moment; this
+ * costs a sequentially consistent store to the thread's reader slot and a
+ * pointer load, and never waits. Writers build a new store off to the side, either from scratch
+ * or by applying deltas to a copy of the current one, and publish it with a
+ * single pointer swap; they are serialized among themselves only.
+ *
+ * Replaced snapshots are reclaimed with epochs: publishing advances a global
+ * epoch, and a snapshot retired at epoch E is destroyed (which wipes its
+ * secure memory) once no reader slot holds an epoch before E. Reclamation runs
+ * on the writer, after each publication and in reclaim() or synchronize().
+ *
+ * Account indices are only meaningful within a snapshot. Applying deltas keeps
+ * the order of the remaining accounts and appends new ones, so indices stay
+ * the same as long as nothing is removed.
+ *
+ * The HOTP counters of accounts whose key stays the same are carried into the
+ * new snapshot on publication, one account at a time after the swap: until an
+ * account's counter has been moved over, HOTP verifications in the new
+ * snapshot wait for it, and once it has, the replaced snapshot refuses that
+ * account's HOTP values. A value is thus never accepted in both; readers
+ * refused on a replaced snapshot should retry with a new Reader.
+ */
+class CredentialSet
+{
+public:
+	/**
+	 * Pins the current snapshot for as long as it lives. Readers may nest on a
+	 * thread; must not be passed to another thread.
+	 */
+	class Reader
+	{
+	private:
+		CredentialStore * m_store;
+
+	public:
+		explicit Reader(const CredentialSet & set);
+		~Reader();
+
+		Reader(const Reader &) = delete;
+		Reader & operator=(const Reader &) = delete;
+
+		CredentialStore & store() const { return *m_store; }
+		CredentialStore * operator->() const { return m_store; }
+	};
+
+private:
+	struct Retired
+	{
+		CredentialStore * store;
+		uint64_t epoch;
+	};
+
+	std::atomic<CredentialStore *> m_current;
+
+	/** Serializes writers. */
+	std::mutex m_writeMutex;
+	std::vector<Retired> m_retired;
+
+	/** Destroys the retired snapshots no reader can see any more; needs m_writeMutex. */
+	size_t reclaimLocked();
+
+	/** Swaps in the given snapshot and retires the old one; needs m_writeMutex. */
+	void publishLocked(std::unique_ptr<CredentialStore> store);
+
+public:
+	/** Starts with the given snapshot (or an empty one). */
+	explicit CredentialSet(std::unique_ptr<CredentialStore> initial = std::unique_ptr<CredentialStore>());
+
+	/** Destroys all snapshots; there must be no readers left. */
+	~CredentialSet();
+
+	CredentialSet(const CredentialSet &) = delete;
+	CredentialSet & operator=(const CredentialSet &) = delete;
+
+	/**
+	 * Makes the given store the current snapshot; it must not be added to any
+	 * more.
+	 */
+	void publish(std::unique_ptr<CredentialStore> store);
+
+	/**
+	 * Publishes a copy of the current snapshot with the given changes applied
+	 * in order.
+	 *
+	 * @throw std::invalid_argument if an upsert has invalid parameters; nothing
+	 * is published then.
+	 */
+	void update(const CredentialDelta deltas[], size_t count);
+
+	/**
+	 * Destroys the replaced snapshots that no reader can see any more.
+	 *
+	 * @return the number of replaced snapshots still pinned by readers.
+	 */
+	size_t reclaim();
+
+	/** Waits until all replaced snapshots have been destroyed. */
+	void synchronize();
+};
+
+}
+
+#endif
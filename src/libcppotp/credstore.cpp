@@ -0,0 +1,402 @@
+/**
+ * @file credstore.cpp
+ *
+ * @brief Implementation of the in-memory account store.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#include "credstore.h"
+#include "hashmix.h"
+#include "otp.h"
+#include "securemem.h"
+
+#include <algorithm>
+#include <new>
+#include <stdexcept>
+#include <thread>
+
+#include <cstring>
+
+namespace CppTotp
+{
+
+static const size_t CacheLineSize = 64;
+
+static size_t roundUpToCacheLine(size_t size)
+{
+	return (size + CacheLineSize - 1) & ~(CacheLineSize - 1);
+}
+
+static size_t slotCountFor(size_t capacity)
+{
+	// keep the load factor at or below one half
+	size_t slots = 16;
+	while (slots < 2 * capacity)
+	{
+		slots *= 2;
+	}
+	return slots;
+}
+
+/** Carves the next cache-line-aligned array out of the allocation. */
+template <typename T>
+static T * carve(uint8_t ** cursor, size_t count)
+{
+	T * ret = reinterpret_cast<T *>(*cursor);
+	*cursor += roundUpToCacheLine(count * sizeof(T));
+	return ret;
+}
+
+CredentialStore::CredentialStore(size_t capacity)
+	: m_capacity(capacity), m_size(0)
+{
+	if (capacity >= 0xFFFFFFFFu)
+	{
+		throw std::length_error("credential store capacity too large");
+	}
+
+	const size_t slotCount = slotCountFor(capacity);
+	m_slotMask = slotCount - 1;
+
+	m_memorySize =
+		10 * roundUpToCacheLine(capacity * sizeof(uint32_t)) +
+		roundUpToCacheLine(capacity * sizeof(uint64_t)) +
+		2 * roundUpToCacheLine(capacity * sizeof(uint8_t)) +
+		roundUpToCacheLine(capacity * sizeof(uint32_t)) +
+		roundUpToCacheLine(capacity * sizeof(uint64_t)) +
+		roundUpToCacheLine(capacity * sizeof(std::atomic<uint64_t>)) +
+		roundUpToCacheLine(slotCount * sizeof(uint32_t))
+	;
+
+	// over-allocate to be able to align the start; the midstates are secret, so
+	// keep them out of swap and core dumps
+	m_memory = static_cast<uint8_t *>(SecureArena::instance().allocate(m_memorySize + CacheLineSize));
+	std::memset(m_memory, 0, m_memorySize + CacheLineSize);
+
+	uint8_t * cursor = m_memory + (CacheLineSize - reinterpret_cast<uintptr_t>(m_memory) % CacheLineSize) % CacheLineSize;
+	for (size_t i = 0; i < 5; ++i)
+	{
+		m_inner[i] = carve<uint32_t>(&cursor, capacity);
+		m_outer[i] = carve<uint32_t>(&cursor, capacity);
+	}
+	m_ids = carve<uint64_t>(&cursor, capacity);
+	m_kinds = carve<uint8_t>(&cursor, capacity);
+	m_digits = carve<uint8_t>(&cursor, capacity);
+	m_timeSteps = carve<uint32_t>(&cursor, capacity);
+	m_timeStarts = carve<uint64_t>(&cursor, capacity);
+	m_counters = carve<std::atomic<uint64_t> >(&cursor, capacity);
+	m_slots = carve<uint32_t>(&cursor, slotCount);
+
+	for (size_t i = 0; i < capacity; ++i)
+	{
+		new (&m_counters[i]) std::atomic<uint64_t>(0);
+	}
+}
+
+CredentialStore::~CredentialStore()
+{
+	// the arena wipes the memory
+	SecureArena::instance().deallocate(m_memory, m_memorySize + CacheLineSize);
+}
+
+size_t CredentialStore::bytesPerAccount() const
+{
+	// the whole allocation: cache-line rounding and the index slots included
+	return (m_memorySize + CacheLineSize) / std::max<size_t>(m_capacity, 1);
+}
+
+size_t CredentialStore::slotOf(uint64_t accountId) const
+{
+	size_t slot = static_cast<size_t>(mix64(accountId)) & m_slotMask;
+
+	// linear probing; stops at the account's slot or the first empty one
+	while (m_slots[slot] != 0 && m_ids[m_slots[slot] - 1] != accountId)
+	{
+		slot = (slot + 1) & m_slotMask;
+	}
+	return slot;
+}
+
+size_t CredentialStore::add(uint64_t accountId, const HmacSha1Key & key, const CredentialParams & params)
+{
+	if (m_size == m_capacity)
+	{
+		throw std::length_error("credential store is full");
+	}
+	if (params.digits < 1 || params.digits > 9)
+	{
+		throw std::invalid_argument("digit count must be between 1 and 9");
+	}
+	if (params.kind == OtpKind::Totp && params.timeStep == 0)
+	{
+		throw std::invalid_argument("TOTP time step must not be zero");
+	}
+
+	size_t slot = slotOf(accountId);
+	if (m_slots[slot] != 0)
+	{
+		throw std::invalid_argument("account ID already in credential store");
+	}
+
+	size_t index = m_size;
+	for (size_t i = 0; i < 5; ++i)
+	{
+		m_inner[i][index] = key.innerState()[i];
+		m_outer[i][index] = key.outerState()[i];
+	}
+	m_ids[index] = accountId;
+	m_kinds[index] = static_cast<uint8_t>(params.kind);
+	m_digits[index] = params.digits;
+	m_timeSteps[index] = params.timeStep;
+	m_timeStarts[index] = params.timeStart;
+	m_counters[index].store(params.counter, std::memory_order_relaxed);
+
+	m_slots[slot] = static_cast<uint32_t>(index + 1);
+	++m_size;
+
+	return index;
+}
+
+size_t CredentialStore::find(uint64_t accountId) const
+{
+	size_t slot = slotOf(accountId);
+	if (m_slots[slot] == 0)
+	{
+		return NotFound;
+	}
+	return m_slots[slot] - 1;
+}
+
+HmacSha1Key CredentialStore::key(size_t index) const
+{
+	uint32_t inner[5];
+	uint32_t outer[5];
+
+	for (size_t i = 0; i < 5; ++i)
+	{
+		inner[i] = m_inner[i][index];
+		outer[i] = m_outer[i][index];
+	}
+
+	HmacSha1Key ret(inner, outer);
+	Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(inner), sizeof(inner));
+	Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(outer), sizeof(outer));
+	return ret;
+}
+
+CredentialParams CredentialStore::params(size_t index) const
+{
+	CredentialParams ret;
+	ret.kind = static_cast<OtpKind>(m_kinds[index]);
+	ret.digits = m_digits[index];
+	ret.timeStep = m_timeSteps[index];
+	ret.timeStart = m_timeStarts[index];
+	ret.counter = loadCounter(index);
+	return ret;
+}
+
+void CredentialStore::gatherLanes(const size_t indices[], size_t count, Sha1LaneStates * inner, Sha1LaneStates * outer) const
+{
+	for (size_t i = 0; i < 5; ++i)
+	{
+		size_t lane;
+		for (lane = 0; lane < count; ++lane)
+		{
+			inner->h[i][lane] = m_inner[i][indices[lane]];
+			outer->h[i][lane] = m_outer[i][indices[lane]];
+		}
+		for (; lane < Sha1MaxLanes; ++lane)
+		{
+			inner->h[i][lane] = 0;
+			outer->h[i][lane] = 0;
+		}
+	}
+}
+
+void CredentialStore::generateMany(const size_t indices[], const uint64_t counters[], size_t count, uint32_t out[]) const
+{
+	Sha1LaneStates inner;
+	Sha1LaneStates outer;
+	Sha1LaneStates digests;
+
+	for (size_t first = 0; first < count; first += Sha1MaxLanes)
+	{
+		size_t lanes = count - first;
+		if (lanes > Sha1MaxLanes)
+		{
+			lanes = Sha1MaxLanes;
+		}
+
+		gatherLanes(&indices[first], lanes, &inner, &outer);
+		hmacSha1CounterLanes(inner, outer, &counters[first], lanes, &digests);
+
+		for (size_t lane = 0; lane < lanes; ++lane)
+		{
+			out[first + lane] = hotpFromLane(digests, lane, m_digits[indices[first + lane]]);
+		}
+	}
+
+	Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(&inner), sizeof(inner));
+	Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(&outer), sizeof(outer));
+	Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(&digests), sizeof(digests));
+}
+
+bool CredentialStore::verifyTotp(size_t index, uint32_t code, uint64_t timeNow, size_t window, int64_t * matchedOffset) const
+{
+	return CppTotp::verifyTotp(key(index), code, timeNow, m_timeStarts[index], m_timeSteps[index], window, m_digits[index], matchedOffset);
+}
+
+bool CredentialStore::advanceCounter(size_t index, uint64_t seen, uint64_t next)
+{
+	// only move forward; a concurrent verification may have won
+	uint64_t current = seen;
+	while (current < next)
+	{
+		if (m_counters[index].compare_exchange_weak(current, next, std::memory_order_acq_rel))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+uint64_t CredentialStore::loadCounter(size_t index) const
+{
+	// held only for as long as a publication takes to carry it over
+	uint64_t counter = m_counters[index].load(std::memory_order_acquire);
+	while (counter == HeldCounter)
+	{
+		std::this_thread::yield();
+		counter = m_counters[index].load(std::memory_order_acquire);
+	}
+	return counter;
+}
+
+bool CredentialStore::verifyHotp(size_t index, uint32_t code, size_t lookAhead, uint64_t * matchedCounter)
+{
+	const uint64_t expected = loadCounter(index);
+	uint64_t matched = 0;
+
+	if (expected == FrozenCounter || !hotpSearch(key(index), expected, lookAhead, code, &matched, m_digits[index]) || !advanceCounter(index, expected, matched + 1))
+	{
+		return false;
+	}
+
+	if (matchedCounter != nullptr)
+	{
+		*matchedCounter = matched;
+	}
+	return true;
+}
+
+void CredentialStore::raiseCounter(size_t index, uint64_t counter)
+{
+	advanceCounter(index, m_counters[index].load(std::memory_order_acquire), counter);
+}
+
+uint64_t CredentialStore::freezeCounter(size_t index)
+{
+	// a verification that loaded the old value fails its exchange afterwards
+	return m_counters[index].exchange(FrozenCounter, std::memory_order_acq_rel);
+}
+
+uint64_t CredentialStore::holdCounter(size_t index)
+{
+	return m_counters[index].exchange(HeldCounter, std::memory_order_acq_rel);
+}
+
+void CredentialStore::releaseCounter(size_t index, uint64_t counter)
+{
+	uint64_t held = HeldCounter;
+	m_counters[index].compare_exchange_strong(held, counter, std::memory_order_acq_rel);
+}
+
+bool CredentialStore::resyncHotp(size_t index, uint32_t code, uint32_t secondCode, size_t lookAhead, uint64_t * matchedCounter)
+{
+	const uint64_t expected = loadCounter(index);
+	uint64_t matched = 0;
+
+	if (expected == FrozenCounter || !hotpSearch(key(index), expected, lookAhead, code, secondCode, &matched, m_digits[index]) || !advanceCounter(index, expected, matched + 2))
+	{
+		return false;
+	}
+
+	if (matchedCounter != nullptr)
+	{
+		*matchedCounter = matched;
+	}
+	return true;
+}
+
+}
+
+#if TEST_CREDSTORE
+#include <iostream>
+#include <vector>
+
+int main(void)
+{
+	using namespace CppTotp;
+
+	const Bytes::ByteString key = reinterpret_cast<const uint8_t *>("12345678901234567890");
+	CredentialStore store(1000);
+
+	CredentialParams totpParams = { OtpKind::Totp, 8, 30, 0, 0 };
+	CredentialParams hotpParams = { OtpKind::Hotp, 6, 0, 0, 3 };
+	for (uint64_t i = 0; i < 1000; ++i)
+	{
+		store.add(i * 7919, HmacSha1Key(key), (i % 2 == 0) ? totpParams : hotpParams);
+	}
+
+	size_t totpIndex = store.find(42 * 7919);
+	size_t hotpIndex = store.find(43 * 7919);
+	int64_t offset = 0;
+	uint64_t counter = 0;
+
+	size_t indices[20];
+	uint64_t counters[20];
+	uint32_t codes[20];
+	for (size_t i = 0; i < 20; ++i)
+	{
+		indices[i] = store.find(i * 7919);
+		counters[i] = 1;
+	}
+	store.generateMany(indices, counters, 20, codes);
+
+	// a last chunk narrower than the SIMD groups, in exactly sized heap arrays
+	const size_t manyCount = 21;
+	std::vector<size_t> manyIndices(manyCount);
+	std::vector<uint64_t> manyCounters(manyCount);
+	std::vector<uint32_t> manyCodes(manyCount);
+	for (size_t i = 0; i < manyCount; ++i)
+	{
+		manyIndices[i] = (i * 37) % store.size();
+		manyCounters[i] = 1000 + i;
+	}
+	store.generateMany(manyIndices.data(), manyCounters.data(), manyCount, manyCodes.data());
+	bool manySame = true;
+	for (size_t i = 0; i < manyCount; ++i)
+	{
+		manySame = manySame && manyCodes[i] == hotp(store.key(manyIndices[i]), manyCounters[i], store.params(manyIndices[i]).digits);
+	}
+
+	std::cout
+		<< (store.find(12345) == CredentialStore::NotFound)
+		<< (store.accountId(totpIndex) == 42 * 7919)
+		<< store.verifyTotp(totpIndex, 94287082, 89, 1, &offset) << (offset == -1)
+		<< !store.verifyHotp(hotpIndex, 338314, 0)
+		<< store.verifyHotp(hotpIndex, 338314, 1, &counter) << (counter == 4)
+		<< !store.verifyHotp(hotpIndex, 338314, 5)
+		<< (store.params(hotpIndex).counter == 5)
+		<< store.resyncHotp(hotpIndex, 162583, 399871, 100, &counter) << (counter == 7)
+		<< (store.params(hotpIndex).counter == 9)
+		<< (codes[0] == 94287082) << (codes[1] == 287082)
+		<< manySame
+		<< (store.bytesPerAccount() >= 10 * 4 + 8 + 2 + 4 + 8 + 8 + 2 * 4)
+	<< std::endl;
+
+	return 0;
+}
+#endif
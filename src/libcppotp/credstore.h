@@ -0,0 +1,215 @@
+/**
+ * @file credstore.h
+ *
+ * @brief In-memory store of one-time-password accounts.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#ifndef __CPPTOTP_CREDSTORE_H__
+#define __CPPTOTP_CREDSTORE_H__
+
+#include "sha1.h"
+#include "sha1lanes.h"
+
+#include <atomic>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace CppTotp
+{
+
+/** The kind of one-time password an account uses. */
+enum class OtpKind : uint8_t
+{
+	Totp = 0,
+	Hotp = 1,
+};
+
+/** The parameters of an account, apart from its key. */
+struct CredentialParams
+{
+	/** TOTP or HOTP. */
+	OtpKind kind;
+
+	/** The number of digits of a value. */
+	uint8_t digits;
+
+	/** The TOTP time step, in seconds. */
+	uint32_t timeStep;
+
+	/** The TOTP start time. */
+	uint64_t timeStart;
+
+	/** The next expected HOTP counter. */
+	uint64_t counter;
+};
+
+/**
+ * A fixed-capacity store of accounts, each consisting of an HMAC-SHA-1 key (as
+ * its pad midstates) and its parameters.
+ *
+ * The records are kept as a structure of arrays aligned to cache lines; the
+ * midstates are word-major, so the same word of consecutive accounts is
+ * contiguous and can be loaded straight into SIMD lanes. Accounts are looked
+ * up by ID through an open-addressing index. All memory is allocated up front;
+ * lookups and verification never allocate.
+ *
+ * Adding accounts must not race with any other access; everything else may be
+ * called from multiple threads at once. HOTP counters are advanced atomically.
+ */
+class CredentialStore
+{
+private:
+	size_t m_capacity;
+	size_t m_size;
+
+	/** The single allocation holding all the arrays. */
+	uint8_t * m_memory;
+	size_t m_memorySize;
+
+	/** The midstates, word-major: m_inner[word][index]. */
+	uint32_t * m_inner[5];
+	uint32_t * m_outer[5];
+
+	uint64_t * m_ids;
+	uint8_t * m_kinds;
+	uint8_t * m_digits;
+	uint32_t * m_timeSteps;
+	uint64_t * m_timeStarts;
+	std::atomic<uint64_t> * m_counters;
+
+	/** The open-addressing index; holds account index + 1 (0 = empty). */
+	uint32_t * m_slots;
+	size_t m_slotMask;
+
+	size_t slotOf(uint64_t accountId) const;
+
+	/** Moves the HOTP counter from seen to next unless someone else moved it. */
+	bool advanceCounter(size_t index, uint64_t seen, uint64_t next);
+
+	/** Loads the HOTP counter of the account, waiting while it is held. */
+	uint64_t loadCounter(size_t index) const;
+
+public:
+	/** Returned by find() if the account does not exist. */
+	static const size_t NotFound = static_cast<size_t>(-1);
+
+	/** The HOTP counter of an account after freezeCounter(). */
+	static const uint64_t FrozenCounter = static_cast<uint64_t>(-1);
+
+	/** The HOTP counter of an account between holdCounter() and releaseCounter(). */
+	static const uint64_t HeldCounter = static_cast<uint64_t>(-2);
+
+	/** Creates an empty store with room for the given number of accounts. */
+	explicit CredentialStore(size_t capacity);
+	~CredentialStore();
+
+	CredentialStore(const CredentialStore &) = delete;
+	CredentialStore & operator=(const CredentialStore &) = delete;
+
+	/** The number of bytes allocated per account of the capacity (including the index). */
+	size_t bytesPerAccount() const;
+
+	/** The maximum number of accounts. */
+	size_t capacity() const { return m_capacity; }
+
+	/** The number of accounts. */
+	size_t size() const { return m_size; }
+
+	/**
+	 * Adds an account and returns its index.
+	 *
+	 * @throw std::length_error if the store is full.
+	 * @throw std::invalid_argument if the ID is already taken or the parameters
+	 * are invalid.
+	 */
+	size_t add(uint64_t accountId, const HmacSha1Key & key, const CredentialParams & params);
+
+	/** Returns the index of the given account, or NotFound. */
+	size_t find(uint64_t accountId) const;
+
+	/** The ID of the account at the given index. */
+	uint64_t accountId(size_t index) const { return m_ids[index]; }
+
+	/** The key of the account at the given index. */
+	HmacSha1Key key(size_t index) const;
+
+	/** The parameters of the account at the given index. */
+	CredentialParams params(size_t index) const;
+
+	/**
+	 * Copies the midstates of the given accounts into the lanes; lanes past
+	 * count are zeroed.
+	 */
+	void gatherLanes(const size_t indices[], size_t count, Sha1LaneStates * inner, Sha1LaneStates * outer) const;
+
+	/**
+	 * Calculates the values of many account/counter pairs, each with the
+	 * account's digit count.
+	 */
+	void generateMany(const size_t indices[], const uint64_t counters[], size_t count, uint32_t out[]) const;
+
+	/**
+	 * Checks a TOTP value of the account at the given index.
+	 *
+	 * @see verifyTotp(const HmacSha1Key &, uint32_t, uint64_t, uint64_t, uint64_t, size_t, size_t, int64_t *)
+	 */
+	bool verifyTotp(size_t index, uint32_t code, uint64_t timeNow, size_t window = 1, int64_t * matchedOffset = nullptr) const;
+
+	/**
+	 * Checks an HOTP value of the account at the given index against the next
+	 * expected counter and the given number of counters after it; on success,
+	 * the next expected counter is advanced past the matching one.
+	 */
+	bool verifyHotp(size_t index, uint32_t code, size_t lookAhead = 0, uint64_t * matchedCounter = nullptr);
+
+	/**
+	 * Raises the next expected HOTP counter of the account at the given index
+	 * to the given one; never lowers it.
+	 */
+	void raiseCounter(size_t index, uint64_t counter);
+
+	/**
+	 * Stops the HOTP counter of the account at the given index: from then on,
+	 * verifyHotp() and resyncHotp() fail for it and raiseCounter() does
+	 * nothing. A verification that is under way either completes before or
+	 * fails.
+	 *
+	 * @return the next expected counter it had, or FrozenCounter if it was
+	 * already frozen.
+	 */
+	uint64_t freezeCounter(size_t index);
+
+	/**
+	 * Holds the HOTP counter of the account at the given index until
+	 * releaseCounter(); verifyHotp(), resyncHotp() and params() wait for it
+	 * meanwhile. Meant for a store about to be published whose counters are
+	 * still moving in the one it replaces.
+	 *
+	 * @return the next expected counter it had.
+	 */
+	uint64_t holdCounter(size_t index);
+
+	/**
+	 * Continues a held HOTP counter of the account at the given index at the
+	 * given next expected counter; does nothing unless it is held.
+	 */
+	void releaseCounter(size_t index, uint64_t counter);
+
+	/**
+	 * Resynchronizes the HOTP counter of the account at the given index with
+	 * two consecutive values from its token, searching the given number of
+	 * counters after the next expected one; on success, the next expected
+	 * counter is advanced past the second value.
+	 *
+	 * @see hotpSearch(const HmacSha1Key &, uint64_t, size_t, uint32_t, uint32_t, uint64_t *, size_t)
+	 */
+	bool resyncHotp(size_t index, uint32_t code, uint32_t secondCode, size_t lookAhead, uint64_t * matchedCounter = nullptr);
+};
+
+}
+
+#endif
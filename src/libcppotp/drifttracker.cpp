@@ -0,0 +1,275 @@
+/**
+ * @file drifttracker.cpp
+ *
+ * @brief Implementation of the clock drift tracker.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#include "drifttracker.h"
+#include "metrics.h"
+#include "otp.h"
+
+#include <stdexcept>
+
+namespace CppTotp
+{
+
+/** Matches in a row at the learned offset after which the window narrows. */
+static const size_t NarrowAfterMatches = 4;
+
+/** Failures in a row after which the window is reset to the maximum. */
+static const size_t WidenAfterFailures = 3;
+
+/**
+ * The state of an account, packed into 16 bits: the offset (5 bits, two's
+ * complement), the narrowing of the window below the maximum (4 bits), the
+ * matches in a row at the offset (3 bits) and the failures in a row (2 bits).
+ * All zeroes is the initial state.
+ */
+struct UnpackedDrift
+{
+	int64_t offset;
+	size_t narrowing;
+	size_t matches;
+	size_t failures;
+};
+
+static UnpackedDrift unpackDrift(uint16_t packed)
+{
+	UnpackedDrift ret;
+	int64_t offset = packed & 0x1F;
+	ret.offset = (offset >= 16) ? offset - 32 : offset;
+	ret.narrowing = (packed >> 5) & 0xF;
+	ret.matches = (packed >> 9) & 0x7;
+	ret.failures = (packed >> 12) & 0x3;
+	return ret;
+}
+
+static uint16_t packDrift(const UnpackedDrift & drift)
+{
+	return static_cast<uint16_t>(
+		(static_cast<uint16_t>(drift.offset) & 0x1F) |
+		(drift.narrowing << 5) |
+		(drift.matches << 9) |
+		(drift.failures << 12)
+	);
+}
+
+DriftTracker::DriftTracker(size_t size, size_t maxWindow, size_t minWindow)
+	: m_states(nullptr), m_size(size), m_maxWindow(maxWindow), m_minWindow(minWindow)
+{
+	if (minWindow > maxWindow || maxWindow > MaxWindow)
+	{
+		throw std::invalid_argument("drift tracker windows out of range");
+	}
+
+	m_states = new std::atomic<uint16_t>[size];
+	for (size_t i = 0; i < size; ++i)
+	{
+		m_states[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+DriftTracker::~DriftTracker()
+{
+	delete[] m_states;
+}
+
+DriftState DriftTracker::state(size_t index) const
+{
+	UnpackedDrift drift = unpackDrift(m_states[index].load(std::memory_order_relaxed));
+
+	DriftState ret;
+	ret.offset = drift.offset;
+	ret.window = m_maxWindow - drift.narrowing;
+	return ret;
+}
+
+void DriftTracker::reset(size_t index)
+{
+	m_states[index].store(0, std::memory_order_relaxed);
+}
+
+bool DriftTracker::verifyTotp(
+	size_t index, const HmacSha1Key & key, uint32_t code, uint64_t timeNow,
+	uint64_t timeStart, uint64_t timeStep, size_t digitCount, int64_t * matchedOffset
+)
+{
+	CPPTOTP_METRIC_ADD(Verifies, 1);
+
+	const uint64_t timeValue = (timeNow - timeStart) / timeStep;
+	const int64_t maxWindow = static_cast<int64_t>(m_maxWindow);
+
+	uint16_t packed = m_states[index].load(std::memory_order_relaxed);
+	UnpackedDrift drift = unpackDrift(packed);
+
+	// the state may come from a tracker with a larger window
+	if (drift.narrowing > m_maxWindow - m_minWindow)
+	{
+		drift.narrowing = m_maxWindow - m_minWindow;
+	}
+	if (drift.offset < -maxWindow || drift.offset > maxWindow)
+	{
+		drift.offset = 0;
+	}
+	const int64_t window = maxWindow - static_cast<int64_t>(drift.narrowing);
+
+	// the learned offset first, then outwards from it
+	bool found = false;
+	int64_t matched = 0;
+	for (int64_t distance = 0; distance <= window && !found; ++distance)
+	{
+		for (int64_t sign = -1; sign <= 1 && !found; sign += 2)
+		{
+			const int64_t offset = drift.offset + sign * distance;
+			if ((distance == 0 && sign == 1) || offset < -maxWindow || offset > maxWindow)
+			{
+				continue;
+			}
+
+			// steps before the epoch don't exist
+			if (offset < 0 && timeValue < static_cast<uint64_t>(-offset))
+			{
+				continue;
+			}
+
+			if (hotp(key, timeValue + static_cast<uint64_t>(offset), digitCount) == code)
+			{
+				found = true;
+				matched = offset;
+			}
+		}
+	}
+
+	if (found)
+	{
+		drift.failures = 0;
+		if (matched == drift.offset)
+		{
+			if (++drift.matches >= NarrowAfterMatches)
+			{
+				drift.matches = 0;
+				if (window > static_cast<int64_t>(m_minWindow))
+				{
+					++drift.narrowing;
+				}
+			}
+		}
+		else
+		{
+			// follow the drift; widen if it reached the edge of the window
+			if ((matched - drift.offset == window || drift.offset - matched == window) && drift.narrowing > 0)
+			{
+				--drift.narrowing;
+			}
+			drift.offset = matched;
+			drift.matches = 0;
+		}
+	}
+	else
+	{
+		drift.matches = 0;
+		if (++drift.failures >= WidenAfterFailures)
+		{
+			drift.failures = 0;
+			drift.narrowing = 0;
+		}
+	}
+
+	// losing against a concurrent update only delays learning
+	m_states[index].compare_exchange_strong(packed, packDrift(drift), std::memory_order_relaxed);
+
+	CPPTOTP_PROBE2(verify, found, matched);
+	if (found)
+	{
+		CPPTOTP_METRIC_ADD(VerifyMatches, 1);
+		CPPTOTP_METRIC_WINDOW_HIT(matched);
+		if (matchedOffset != nullptr)
+		{
+			*matchedOffset = matched;
+		}
+	}
+	return found;
+}
+
+bool DriftTracker::verifyTotp(const CredentialStore & store, size_t index, uint32_t code, uint64_t timeNow, int64_t * matchedOffset)
+{
+	const CredentialParams params = store.params(index);
+	return verifyTotp(index, store.key(index), code, timeNow, params.timeStart, params.timeStep, params.digits, matchedOffset);
+}
+
+}
+
+#if TEST_DRIFTTRACKER
+#include <iostream>
+
+int main(void)
+{
+	using namespace CppTotp;
+
+	const Bytes::ByteString rawKey = reinterpret_cast<const uint8_t *>("12345678901234567890");
+	const HmacSha1Key key(rawKey);
+	const uint64_t timeNow = 1111111109;
+	const uint64_t step = timeNow / 30;
+
+	DriftTracker tracker(4, 2, 1);
+	int64_t offset = 99;
+
+	// a client one step ahead is found within the initial window...
+	bool first = tracker.verifyTotp(0, key, hotp(key, step + 1, 8), timeNow, 0, 30, 8, &offset) && offset == 1;
+	DriftState learned = tracker.state(0);
+
+	// ...and narrows it after enough matches there
+	bool stable = true;
+	for (size_t i = 0; i < 4; ++i)
+	{
+		stable = stable && tracker.verifyTotp(0, key, hotp(key, step + 1, 8), timeNow, 0, 30, 8);
+	}
+	DriftState narrowed = tracker.state(0);
+
+	// a match on the edge follows the drift and widens the window again
+	bool edge = tracker.verifyTotp(0, key, hotp(key, step + 2, 8), timeNow, 0, 30, 8, &offset) && offset == 2;
+	DriftState followed = tracker.state(0);
+
+	// two steps behind is outside the window around +2, and three steps ahead
+	// is outside the maximum window around the server's step
+	bool outside = !tracker.verifyTotp(0, key, hotp(key, step - 2, 8), timeNow, 0, 30, 8)
+		&& !tracker.verifyTotp(0, key, hotp(key, step + 3, 8), timeNow, 0, 30, 8);
+
+	// on a fresh account: narrow the window at +1, then fail three times in a
+	// row; only the third failure restores the maximum window
+	tracker.verifyTotp(2, key, hotp(key, step + 1, 8), timeNow, 0, 30, 8);
+	for (size_t i = 0; i < 4; ++i)
+	{
+		tracker.verifyTotp(2, key, hotp(key, step + 1, 8), timeNow, 0, 30, 8);
+	}
+	DriftState beforeFailures = tracker.state(2);
+	tracker.verifyTotp(2, key, 12345678, timeNow, 0, 30, 8);
+	tracker.verifyTotp(2, key, 12345678, timeNow, 0, 30, 8);
+	DriftState twoFailures = tracker.state(2);
+	tracker.verifyTotp(2, key, 12345678, timeNow, 0, 30, 8);
+	DriftState afterFailures = tracker.state(2);
+
+	// the store variant, with the RFC 6238 test value
+	CredentialStore store(1);
+	store.add(7, key, { OtpKind::Totp, 8, 30, 0, 0 });
+	bool fromStore = tracker.verifyTotp(store, 0, 7081804, timeNow, &offset) && offset == 0;
+	tracker.reset(1);
+
+	std::cout
+		<< first << (learned.offset == 1 && learned.window == 2)
+		<< stable << (narrowed.offset == 1 && narrowed.window == 1)
+		<< edge << (followed.offset == 2 && followed.window == 2)
+		<< outside
+		<< (beforeFailures.offset == 1 && beforeFailures.window == 1)
+		<< (twoFailures.offset == 1 && twoFailures.window == 1)
+		<< (afterFailures.offset == 1 && afterFailures.window == 2)
+		<< fromStore
+		<< (tracker.state(1).offset == 0 && tracker.state(1).window == 2)
+	<< std::endl;
+
+	return 0;
+}
+#endif
@@ -0,0 +1,103 @@
+/**
+ * @file drifttracker.h
+ *
+ * @brief Per-account tracking of TOTP clock drift.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#ifndef __CPPTOTP_DRIFTTRACKER_H__
+#define __CPPTOTP_DRIFTTRACKER_H__
+
+#include "credstore.h"
+#include "sha1.h"
+
+#include <atomic>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace CppTotp
+{
+
+/** What a DriftTracker has learned about an account. */
+struct DriftState
+{
+	/** The time step offset the account's values are expected at. */
+	int64_t offset;
+
+	/** The number of steps around the offset that are accepted. */
+	size_t window;
+};
+
+/**
+ * Learns the offset (in time steps) at which each account's token matches and
+ * verifies TOTP values there first.
+ *
+ * A verification tries the learned offset first and then the others in the
+ * account's window around it, nearest first; a value from a client that stays
+ * in step costs a single HMAC. The window starts at the maximum and narrows
+ * by one (down to the minimum) after a run of matches at the learned offset.
+ * It widens again when a match lands on its edge or after repeated failures.
+ * Accepted offsets never leave the maximum window around the server's time
+ * step.
+ *
+ * The state of an account takes 16 bits, indexed like the CredentialStore;
+ * it is read and updated without locks. Concurrent verifications of the same
+ * account may drop each other's updates, which only delays learning.
+ *
+ * @note Unlike verifyTotp(), verification stops at the first matching offset;
+ * the time taken reveals which offset matched, though not the value.
+ */
+class DriftTracker
+{
+private:
+	std::atomic<uint16_t> * m_states;
+	size_t m_size;
+	size_t m_maxWindow;
+	size_t m_minWindow;
+
+public:
+	/** The largest supported window. */
+	static const size_t MaxWindow = 15;
+
+	/**
+	 * Creates a tracker for the given number of accounts, all of them starting
+	 * at offset 0 with the maximum window.
+	 *
+	 * @throw std::invalid_argument unless minWindow <= maxWindow <= MaxWindow.
+	 */
+	DriftTracker(size_t size, size_t maxWindow = 2, size_t minWindow = 1);
+	~DriftTracker();
+
+	DriftTracker(const DriftTracker &) = delete;
+	DriftTracker & operator=(const DriftTracker &) = delete;
+
+	/** The number of accounts. */
+	size_t size() const { return m_size; }
+
+	/** What has been learned about the given account. */
+	DriftState state(size_t index) const;
+
+	/** Forgets what has been learned about the given account. */
+	void reset(size_t index);
+
+	/**
+	 * Checks a TOTP value of the given account with the given key and
+	 * parameters, and learns from the result.
+	 *
+	 * @see totp(const HmacSha1Key &, uint64_t, uint64_t, uint64_t, size_t)
+	 */
+	bool verifyTotp(
+		size_t index, const HmacSha1Key & key, uint32_t code, uint64_t timeNow,
+		uint64_t timeStart, uint64_t timeStep, size_t digitCount = 6, int64_t * matchedOffset = nullptr
+	);
+
+	/** Checks a TOTP value of the account at the given index of the store. */
+	bool verifyTotp(const CredentialStore & store, size_t index, uint32_t code, uint64_t timeNow, int64_t * matchedOffset = nullptr);
+};
+
+}
+
+#endif
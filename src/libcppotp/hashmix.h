@@ -0,0 +1,34 @@
+/**
+ * @file hashmix.h
+ *
+ * @brief Bit mixing for the library's hash tables and check values.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#ifndef __CPPTOTP_HASHMIX_H__
+#define __CPPTOTP_HASHMIX_H__
+
+#include <cstdint>
+
+namespace CppTotp
+{
+
+/**
+ * Spreads the bits of a word over all bits of the result (the finalizer of
+ * MurmurHash3); a bijection, so distinct words never collide.
+ */
+inline uint64_t mix64(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+}
+
+#endif
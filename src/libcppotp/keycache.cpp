@@ -0,0 +1,354 @@
+/**
+ * @file keycache.cpp
+ *
+ * @brief Implementation of the per-thread key cache.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#include "keycache.h"
+#include "hashmix.h"
+#include "securemem.h"
+
+#include <atomic>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include <cstring>
+
+namespace CppTotp
+{
+
+static std::atomic<size_t> g_capacity(0);
+
+/** Marks the ends of the recency list. */
+static const uint32_t NoEntry = 0xFFFFFFFFu;
+
+/** Hashes a raw key; seeded per process so that collisions cannot be planned. */
+static uint64_t fingerprintOf(const Bytes::Byte * key, size_t keySize)
+{
+	static const uint64_t seed = (static_cast<uint64_t>(std::random_device()()) << 32) | std::random_device()();
+
+	uint64_t h = seed ^ (keySize * 0x9e3779b97f4a7c15ULL);
+	size_t i = 0;
+	for (; i + 8 <= keySize; i += 8)
+	{
+		uint64_t word;
+		std::memcpy(&word, key + i, sizeof(word));
+		h = (h ^ word) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
+	for (; i < keySize; ++i)
+	{
+		h = (h ^ key[i]) * 0xc4ceb9fe1a85ec53ULL;
+	}
+
+	return mix64(h);
+}
+
+namespace
+{
+	struct CacheEntry
+	{
+		uint64_t fingerprint;
+		std::vector<Bytes::Byte, SecureAllocator<Bytes::Byte> > rawKey;
+		HmacSha1Key key;
+
+		/** Neighbours in the recency list (towards the most and least recent). */
+		uint32_t newer;
+		uint32_t older;
+	};
+
+	/** A least-recently-used cache of a single thread. */
+	class ThreadKeyCache
+	{
+	private:
+		size_t m_capacity;
+		std::vector<CacheEntry, SecureAllocator<CacheEntry> > m_entries;
+		std::unordered_map<uint64_t, uint32_t> m_index;
+		uint32_t m_newest;
+		uint32_t m_oldest;
+
+		void unlink(uint32_t entry)
+		{
+			CacheEntry & e = m_entries[entry];
+			if (e.newer != NoEntry)
+			{
+				m_entries[e.newer].older = e.older;
+			}
+			else
+			{
+				m_newest = e.older;
+			}
+			if (e.older != NoEntry)
+			{
+				m_entries[e.older].newer = e.newer;
+			}
+			else
+			{
+				m_oldest = e.newer;
+			}
+		}
+
+		void linkNewest(uint32_t entry)
+		{
+			CacheEntry & e = m_entries[entry];
+			e.newer = NoEntry;
+			e.older = m_newest;
+			if (m_newest != NoEntry)
+			{
+				m_entries[m_newest].newer = entry;
+			}
+			m_newest = entry;
+			if (m_oldest == NoEntry)
+			{
+				m_oldest = entry;
+			}
+		}
+
+		/** Wipes the entry and fills it with the given key. */
+		void fill(uint32_t entry, uint64_t fingerprint, const Bytes::Byte * key, size_t keySize)
+		{
+			CacheEntry & e = m_entries[entry];
+			Bytes::clearBytes(e.rawKey.data(), e.rawKey.size());
+
+			e.fingerprint = fingerprint;
+			e.rawKey.assign(key, key + keySize);
+			e.key = HmacSha1Key(key, keySize);
+			m_index[fingerprint] = entry;
+		}
+
+	public:
+		HmacKeyCacheStats stats;
+
+		ThreadKeyCache()
+			: m_capacity(0), m_newest(NoEntry), m_oldest(NoEntry)
+		{
+			stats.hits = 0;
+			stats.misses = 0;
+			stats.evictions = 0;
+		}
+
+		~ThreadKeyCache()
+		{
+			clear();
+		}
+
+		void clear()
+		{
+			for (CacheEntry & e : m_entries)
+			{
+				Bytes::clearBytes(e.rawKey.data(), e.rawKey.size());
+			}
+			m_entries.clear();
+			m_index.clear();
+			m_newest = NoEntry;
+			m_oldest = NoEntry;
+		}
+
+		bool empty() const
+		{
+			return m_entries.empty();
+		}
+
+		const HmacSha1Key * lookup(const Bytes::Byte * key, size_t keySize, size_t capacity)
+		{
+			if (capacity != m_capacity)
+			{
+				clear();
+				m_capacity = capacity;
+				m_entries.reserve(capacity);
+				m_index.reserve(capacity);
+			}
+
+			const uint64_t fingerprint = fingerprintOf(key, keySize);
+			uint32_t entry;
+
+			std::unordered_map<uint64_t, uint32_t>::const_iterator it = m_index.find(fingerprint);
+			if (it != m_index.end())
+			{
+				entry = it->second;
+				CacheEntry & e = m_entries[entry];
+				if (e.rawKey.size() == keySize && std::memcmp(e.rawKey.data(), key, keySize) == 0)
+				{
+					++stats.hits;
+				}
+				else
+				{
+					// a different key with the same fingerprint; take over its entry
+					++stats.misses;
+					++stats.evictions;
+					fill(entry, fingerprint, key, keySize);
+				}
+				unlink(entry);
+				linkNewest(entry);
+				return &m_entries[entry].key;
+			}
+
+			++stats.misses;
+			if (m_entries.size() < m_capacity)
+			{
+				m_entries.emplace_back();
+				entry = static_cast<uint32_t>(m_entries.size() - 1);
+			}
+			else
+			{
+				entry = m_oldest;
+				++stats.evictions;
+				m_index.erase(m_entries[entry].fingerprint);
+				unlink(entry);
+			}
+
+			fill(entry, fingerprint, key, keySize);
+			linkNewest(entry);
+			return &m_entries[entry].key;
+		}
+	};
+
+	thread_local ThreadKeyCache t_cache;
+}
+
+void setHmacKeyCacheCapacity(size_t entries)
+{
+	if (entries >= NoEntry)
+	{
+		entries = NoEntry - 1;
+	}
+	g_capacity.store(entries, std::memory_order_relaxed);
+
+	// the other threads wipe theirs on their next call
+	if (entries == 0)
+	{
+		t_cache.clear();
+	}
+}
+
+size_t hmacKeyCacheCapacity()
+{
+	return g_capacity.load(std::memory_order_relaxed);
+}
+
+const HmacSha1Key * cachedHmacSha1Key(const Bytes::Byte * key, size_t keySize)
+{
+	// a disabled cache only wipes the keys left from before
+	const size_t capacity = g_capacity.load(std::memory_order_relaxed);
+	if (capacity == 0)
+	{
+		ThreadKeyCache & cache = t_cache;
+		if (!cache.empty())
+		{
+			cache.clear();
+		}
+		return nullptr;
+	}
+	return t_cache.lookup(key, keySize, capacity);
+}
+
+void clearHmacKeyCache()
+{
+	t_cache.clear();
+}
+
+HmacKeyCacheStats hmacKeyCacheStats()
+{
+	return t_cache.stats;
+}
+
+}
+
+#if TEST_KEYCACHE
+#include "otp.h"
+
+#include <iostream>
+#include <thread>
+
+int main(void)
+{
+	using namespace CppTotp;
+
+	const Bytes::ByteString keyA = reinterpret_cast<const uint8_t *>("12345678901234567890");
+	const Bytes::ByteString keyB = reinterpret_cast<const uint8_t *>("abcdefghijabcdefghij");
+	const Bytes::ByteString keyC(100, 0x42);
+	const Bytes::ByteString msg = reinterpret_cast<const uint8_t *>("The quick brown fox jumps over the lazy dog");
+
+	// the results without the cache
+	const Bytes::ByteString macA = hmacSha1(keyA, msg);
+	const Bytes::ByteString macC = hmacSha1(keyC, msg);
+	const uint32_t hotpC = hotp(keyC, 1234);
+	bool disabled = (cachedHmacSha1Key(keyA.data(), keyA.size()) == nullptr) && (hmacKeyCacheStats().misses == 0);
+
+	setHmacKeyCacheCapacity(2);
+	bool same = (hmacSha1(keyA, msg) == macA) && (hotp(keyA, 1) == 287082);
+	HmacKeyCacheStats afterA = hmacKeyCacheStats();
+
+	hmacSha1(keyB, msg);
+	same = same && (hmacSha1(keyC, msg) == macC) && (hotp(keyC, 1234) == hotpC);
+	HmacKeyCacheStats afterC = hmacKeyCacheStats();
+
+	// C evicted A; bringing A back evicts B, the least recently used
+	same = same && (hmacSha1(keyA, msg) == macA);
+	HmacKeyCacheStats afterReload = hmacKeyCacheStats();
+
+	clearHmacKeyCache();
+	hmacSha1(keyC, msg);
+	HmacKeyCacheStats afterClear = hmacKeyCacheStats();
+	setHmacKeyCacheCapacity(0);
+
+	// disabling wipes this thread's entries right away...
+	setHmacKeyCacheCapacity(2);
+	hmacSha1(keyB, msg);
+	setHmacKeyCacheCapacity(0);
+	setHmacKeyCacheCapacity(2);
+	hmacSha1(keyB, msg);
+	HmacKeyCacheStats afterDisable = hmacKeyCacheStats();
+
+	// ...and another thread's on its next call
+	std::atomic<int> phase(0);
+	HmacKeyCacheStats otherThread;
+	std::thread worker([&]()
+	{
+		hmacSha1(keyA, msg);
+		phase.store(1);
+		while (phase.load() != 2)
+		{
+			std::this_thread::yield();
+		}
+		hmacSha1(keyA, msg);
+		phase.store(3);
+		while (phase.load() != 4)
+		{
+			std::this_thread::yield();
+		}
+		hmacSha1(keyA, msg);
+		otherThread = hmacKeyCacheStats();
+	});
+	while (phase.load() != 1)
+	{
+		std::this_thread::yield();
+	}
+	setHmacKeyCacheCapacity(0);
+	phase.store(2);
+	while (phase.load() != 3)
+	{
+		std::this_thread::yield();
+	}
+	setHmacKeyCacheCapacity(2);
+	phase.store(4);
+	worker.join();
+	setHmacKeyCacheCapacity(0);
+
+	std::cout
+		<< disabled << same
+		<< (afterA.misses == 1 && afterA.hits == 1)
+		<< (afterC.misses == 3 && afterC.hits == 2 && afterC.evictions == 1)
+		<< (afterReload.misses == 4 && afterReload.evictions == 2)
+		<< (afterClear.misses == 5 && afterClear.evictions == 2)
+		<< (afterDisable.misses == 7 && afterDisable.hits == afterClear.hits)
+		<< (otherThread.misses == 2 && otherThread.hits == 0)
+	<< std::endl;
+
+	return 0;
+}
+#endif
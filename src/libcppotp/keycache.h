@@ -0,0 +1,68 @@
+/**
+ * @file keycache.h
+ *
+ * @brief Per-thread cache of prepared HMAC-SHA-1 keys.
+ *
+ * Callers of the raw-key API (hmacSha1(), and hotp() and totp() on byte
+ * strings) pay for the two pad blocks, and for keys longer than a block for
+ * hashing the key, on every call. Once enabled, the cache remembers the
+ * prepared keys of the most recently used raw keys of each thread, and
+ * hmacSha1() with a block size of 64 picks them up automatically.
+ *
+ * Entries are found by a fingerprint of the raw key and confirmed by comparing
+ * the whole key, so a fingerprint collision can only cause a miss. The
+ * entries, raw keys and prepared midstates alike, are kept in the secure
+ * arena; evicted entries are wiped.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#ifndef __CPPTOTP_KEYCACHE_H__
+#define __CPPTOTP_KEYCACHE_H__
+
+#include "bytes.h"
+#include "sha1.h"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace CppTotp
+{
+
+/** The activity of the calling thread's key cache. */
+struct HmacKeyCacheStats
+{
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+};
+
+/**
+ * Sets the number of keys each thread's cache holds; 0 (the default) disables
+ * the cache. Each thread's cache is emptied the next time it is used, and
+ * disabling wipes the calling thread's cache right away.
+ */
+void setHmacKeyCacheCapacity(size_t entries);
+
+/** The number of keys each thread's cache holds. */
+size_t hmacKeyCacheCapacity();
+
+/**
+ * Returns the prepared form of the given raw key from the calling thread's
+ * cache, preparing and inserting it on a miss; returns nullptr if the cache
+ * is disabled.
+ *
+ * @note The pointer is only valid until the next call on the same thread.
+ */
+const HmacSha1Key * cachedHmacSha1Key(const Bytes::Byte * key, size_t keySize);
+
+/** Wipes all entries of the calling thread's cache. */
+void clearHmacKeyCache();
+
+/** The activity of the calling thread's cache so far. */
+HmacKeyCacheStats hmacKeyCacheStats();
+
+}
+
+#endif
@@ -0,0 +1,305 @@
+/**
+ * @file metrics.cpp
+ *
+ * @brief Implementation of the hot-path instrumentation.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#include "metrics.h"
+
+#include <cstring>
+
+#if CPPTOTP_METRICS
+#	include <atomic>
+#	include <mutex>
+#	include <set>
+#endif
+
+namespace CppTotp
+{
+namespace Metrics
+{
+
+static const char * const CounterNames[CounterCount] = {
+	"sha1_blocks",
+	"hmac_calls",
+	"key_setups",
+	"generates",
+	"verifies",
+	"verify_matches",
+	"throttled",
+	"lane_batches",
+	"lanes_used",
+};
+
+static const char * const HistogramNames[HistogramCount] = {
+	"key_setup",
+	"hmac",
+	"lanes",
+	"generate",
+	"verify",
+	"pregenerate",
+};
+
+const char * counterName(Counter counter)
+{
+	return CounterNames[static_cast<size_t>(counter)];
+}
+
+const char * histogramName(Histogram histogram)
+{
+	return HistogramNames[static_cast<size_t>(histogram)];
+}
+
+double Snapshot::batchFillRatio() const
+{
+	uint64_t batches = counters[static_cast<size_t>(Counter::LaneBatches)];
+	if (batches == 0)
+	{
+		return 0.0;
+	}
+	return static_cast<double>(counters[static_cast<size_t>(Counter::LanesUsed)]) / static_cast<double>(batches * LanesPerBatch);
+}
+
+void writeSnapshot(std::ostream & out, const Snapshot & snap)
+{
+	for (size_t i = 0; i < CounterCount; ++i)
+	{
+		out << "cppotp_" << CounterNames[i] << "_total " << snap.counters[i] << "\n";
+	}
+
+	for (size_t h = 0; h < HistogramCount; ++h)
+	{
+		uint64_t cumulative = 0;
+		for (size_t b = 0; b < LatencyBuckets; ++b)
+		{
+			cumulative += snap.latencies[h][b];
+			out << "cppotp_" << HistogramNames[h] << "_latency_ns_bucket{le=\"" << ((static_cast<uint64_t>(2) << b) - 1) << "\"} " << cumulative << "\n";
+		}
+		out << "cppotp_" << HistogramNames[h] << "_latency_ns_count " << cumulative << "\n";
+	}
+
+	for (size_t i = 0; i < WindowBuckets; ++i)
+	{
+		out << "cppotp_window_hits_total{offset=\"" << (static_cast<int64_t>(i) - MaxTrackedOffset) << "\"} " << snap.windowHits[i] << "\n";
+	}
+
+	out << "cppotp_batch_fill_ratio " << snap.batchFillRatio() << "\n";
+}
+
+#if CPPTOTP_METRICS
+
+/** The metrics of one thread; only that thread writes, anyone may read. */
+struct ThreadSlots
+{
+	std::atomic<uint64_t> counters[CounterCount];
+	std::atomic<uint64_t> latencies[HistogramCount][LatencyBuckets];
+	std::atomic<uint64_t> windowHits[WindowBuckets];
+
+	ThreadSlots();
+	~ThreadSlots();
+};
+
+/** The live threads' slots and the totals of the finished threads. */
+struct Registry
+{
+	std::mutex mutex;
+	std::set<ThreadSlots *> live;
+	Snapshot retired;
+
+	Registry()
+	{
+		std::memset(&retired, 0, sizeof(retired));
+	}
+};
+
+static Registry & registry()
+{
+	// never destroyed, as threads may finish during static destruction
+	static Registry * reg = new Registry();
+	return *reg;
+}
+
+static void addSlots(Snapshot * out, const ThreadSlots & slots)
+{
+	for (size_t i = 0; i < CounterCount; ++i)
+	{
+		out->counters[i] += slots.counters[i].load(std::memory_order_relaxed);
+	}
+	for (size_t h = 0; h < HistogramCount; ++h)
+	{
+		for (size_t b = 0; b < LatencyBuckets; ++b)
+		{
+			out->latencies[h][b] += slots.latencies[h][b].load(std::memory_order_relaxed);
+		}
+	}
+	for (size_t i = 0; i < WindowBuckets; ++i)
+	{
+		out->windowHits[i] += slots.windowHits[i].load(std::memory_order_relaxed);
+	}
+}
+
+ThreadSlots::ThreadSlots()
+{
+	for (size_t i = 0; i < CounterCount; ++i)
+	{
+		counters[i].store(0, std::memory_order_relaxed);
+	}
+	for (size_t h = 0; h < HistogramCount; ++h)
+	{
+		for (size_t b = 0; b < LatencyBuckets; ++b)
+		{
+			latencies[h][b].store(0, std::memory_order_relaxed);
+		}
+	}
+	for (size_t i = 0; i < WindowBuckets; ++i)
+	{
+		windowHits[i].store(0, std::memory_order_relaxed);
+	}
+
+	Registry & reg = registry();
+	std::lock_guard<std::mutex> lock(reg.mutex);
+	reg.live.insert(this);
+}
+
+ThreadSlots::~ThreadSlots()
+{
+	Registry & reg = registry();
+	std::lock_guard<std::mutex> lock(reg.mutex);
+	addSlots(&reg.retired, *this);
+	reg.live.erase(this);
+}
+
+static thread_local ThreadSlots threadSlots;
+
+/** Adds to a slot without a locked read-modify-write; only the owner writes. */
+static inline void bump(std::atomic<uint64_t> * slot, uint64_t amount)
+{
+	slot->store(slot->load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+void add(Counter counter, uint64_t amount)
+{
+	bump(&threadSlots.counters[static_cast<size_t>(counter)], amount);
+}
+
+void recordLatency(Histogram histogram, uint64_t nanoseconds)
+{
+	size_t bucket = 0;
+	while (bucket + 1 < LatencyBuckets && (nanoseconds >> (bucket + 1)) != 0)
+	{
+		++bucket;
+	}
+	bump(&threadSlots.latencies[static_cast<size_t>(histogram)][bucket], 1);
+}
+
+void recordWindowHit(int64_t offset)
+{
+	if (offset < -MaxTrackedOffset)
+	{
+		offset = -MaxTrackedOffset;
+	}
+	else if (offset > MaxTrackedOffset)
+	{
+		offset = MaxTrackedOffset;
+	}
+	bump(&threadSlots.windowHits[static_cast<size_t>(offset + MaxTrackedOffset)], 1);
+}
+
+bool enabled()
+{
+	return true;
+}
+
+void snapshot(Snapshot * out)
+{
+	Registry & reg = registry();
+	std::lock_guard<std::mutex> lock(reg.mutex);
+
+	*out = reg.retired;
+	for (const ThreadSlots * slots : reg.live)
+	{
+		addSlots(out, *slots);
+	}
+}
+
+#else
+
+bool enabled()
+{
+	return false;
+}
+
+void snapshot(Snapshot * out)
+{
+	std::memset(out, 0, sizeof(*out));
+}
+
+#endif
+
+}
+}
+
+#if TEST_METRICS
+// build everything with CPPTOTP_METRICS for this one
+#include "keycache.h"
+#include "otp.h"
+
+#include <iostream>
+#include <thread>
+
+int main(void)
+{
+	using namespace CppTotp;
+
+	const Bytes::ByteString key = reinterpret_cast<const uint8_t *>("12345678901234567890");
+
+	std::thread worker([&key]()
+	{
+		for (uint64_t i = 0; i < 10; ++i)
+		{
+			hotp(key, i, 6);
+		}
+	});
+	worker.join();
+
+	HmacSha1Key prepared(key);
+	// enough candidates to go through the lanes
+	bool valid = verifyTotp(prepared, 94287082, 89, 0, 30, 3, 8);
+
+	Metrics::Snapshot snap;
+	Metrics::snapshot(&snap);
+
+	// calls served from the key cache count once each, too
+	setHmacKeyCacheCapacity(4);
+	Sha1Digest digest;
+	hmacSha1(key.data(), key.size(), key.data(), key.size(), &digest);
+	hmacSha1(key.data(), key.size(), key.data(), key.size(), &digest);
+	setHmacKeyCacheCapacity(0);
+	Metrics::Snapshot cachedSnap;
+	Metrics::snapshot(&cachedSnap);
+	const size_t hmacCalls = static_cast<size_t>(Metrics::Counter::HmacCalls);
+
+	uint64_t verifyLatencies = 0;
+	for (size_t b = 0; b < Metrics::LatencyBuckets; ++b)
+	{
+		verifyLatencies += snap.latencies[static_cast<size_t>(Metrics::Histogram::Verify)][b];
+	}
+
+	std::cout
+		<< Metrics::enabled()
+		<< valid
+		<< (snap.counters[static_cast<size_t>(Metrics::Counter::Generates)] >= 10)
+		<< (snap.counters[static_cast<size_t>(Metrics::Counter::Verifies)] == 1)
+		<< (snap.counters[static_cast<size_t>(Metrics::Counter::VerifyMatches)] == 1)
+		<< (snap.windowHits[Metrics::MaxTrackedOffset - 1] == 1)
+		<< (verifyLatencies == 1)
+		<< (snap.batchFillRatio() > 0.0)
+		<< (cachedSnap.counters[hmacCalls] == snap.counters[hmacCalls] + 2)
+	<< std::endl;
+
+	return 0;
+}
+#endif
@@ -0,0 +1,172 @@
+/**
+ * @file metrics.h
+ *
+ * @brief Optional instrumentation of the hot paths.
+ *
+ * If the library is built with CPPTOTP_METRICS defined, the hashing, generation
+ * and verification functions count their calls, record their latencies in
+ * histograms and fire static tracepoints (USDT probes in the "cppotp"
+ * provider, if <sys/sdt.h> is available). Each thread records into its own
+ * slots; snapshot() sums them up.
+ *
+ * Without CPPTOTP_METRICS, the recording macros expand to nothing and
+ * snapshot() returns zeros.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#ifndef __CPPTOTP_METRICS_H__
+#define __CPPTOTP_METRICS_H__
+
+#include <ostream>
+
+#include <cstddef>
+#include <cstdint>
+
+#if CPPTOTP_METRICS
+#	include <chrono>
+#	if defined(__has_include)
+#		if __has_include(<sys/sdt.h>)
+#			include <sys/sdt.h>
+#			define CPPTOTP_HAVE_SDT 1
+#		endif
+#	endif
+#endif
+
+namespace CppTotp
+{
+namespace Metrics
+{
+
+enum class Counter : size_t
+{
+	/** SHA-1 blocks compressed by the single-message backends. */
+	Sha1Blocks,
+
+	/** HMACs calculated one at a time. */
+	HmacCalls,
+
+	/** HMAC keys prepared from raw keys. */
+	KeySetups,
+
+	/** HOTP/TOTP values generated. */
+	Generates,
+
+	/** TOTP values verified, and how many of them matched. */
+	Verifies,
+	VerifyMatches,
+
+	/** Verification attempts refused by an AttemptLimiter. */
+	Throttled,
+
+	/** Calls to the SIMD lane HMAC and the lanes they filled. */
+	LaneBatches,
+	LanesUsed,
+
+	Count_,
+};
+
+enum class Histogram : size_t
+{
+	KeySetup,
+	Hmac,
+	Lanes,
+	Generate,
+	Verify,
+
+	/** Building a whole pregenerated code table. */
+	Pregenerate,
+
+	Count_,
+};
+
+const size_t CounterCount = static_cast<size_t>(Counter::Count_);
+const size_t HistogramCount = static_cast<size_t>(Histogram::Count_);
+
+/** Latency bucket i counts durations of [2^i, 2^(i+1)) nanoseconds; 0 includes 0. */
+const size_t LatencyBuckets = 32;
+
+/** Window hits further off than this are counted with the outermost offset. */
+const int64_t MaxTrackedOffset = 8;
+const size_t WindowBuckets = 2 * MaxTrackedOffset + 1;
+
+/** The number of lanes per call to the lane HMAC, for the batch fill ratio. */
+const size_t LanesPerBatch = 16;
+
+/** The sum of all threads' metrics. */
+struct Snapshot
+{
+	uint64_t counters[CounterCount];
+	uint64_t latencies[HistogramCount][LatencyBuckets];
+
+	/** Matched TOTP offsets; index 0 is -MaxTrackedOffset. */
+	uint64_t windowHits[WindowBuckets];
+
+	/** The ratio of used lanes to available lanes in lane HMAC calls. */
+	double batchFillRatio() const;
+};
+
+/** Whether the library was built with CPPTOTP_METRICS. */
+bool enabled();
+
+/** Sums up the metrics of all threads, including finished ones. */
+void snapshot(Snapshot * out);
+
+/** Writes a snapshot in the Prometheus text format. */
+void writeSnapshot(std::ostream & out, const Snapshot & snap);
+
+const char * counterName(Counter counter);
+const char * histogramName(Histogram histogram);
+
+#if CPPTOTP_METRICS
+void add(Counter counter, uint64_t amount);
+void recordLatency(Histogram histogram, uint64_t nanoseconds);
+void recordWindowHit(int64_t offset);
+
+/** Records the lifetime of the object into a histogram. */
+class ScopedTimer
+{
+private:
+	Histogram m_histogram;
+	std::chrono::steady_clock::time_point m_start;
+
+public:
+	explicit ScopedTimer(Histogram histogram)
+		: m_histogram(histogram), m_start(std::chrono::steady_clock::now())
+	{
+	}
+
+	~ScopedTimer()
+	{
+		std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - m_start;
+		recordLatency(m_histogram, static_cast<uint64_t>(elapsed.count()));
+	}
+};
+#endif
+
+}
+}
+
+#if CPPTOTP_METRICS
+#	define CPPTOTP_METRIC_ADD(counter, amount) \
+		::CppTotp::Metrics::add(::CppTotp::Metrics::Counter::counter, (amount))
+#	define CPPTOTP_METRIC_TIMER(histogram) \
+		::CppTotp::Metrics::ScopedTimer cppotpTimer##histogram(::CppTotp::Metrics::Histogram::histogram)
+#	define CPPTOTP_METRIC_WINDOW_HIT(offset) \
+		::CppTotp::Metrics::recordWindowHit(offset)
+#else
+#	define CPPTOTP_METRIC_ADD(counter, amount) do {} while (0)
+#	define CPPTOTP_METRIC_TIMER(histogram) do {} while (0)
+#	define CPPTOTP_METRIC_WINDOW_HIT(offset) do {} while (0)
+#endif
+
+#if CPPTOTP_HAVE_SDT
+#	define CPPTOTP_PROBE1(name, a) DTRACE_PROBE1(cppotp, name, a)
+#	define CPPTOTP_PROBE2(name, a, b) DTRACE_PROBE2(cppotp, name, a, b)
+#else
+#	define CPPTOTP_PROBE1(name, a) do {} while (0)
+#	define CPPTOTP_PROBE2(name, a, b) do {} while (0)
+#endif
+
+#endif
@@ -8,6 +8,9 @@
  */
 
 #include "otp.h"
+#include "consttime.h"
+#include "metrics.h"
+#include "sha1backend.h"
 
 #include <iostream>
 
@@ -23,15 +26,25 @@ Bytes::ByteString hmacSha1_64(const Bytes::ByteString & key, const Bytes::ByteSt
 	return hmacSha1(key, msg, 64);
 }
 
-//uint32_t hotp(const Bytes::ByteString & key, const Bytes::ByteString & msg, size_t digitCount, HmacFunc hmacf)
-uint32_t hotp(const Bytes::ByteString & key, uint64_t counter, size_t digitCount, HmacFunc hmacf)
+size_t hmacSha1_64Into(const Bytes::Byte * key, size_t keySize, const Bytes::Byte * msg, size_t msgSize, Bytes::Byte * digest, size_t digestCapacity)
 {
-	Bytes::ByteString msg = Bytes::u64beToByteString(counter);
-	Bytes::ByteStringDestructor dmsg(&msg);
+	assert(digestCapacity >= Sha1DigestSize);
+	(void)digestCapacity;
 
-	Bytes::ByteString hmac = hmacf(key, msg);
-	Bytes::ByteStringDestructor dhmac(&hmac);
+	Sha1Digest hmac;
+	hmacSha1(key, keySize, msg, msgSize, &hmac, 64);
+	std::memcpy(digest, hmac.data(), hmac.size());
+	Bytes::clearBytes(hmac.data(), hmac.size());
 
+	return Sha1DigestSize;
+}
+
+/**
+ * Performs the dynamic truncation of an HMAC value and reduces it to the given
+ * number of decimal digits.
+ */
+static uint32_t truncateHmac(const Bytes::Byte * hmac, size_t hmacSize, size_t digitCount)
+{
 	uint32_t digits10 = 1;
 	for (size_t i = 0; i < digitCount; ++i)
 	{
@@ -39,18 +52,14 @@ uint32_t hotp(const Bytes::ByteString & key, uint64_t counter, size_t digitCount
 	}
 
 	// fetch the offset (from the last nibble)
-	uint8_t offset = hmac[hmac.size()-1] & 0x0F;
+	uint8_t offset = hmac[hmacSize-1] & 0x0F;
 
-	// fetch the four bytes from the offset
-	Bytes::ByteString fourWord = hmac.substr(offset, 4);
-	Bytes::ByteStringDestructor dfourWord(&fourWord);
-
-	// turn them into a 32-bit integer
+	// turn the four bytes from the offset into a 32-bit integer
 	uint32_t ret =
-		(fourWord[0] << 24) |
-		(fourWord[1] << 16) |
-		(fourWord[2] <<  8) |
-		(fourWord[3] <<  0)
+		(hmac[offset + 0] << 24) |
+		(hmac[offset + 1] << 16) |
+		(hmac[offset + 2] <<  8) |
+		(hmac[offset + 3] <<  0)
 	;
 
 	// snip off the MSB (to alleviate signed/unsigned troubles)
@@ -58,15 +67,374 @@ uint32_t hotp(const Bytes::ByteString & key, uint64_t counter, size_t digitCount
 	return (ret & 0x7fffffff) % digits10;
 }
 
+//uint32_t hotp(const Bytes::ByteString & key, const Bytes::ByteString & msg, size_t digitCount, HmacFunc hmacf)
+uint32_t hotp(const Bytes::ByteString & key, uint64_t counter, size_t digitCount, HmacFunc hmacf)
+{
+	if (hmacf == hmacSha1_64)
+	{
+		// no need to go through byte strings
+		return hotp(key.data(), key.size(), counter, digitCount, hmacSha1_64Into);
+	}
+
+	Bytes::ByteString msg = Bytes::u64beToByteString(counter);
+	Bytes::ByteStringDestructor dmsg(&msg);
+
+	Bytes::ByteString hmac = hmacf(key, msg);
+	Bytes::ByteStringDestructor dhmac(&hmac);
+
+	assert(hmac.size() >= 20);
+	return truncateHmac(hmac.data(), hmac.size(), digitCount);
+}
+
 uint32_t totp(const Bytes::ByteString & key, uint64_t timeNow, uint64_t timeStart, uint64_t timeStep, size_t digitCount, HmacFunc hmacf)
 {
 	uint64_t timeValue = (timeNow - timeStart) / timeStep;
 	return hotp(key, timeValue, digitCount, hmacf);
 }
 
+uint32_t hotp(const Bytes::Byte * key, size_t keySize, uint64_t counter, size_t digitCount, HmacIntoFunc hmacf)
+{
+	CPPTOTP_METRIC_ADD(Generates, 1);
+	CPPTOTP_METRIC_TIMER(Generate);
+	CPPTOTP_PROBE2(generate, counter, digitCount);
+
+	Bytes::Byte msg[8];
+	Bytes::Byte hmac[HmacMaxDigestSize];
+
+	Bytes::u64beToBytes(counter, msg);
+
+	size_t hmacSize = hmacf(key, keySize, msg, sizeof(msg), hmac, sizeof(hmac));
+	assert(hmacSize >= 20 && hmacSize <= sizeof(hmac));
+	uint32_t ret = truncateHmac(hmac, hmacSize, digitCount);
+
+	Bytes::clearBytes(msg, sizeof(msg));
+	Bytes::clearBytes(hmac, hmacSize);
+	return ret;
+}
+
+uint32_t totp(const Bytes::Byte * key, size_t keySize, uint64_t timeNow, uint64_t timeStart, uint64_t timeStep, size_t digitCount, HmacIntoFunc hmacf)
+{
+	uint64_t timeValue = (timeNow - timeStart) / timeStep;
+	return hotp(key, keySize, timeValue, digitCount, hmacf);
+}
+
+uint32_t hotp(const HmacSha1Key & key, uint64_t counter, size_t digitCount)
+{
+	CPPTOTP_METRIC_ADD(Generates, 1);
+	CPPTOTP_METRIC_TIMER(Generate);
+	CPPTOTP_PROBE2(generate, counter, digitCount);
+
+	Sha1Digest hmac;
+
+	key.macCounter(counter, hmac.data());
+	uint32_t ret = truncateHmac(hmac.data(), hmac.size(), digitCount);
+
+	Bytes::clearBytes(hmac.data(), hmac.size());
+	return ret;
+}
+
+uint32_t totp(const HmacSha1Key & key, uint64_t timeNow, uint64_t timeStart, uint64_t timeStep, size_t digitCount)
+{
+	uint64_t timeValue = (timeNow - timeStart) / timeStep;
+	return hotp(key, timeValue, digitCount);
+}
+
+uint32_t hotpFromLane(const Sha1LaneStates & digests, size_t lane, size_t digitCount)
+{
+	Sha1Digest hmac;
+
+	for (size_t i = 0; i < 5; ++i)
+	{
+		Bytes::u32beToBytes(digests.h[i][lane], &hmac[4*i]);
+	}
+
+	uint32_t ret = truncateHmac(hmac.data(), hmac.size(), digitCount);
+	Bytes::clearBytes(hmac.data(), hmac.size());
+	return ret;
+}
+
+void hotpMany(const HmacSha1Key * const keys[], const uint64_t counters[], size_t count, size_t digitCount, uint32_t out[])
+{
+	CPPTOTP_METRIC_ADD(Generates, count);
+
+	Sha1LaneStates inner = {};
+	Sha1LaneStates outer = {};
+	Sha1LaneStates digests;
+
+	for (size_t first = 0; first < count; first += Sha1MaxLanes)
+	{
+		size_t lanes = count - first;
+		if (lanes > Sha1MaxLanes)
+		{
+			lanes = Sha1MaxLanes;
+		}
+
+		// gather the key states into the lanes
+		for (size_t lane = 0; lane < lanes; ++lane)
+		{
+			const HmacSha1Key & key = *keys[first + lane];
+			for (size_t i = 0; i < 5; ++i)
+			{
+				inner.h[i][lane] = key.innerState()[i];
+				outer.h[i][lane] = key.outerState()[i];
+			}
+		}
+
+		hmacSha1CounterLanes(inner, outer, &counters[first], lanes, &digests);
+
+		for (size_t lane = 0; lane < lanes; ++lane)
+		{
+			out[first + lane] = hotpFromLane(digests, lane, digitCount);
+		}
+	}
+
+	Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(&inner), sizeof(inner));
+	Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(&outer), sizeof(outer));
+	Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(&digests), sizeof(digests));
+}
+
+/**
+ * Up to this many values of the same key are calculated one at a time; filling
+ * the lanes and hashing all of them costs more.
+ */
+static const size_t MaxSingleCounterMacs = 5;
+
+/**
+ * Calculates the HOTP values of up to Sha1MaxLanes counters with the same key.
+ */
+static void hotpLanesSameKey(const HmacSha1Key & key, const uint64_t counters[], size_t count, size_t digitCount, uint32_t out[Sha1MaxLanes])
+{
+	Sha1LaneStates digests;
+
+	if (count <= MaxSingleCounterMacs)
+	{
+		CPPTOTP_METRIC_ADD(HmacCalls, count);
+		CPPTOTP_METRIC_ADD(Sha1Blocks, 2 * count);
+
+		const Sha1CounterMacFunc counterMac = sha1Backend().counterMac;
+		uint32_t words[5];
+		for (size_t lane = 0; lane < count; ++lane)
+		{
+			counterMac(key.innerState(), key.outerState(), counters[lane], words);
+			for (size_t i = 0; i < 5; ++i)
+			{
+				digests.h[i][lane] = words[i];
+			}
+		}
+		Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(words), sizeof(words));
+	}
+	else
+	{
+		Sha1LaneStates inner;
+		Sha1LaneStates outer;
+
+		// unused lanes are calculated too, so fill all of them
+		for (size_t i = 0; i < 5; ++i)
+		{
+			for (size_t lane = 0; lane < Sha1MaxLanes; ++lane)
+			{
+				inner.h[i][lane] = key.innerState()[i];
+				outer.h[i][lane] = key.outerState()[i];
+			}
+		}
+
+		hmacSha1CounterLanes(inner, outer, counters, count, &digests);
+
+		Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(&inner), sizeof(inner));
+		Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(&outer), sizeof(outer));
+	}
+
+	for (size_t lane = 0; lane < count; ++lane)
+	{
+		out[lane] = hotpFromLane(digests, lane, digitCount);
+	}
+
+	Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(&digests), sizeof(digests));
+}
+
+/**
+ * Calculates the HOTP values of consecutive counters, one batch of lanes at a
+ * time, until the code (or, if requested, the code followed by the second
+ * code) is found.
+ */
+static bool hotpSearchLanes(const HmacSha1Key & key, uint64_t startCounter, size_t lookAhead, uint32_t code, bool useSecondCode, uint32_t secondCode, uint64_t * matchedCounter, size_t digitCount)
+{
+	Sha1LaneStates inner;
+	Sha1LaneStates outer;
+	Sha1LaneStates digests;
+	uint64_t counters[Sha1MaxLanes] = {};
+
+	// all lanes share the key; fill them once for all batches
+	for (size_t i = 0; i < 5; ++i)
+	{
+		for (size_t lane = 0; lane < Sha1MaxLanes; ++lane)
+		{
+			inner.h[i][lane] = key.innerState()[i];
+			outer.h[i][lane] = key.outerState()[i];
+		}
+	}
+
+	// the second code needs the value of the counter after the last candidate
+	const uint64_t total = static_cast<uint64_t>(lookAhead) + (useSecondCode ? 2 : 1);
+	bool found = false;
+	uint64_t foundCounter = 0;
+	bool previousMatched = false;
+
+	for (uint64_t first = 0; first < total && !found; first += Sha1MaxLanes)
+	{
+		size_t lanes = (total - first < Sha1MaxLanes) ? static_cast<size_t>(total - first) : Sha1MaxLanes;
+		for (size_t lane = 0; lane < lanes; ++lane)
+		{
+			counters[lane] = startCounter + first + lane;
+		}
+
+		hmacSha1CounterLanes(inner, outer, counters, lanes, &digests);
+
+		for (size_t lane = 0; lane < lanes && !found; ++lane)
+		{
+			uint32_t value = hotpFromLane(digests, lane, digitCount);
+			if (!useSecondCode)
+			{
+				found = (value == code);
+				foundCounter = counters[lane];
+			}
+			else
+			{
+				found = previousMatched && (value == secondCode);
+				foundCounter = counters[lane] - 1;
+				previousMatched = (value == code);
+			}
+		}
+	}
+
+	Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(&inner), sizeof(inner));
+	Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(&outer), sizeof(outer));
+	Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(&digests), sizeof(digests));
+
+	if (found && matchedCounter != nullptr)
+	{
+		*matchedCounter = foundCounter;
+	}
+	return found;
+}
+
+bool hotpSearch(const HmacSha1Key & key, uint64_t startCounter, size_t lookAhead, uint32_t code, uint64_t * matchedCounter, size_t digitCount)
+{
+	return hotpSearchLanes(key, startCounter, lookAhead, code, false, 0, matchedCounter, digitCount);
+}
+
+bool hotpSearch(const HmacSha1Key & key, uint64_t startCounter, size_t lookAhead, uint32_t code, uint32_t secondCode, uint64_t * matchedCounter, size_t digitCount)
+{
+	return hotpSearchLanes(key, startCounter, lookAhead, code, true, secondCode, matchedCounter, digitCount);
+}
+
+bool verifyTotp(const HmacSha1Key & key, uint32_t code, uint64_t timeNow, uint64_t timeStart, uint64_t timeStep, size_t window, size_t digitCount, int64_t * matchedOffset)
+{
+	CPPTOTP_METRIC_ADD(Verifies, 1);
+	CPPTOTP_METRIC_TIMER(Verify);
+
+	const uint64_t timeValue = (timeNow - timeStart) / timeStep;
+
+	uint64_t counters[Sha1MaxLanes] = {};
+	int64_t offsets[Sha1MaxLanes];
+	uint32_t codes[Sha1MaxLanes];
+
+	uint32_t found = 0;
+	uint64_t foundOffset = 0;
+
+	// candidates in order of preference: 0, -1, +1, -2, +2, ...
+	const size_t candidateCount = 2*window + 1;
+	for (size_t first = 0; first < candidateCount; first += Sha1MaxLanes)
+	{
+		size_t lanes = 0;
+		uint32_t valid[Sha1MaxLanes];
+
+		for (size_t i = first; i < candidateCount && lanes < Sha1MaxLanes; ++i, ++lanes)
+		{
+			int64_t distance = static_cast<int64_t>((i + 1) / 2);
+			int64_t offset = (i % 2 == 1) ? -distance : distance;
+
+			offsets[lanes] = offset;
+			counters[lanes] = timeValue + static_cast<uint64_t>(offset);
+
+			// steps before the epoch (or past the end of time) don't exist
+			valid[lanes] = (offset < 0)
+				? (timeValue >= static_cast<uint64_t>(-offset))
+				: (counters[lanes] >= timeValue)
+			;
+		}
+
+		hotpLanesSameKey(key, counters, lanes, digitCount, codes);
+
+		for (size_t lane = 0; lane < lanes; ++lane)
+		{
+			uint32_t take = ctEqual(codes[lane], code) & valid[lane] & (found ^ 1u);
+			uint64_t mask = 0u - static_cast<uint64_t>(take);
+
+			foundOffset |= mask & static_cast<uint64_t>(offsets[lane]);
+			found |= take;
+		}
+	}
+
+	Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(codes), sizeof(codes));
+
+	CPPTOTP_PROBE2(verify, found, static_cast<int64_t>(foundOffset));
+	if (found)
+	{
+		CPPTOTP_METRIC_ADD(VerifyMatches, 1);
+		CPPTOTP_METRIC_WINDOW_HIT(static_cast<int64_t>(foundOffset));
+	}
+
+	if (found && matchedOffset != nullptr)
+	{
+		*matchedOffset = static_cast<int64_t>(foundOffset);
+	}
+	return found != 0;
+}
+
+bool verifyTotp(const Bytes::ByteString & key, uint32_t code, uint64_t timeNow, uint64_t timeStart, uint64_t timeStep, size_t window, size_t digitCount, int64_t * matchedOffset)
+{
+	return verifyTotp(HmacSha1Key(key), code, timeNow, timeStart, timeStep, window, digitCount, matchedOffset);
+}
+
 }
 
 #if TEST_OTP
+#include "otptemplate.h"
+
+namespace
+{
+	using namespace CppTotp;
+
+	typedef Hotp<HmacSha1Policy, 6> RfcHotp;
+	typedef Totp<HmacSha1Policy, 8, 30> RfcTotp;
+
+	constexpr HmacSha1Policy::Key rfcKey = HmacSha1Policy::prepareKey("12345678901234567890", 20);
+
+	static_assert(RfcHotp::generate(rfcKey, 0) == 755224, "RFC 4226 HOTP, counter 0");
+	static_assert(RfcHotp::generate(rfcKey, 1) == 287082, "RFC 4226 HOTP, counter 1");
+	static_assert(RfcHotp::generate(rfcKey, 2) == 359152, "RFC 4226 HOTP, counter 2");
+	static_assert(RfcHotp::generate(rfcKey, 3) == 969429, "RFC 4226 HOTP, counter 3");
+	static_assert(RfcHotp::generate(rfcKey, 4) == 338314, "RFC 4226 HOTP, counter 4");
+	static_assert(RfcHotp::generate(rfcKey, 5) == 254676, "RFC 4226 HOTP, counter 5");
+	static_assert(RfcHotp::generate(rfcKey, 6) == 287922, "RFC 4226 HOTP, counter 6");
+	static_assert(RfcHotp::generate(rfcKey, 7) == 162583, "RFC 4226 HOTP, counter 7");
+	static_assert(RfcHotp::generate(rfcKey, 8) == 399871, "RFC 4226 HOTP, counter 8");
+	static_assert(RfcHotp::generate(rfcKey, 9) == 520489, "RFC 4226 HOTP, counter 9");
+
+	static_assert(RfcTotp::generate(rfcKey, 59) == 94287082, "RFC 6238 TOTP, time 59");
+	static_assert(RfcTotp::generate(rfcKey, 1111111109) == 7081804, "RFC 6238 TOTP, time 1111111109");
+	static_assert(RfcTotp::generate(rfcKey, 1111111111) == 14050471, "RFC 6238 TOTP, time 1111111111");
+	static_assert(RfcTotp::generate(rfcKey, 1234567890) == 89005924, "RFC 6238 TOTP, time 1234567890");
+	static_assert(RfcTotp::generate(rfcKey, 2000000000) == 69279037, "RFC 6238 TOTP, time 2000000000");
+	static_assert(RfcTotp::generate(rfcKey, 20000000000) == 65353130, "RFC 6238 TOTP, time 20000000000");
+
+	// keys longer than the block size are hashed first
+	constexpr HmacSha1Policy::Key longKey = HmacSha1Policy::prepareKey(
+		"12345678901234567890123456789012345678901234567890123456789012345678901234567890", 80
+	);
+}
+
 int main(void)
 {
 	using namespace CppTotp;
@@ -96,6 +464,65 @@ int main(void)
 		<< (totp(key, 20000000000, start, step, digitsT) == 65353130)
 	<< std::endl;
 
+	std::cout
+		<< (hotp(key.data(), key.size(), 3, digitsH) == 969429)
+		<< (totp(key.data(), key.size(), 1234567890, start, step, digitsT) == 89005924)
+	<< std::endl;
+
+	const HmacSha1Key pkey(key);
+	std::cout
+		<< (hotp(pkey, 0, digitsH) == 755224)
+		<< (hotp(pkey, 9, digitsH) == 520489)
+		<< (totp(pkey, 59, start, step, digitsT) == 94287082)
+		<< (totp(pkey, 20000000000, start, step, digitsT) == 65353130)
+	<< std::endl;
+
+	const HmacSha1Key * pkeys[10];
+	uint64_t counters[10];
+	uint32_t codes[10];
+	for (size_t i = 0; i < 10; ++i)
+	{
+		pkeys[i] = &pkey;
+		counters[i] = i;
+	}
+	hotpMany(pkeys, counters, 10, digitsH, codes);
+	std::cout
+		<< (codes[0] == 755224)
+		<< (codes[4] == 338314)
+		<< (codes[9] == 520489)
+	<< std::endl;
+
+	int64_t offset = 0;
+	std::cout
+		<< verifyTotp(key, 94287082, 59, start, step, 1, digitsT, &offset) << (offset == 0)
+		<< verifyTotp(key, 94287082, 89, start, step, 1, digitsT, &offset) << (offset == -1)
+		<< verifyTotp(key, 94287082, 29, start, step, 1, digitsT, &offset) << (offset == 1)
+		<< !verifyTotp(key, 94287082, 119, start, step, 1, digitsT)
+		<< verifyTotp(pkey, 65353130, 20000000000 - 7*step, start, step, 7, digitsT, &offset) << (offset == 7)
+		<< verifyTotp(pkey, 65353130, 20000000000 + 8*step, start, step, 9, digitsT, &offset) << (offset == -8)
+	<< std::endl;
+
+	uint64_t matched = 0;
+	const uint32_t far = hotp(pkey, 3000, digitsH);
+	const uint32_t farNext = hotp(pkey, 3001, digitsH);
+	std::cout
+		<< hotpSearch(pkey, 0, 9, 520489, &matched) << (matched == 9)
+		<< !hotpSearch(pkey, 0, 8, 520489)
+		<< hotpSearch(pkey, 0, 7, 162583, 399871, &matched) << (matched == 7)
+		<< !hotpSearch(pkey, 0, 20, 162583, 520489)
+		<< hotpSearch(pkey, 100, 5000, far, farNext, &matched) << (matched == 3000)
+	<< std::endl;
+
+	const Bytes::ByteString longKeyBytes = reinterpret_cast<const uint8_t *>(
+		"12345678901234567890123456789012345678901234567890123456789012345678901234567890"
+	);
+	std::cout
+		<< (RfcHotp::generate(HmacSha1Policy::prepareKey(pkey), 9) == 520489)
+		<< (RfcHotp::generate(longKey, 42) == hotp(longKeyBytes, 42, 6))
+		<< RfcTotp::verify(rfcKey, 94287082, 89, 1, &offset) << (offset == -1)
+		<< !StandardTotp::verify(rfcKey, 94287082, 89)
+	<< std::endl;
+
 	const Bytes::ByteString tutestkey = reinterpret_cast<const uint8_t *>("HelloWorld");
 	std::cout << totp(tutestkey, time(NULL), 0, 30, 6) << std::endl;
 
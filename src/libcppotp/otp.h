@@ -12,6 +12,7 @@
 
 #include "bytes.h"
 #include "sha1.h"
+#include "sha1lanes.h"
 
 #include <cstdint>
 
@@ -21,6 +22,9 @@ namespace CppTotp
 /** The 64-bit-blocksize variant of HMAC-SHA1. */
 Bytes::ByteString hmacSha1_64(const Bytes::ByteString & key, const Bytes::ByteString & msg);
 
+/** The 64-bit-blocksize variant of HMAC-SHA1, writing into a buffer. */
+size_t hmacSha1_64Into(const Bytes::Byte * key, size_t keySize, const Bytes::Byte * msg, size_t msgSize, Bytes::Byte * digest, size_t digestCapacity);
+
 /**
  * Calculate the HOTP value of the given key, message and digit count.
  */
@@ -32,6 +36,92 @@ uint32_t hotp(const Bytes::ByteString & key, uint64_t counter, size_t digitCount
  */
 uint32_t totp(const Bytes::ByteString & key, uint64_t timeNow, uint64_t timeStart, uint64_t timeStep, size_t digitCount = 6, HmacFunc hmac = hmacSha1_64);
 
+/**
+ * Calculate the HOTP value of the given key, counter and digit count without
+ * allocating memory.
+ */
+uint32_t hotp(const Bytes::Byte * key, size_t keySize, uint64_t counter, size_t digitCount = 6, HmacIntoFunc hmac = hmacSha1_64Into);
+
+/**
+ * Calculate the TOTP value from the given parameters without allocating
+ * memory.
+ */
+uint32_t totp(const Bytes::Byte * key, size_t keySize, uint64_t timeNow, uint64_t timeStart, uint64_t timeStep, size_t digitCount = 6, HmacIntoFunc hmac = hmacSha1_64Into);
+
+/**
+ * Calculate the HOTP value of the given prepared HMAC-SHA-1 key, counter and
+ * digit count.
+ */
+uint32_t hotp(const HmacSha1Key & key, uint64_t counter, size_t digitCount = 6);
+
+/**
+ * Calculate the TOTP value from the given prepared HMAC-SHA-1 key and
+ * parameters.
+ */
+uint32_t totp(const HmacSha1Key & key, uint64_t timeNow, uint64_t timeStart, uint64_t timeStep, size_t digitCount = 6);
+
+/**
+ * Calculate the HOTP values of many key/counter pairs at once.
+ *
+ * keys[i] and counters[i] produce out[i]. The calculations are spread across
+ * SIMD lanes, which makes this considerably faster than calling hotp() in a
+ * loop; the same key may appear multiple times.
+ */
+void hotpMany(const HmacSha1Key * const keys[], const uint64_t counters[], size_t count, size_t digitCount, uint32_t out[]);
+
+/**
+ * Calculate the HOTP value from the HMAC digest in the given lane of the
+ * result of hmacSha1CounterLanes().
+ */
+uint32_t hotpFromLane(const Sha1LaneStates & digests, size_t lane, size_t digitCount = 6);
+
+/**
+ * Search the counters from startCounter to startCounter + lookAhead for the
+ * given HOTP value, stopping at the first match (RFC 4226, section 7.4).
+ *
+ * The counters are fed through the SIMD lanes in consecutive batches, all
+ * sharing the prepared key, so large look-ahead windows are cheap.
+ *
+ * @param matchedCounter If not null and the code matched, receives the
+ * matching counter.
+ * @return Whether the code matched any of the counters.
+ */
+bool hotpSearch(const HmacSha1Key & key, uint64_t startCounter, size_t lookAhead, uint32_t code, uint64_t * matchedCounter = nullptr, size_t digitCount = 6);
+
+/**
+ * Search the counters from startCounter to startCounter + lookAhead for a
+ * counter whose HOTP value is code and whose successor's value is secondCode,
+ * as used to resynchronize with a token that has drifted far ahead.
+ *
+ * @param matchedCounter If not null and the codes matched, receives the
+ * counter of the first code.
+ * @see hotpSearch(const HmacSha1Key &, uint64_t, size_t, uint32_t, uint64_t *, size_t)
+ */
+bool hotpSearch(const HmacSha1Key & key, uint64_t startCounter, size_t lookAhead, uint32_t code, uint32_t secondCode, uint64_t * matchedCounter = nullptr, size_t digitCount = 6);
+
+/**
+ * Check a TOTP value against the current time step and the given number of
+ * time steps before and after it.
+ *
+ * All candidate values are calculated in one batch from the prepared key and
+ * each of them is compared to the code without exiting early, so the running
+ * time does not reveal which step (if any) matched. If multiple steps match,
+ * the one closest to the current step wins.
+ *
+ * @param matchedOffset If not null and the code matched, receives the offset
+ * (in time steps, relative to the current one) of the matching step.
+ * @return Whether the code matched any of the steps.
+ */
+bool verifyTotp(const HmacSha1Key & key, uint32_t code, uint64_t timeNow, uint64_t timeStart, uint64_t timeStep, size_t window = 1, size_t digitCount = 6, int64_t * matchedOffset = nullptr);
+
+/**
+ * Check a TOTP value against the current time step and the given number of
+ * time steps before and after it.
+ *
+ * @see verifyTotp(const HmacSha1Key &, uint32_t, uint64_t, uint64_t, uint64_t, size_t, size_t, int64_t *)
+ */
+bool verifyTotp(const Bytes::ByteString & key, uint32_t code, uint64_t timeNow, uint64_t timeStart, uint64_t timeStep, size_t window = 1, size_t digitCount = 6, int64_t * matchedOffset = nullptr);
+
 }
 
 #endif
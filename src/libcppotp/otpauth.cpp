@@ -0,0 +1,597 @@
+/**
+ * @file otpauth.cpp
+ *
+ * @brief Implementation of the otpauth:// importer.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#include "otpauth.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace CppTotp
+{
+
+/** Inputs smaller than this per thread are not worth splitting up. */
+static const size_t MinBytesPerThread = 256 * 1024;
+
+/** The size of the chunks read from a stream. */
+static const size_t StreamChunkSize = 4 * 1024 * 1024;
+
+static inline char asciiToLower(char c)
+{
+	return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+/** Compares a string case-insensitively with a lowercase literal. */
+static bool equalsLiteral(const char * str, size_t size, const char * literal)
+{
+	size_t i;
+	for (i = 0; i < size; ++i)
+	{
+		if (literal[i] == '\0' || asciiToLower(str[i]) != literal[i])
+		{
+			return false;
+		}
+	}
+	return literal[i] == '\0';
+}
+
+static int hexDigitValue(char c)
+{
+	if (c >= '0' && c <= '9')
+	{
+		return c - '0';
+	}
+	c = asciiToLower(c);
+	if (c >= 'a' && c <= 'f')
+	{
+		return c - 'a' + 10;
+	}
+	return -1;
+}
+
+static bool parseDecimal(const char * str, size_t size, uint64_t maximum, uint64_t * value)
+{
+	if (size == 0)
+	{
+		return false;
+	}
+
+	uint64_t ret = 0;
+	for (size_t i = 0; i < size; ++i)
+	{
+		if (str[i] < '0' || str[i] > '9')
+		{
+			return false;
+		}
+
+		uint64_t digit = static_cast<uint64_t>(str[i] - '0');
+		if (ret > (maximum - digit) / 10)
+		{
+			return false;
+		}
+		ret = ret * 10 + digit;
+	}
+
+	*value = ret;
+	return true;
+}
+
+/** Normalizes the secret parameter and decodes it into the record. */
+static const char * decodeSecret(const char * value, size_t size, OtpAuthRecord * record)
+{
+	char chars[(OtpAuthMaxSecretSize * 8 + 4) / 5];
+	size_t count = 0;
+	const char * problem = nullptr;
+
+	for (size_t i = 0; i < size; ++i)
+	{
+		char c = value[i];
+
+		if (c == '%')
+		{
+			int hi = (i + 2 < size) ? hexDigitValue(value[i+1]) : -1;
+			int lo = (i + 2 < size) ? hexDigitValue(value[i+2]) : -1;
+			if (hi < 0 || lo < 0)
+			{
+				problem = "invalid percent-encoding in secret";
+				break;
+			}
+			c = static_cast<char>((hi << 4) | lo);
+			i += 2;
+		}
+
+		if (c == ' ' || c == '+' || c == '-' || c == '=')
+		{
+			// skip separators and padding
+			continue;
+		}
+
+		if (count == sizeof(chars))
+		{
+			problem = "secret too long";
+			break;
+		}
+		chars[count++] = (c >= 'a' && c <= 'z') ? static_cast<char>(c - 'a' + 'A') : c;
+	}
+
+	if (problem == nullptr && count == 0)
+	{
+		problem = "empty secret";
+	}
+
+	if (problem == nullptr)
+	{
+		size_t written = Bytes::decodeBase32(chars, count, record->secret);
+		if (written == Bytes::DecodeError)
+		{
+			problem = "secret is not valid Base32";
+		}
+		else
+		{
+			record->secretSize = written;
+		}
+	}
+
+	Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(chars), count);
+	return problem;
+}
+
+const char * parseOtpAuthUri(const char * uri, size_t size, OtpAuthRecord * record)
+{
+	static const size_t SchemeSize = 10;
+	const char * const end = uri + size;
+
+	if (size < SchemeSize || !equalsLiteral(uri, SchemeSize, "otpauth://"))
+	{
+		return "not an otpauth:// URI";
+	}
+
+	const char * type = uri + SchemeSize;
+	const char * slash = static_cast<const char *>(std::memchr(type, '/', static_cast<size_t>(end - type)));
+	if (slash == nullptr)
+	{
+		return "missing label";
+	}
+
+	if (equalsLiteral(type, static_cast<size_t>(slash - type), "totp"))
+	{
+		record->params.kind = OtpKind::Totp;
+	}
+	else if (equalsLiteral(type, static_cast<size_t>(slash - type), "hotp"))
+	{
+		record->params.kind = OtpKind::Hotp;
+	}
+	else
+	{
+		return "unknown OTP type";
+	}
+
+	const char * query = static_cast<const char *>(std::memchr(slash, '?', static_cast<size_t>(end - slash)));
+	if (query == nullptr)
+	{
+		return "missing parameters";
+	}
+
+	record->label = slash + 1;
+	record->labelSize = static_cast<size_t>(query - record->label);
+	record->issuer = nullptr;
+	record->issuerSize = 0;
+	record->params.digits = 6;
+	record->params.timeStep = 30;
+	record->params.timeStart = 0;
+	record->params.counter = 0;
+
+	bool haveSecret = false;
+	bool haveCounter = false;
+
+	const char * param = query + 1;
+	while (param < end)
+	{
+		const char * paramEnd = static_cast<const char *>(std::memchr(param, '&', static_cast<size_t>(end - param)));
+		if (paramEnd == nullptr)
+		{
+			paramEnd = end;
+		}
+
+		const char * equals = static_cast<const char *>(std::memchr(param, '=', static_cast<size_t>(paramEnd - param)));
+		const char * value = (equals == nullptr) ? paramEnd : equals + 1;
+		const size_t nameSize = static_cast<size_t>(((equals == nullptr) ? paramEnd : equals) - param);
+		const size_t valueSize = static_cast<size_t>(paramEnd - value);
+		uint64_t number = 0;
+
+		if (equalsLiteral(param, nameSize, "secret"))
+		{
+			const char * problem = decodeSecret(value, valueSize, record);
+			if (problem != nullptr)
+			{
+				return problem;
+			}
+			haveSecret = true;
+		}
+		else if (equalsLiteral(param, nameSize, "issuer"))
+		{
+			record->issuer = value;
+			record->issuerSize = valueSize;
+		}
+		else if (equalsLiteral(param, nameSize, "algorithm"))
+		{
+			if (!equalsLiteral(value, valueSize, "sha1"))
+			{
+				return "unsupported algorithm";
+			}
+		}
+		else if (equalsLiteral(param, nameSize, "digits"))
+		{
+			if (!parseDecimal(value, valueSize, 9, &number) || number < 1)
+			{
+				return "invalid digit count";
+			}
+			record->params.digits = static_cast<uint8_t>(number);
+		}
+		else if (equalsLiteral(param, nameSize, "period"))
+		{
+			if (!parseDecimal(value, valueSize, 0xFFFFFFFFu, &number) || number < 1)
+			{
+				return "invalid period";
+			}
+			record->params.timeStep = static_cast<uint32_t>(number);
+		}
+		else if (equalsLiteral(param, nameSize, "counter"))
+		{
+			if (!parseDecimal(value, valueSize, UINT64_MAX, &number))
+			{
+				return "invalid counter";
+			}
+			record->params.counter = number;
+			haveCounter = true;
+		}
+		// ignore unknown parameters
+
+		param = paramEnd + 1;
+	}
+
+	if (!haveSecret)
+	{
+		// don't hand out a stale secret
+		record->secretSize = 0;
+		return "missing secret";
+	}
+
+	if (record->params.kind == OtpKind::Hotp)
+	{
+		if (!haveCounter)
+		{
+			return "missing counter";
+		}
+		record->params.timeStep = 0;
+	}
+	else
+	{
+		record->params.counter = 0;
+	}
+
+	return nullptr;
+}
+
+static inline bool isBlank(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+/** Imports the lines of a range which starts at the beginning of a line. */
+static size_t importRange(const char * data, size_t size, size_t firstLine, OtpAuthSink * sink)
+{
+	OtpAuthRecord record;
+	record.secretSize = 0;
+	size_t accepted = 0;
+	size_t lineNumber = firstLine;
+
+	const char * const end = data + size;
+	const char * line = data;
+	while (line < end)
+	{
+		const char * lineEnd = static_cast<const char *>(std::memchr(line, '\n', static_cast<size_t>(end - line)));
+		if (lineEnd == nullptr)
+		{
+			lineEnd = end;
+		}
+
+		const char * first = line;
+		const char * last = lineEnd;
+		while (first < last && isBlank(*first))
+		{
+			++first;
+		}
+		while (last > first && isBlank(*(last - 1)))
+		{
+			--last;
+		}
+
+		if (first < last && *first != '#')
+		{
+			const char * problem = parseOtpAuthUri(first, static_cast<size_t>(last - first), &record);
+			if (problem == nullptr)
+			{
+				sink->record(lineNumber, record);
+				++accepted;
+			}
+			else
+			{
+				sink->error(lineNumber, problem);
+			}
+			Bytes::clearBytes(record.secret, record.secretSize);
+		}
+
+		line = lineEnd + 1;
+		++lineNumber;
+	}
+
+	return accepted;
+}
+
+/** Runs the function for each of the given number of parts, one thread each. */
+template <typename Func>
+static void runParallel(size_t count, Func func)
+{
+	std::vector<std::thread> threads;
+	threads.reserve(count - 1);
+	for (size_t i = 1; i < count; ++i)
+	{
+		threads.emplace_back(func, i);
+	}
+
+	// the calling thread takes the first part
+	func(0);
+
+	for (std::thread & thread : threads)
+	{
+		thread.join();
+	}
+}
+
+static size_t importLines(const char * data, size_t size, size_t firstLine, OtpAuthSink * sink, size_t threadCount)
+{
+	if (threadCount == 0)
+	{
+		threadCount = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+	}
+	threadCount = std::min(threadCount, std::max<size_t>(size / MinBytesPerThread, 1));
+
+	if (threadCount == 1)
+	{
+		return importRange(data, size, firstLine, sink);
+	}
+
+	// split into parts of roughly equal size at line boundaries
+	std::vector<size_t> bounds(threadCount + 1, size);
+	bounds[0] = 0;
+	for (size_t i = 1; i < threadCount; ++i)
+	{
+		size_t pos = std::max(size / threadCount * i, bounds[i-1]);
+		const char * newline = static_cast<const char *>(std::memchr(data + pos, '\n', size - pos));
+		bounds[i] = (newline == nullptr) ? size : static_cast<size_t>(newline - data) + 1;
+	}
+
+	// line numbers need the line counts of all preceding parts
+	std::vector<size_t> firstLines(threadCount);
+	runParallel(threadCount, [&](size_t i)
+	{
+		firstLines[i] = static_cast<size_t>(std::count(data + bounds[i], data + bounds[i+1], '\n'));
+	});
+	size_t lineNumber = firstLine;
+	for (size_t i = 0; i < threadCount; ++i)
+	{
+		size_t lines = firstLines[i];
+		firstLines[i] = lineNumber;
+		lineNumber += lines;
+	}
+
+	std::vector<size_t> accepted(threadCount);
+	runParallel(threadCount, [&](size_t i)
+	{
+		accepted[i] = importRange(data + bounds[i], bounds[i+1] - bounds[i], firstLines[i], sink);
+	});
+
+	size_t ret = 0;
+	for (size_t count : accepted)
+	{
+		ret += count;
+	}
+	return ret;
+}
+
+size_t importOtpAuth(const char * data, size_t size, OtpAuthSink * sink, size_t threadCount)
+{
+	return importLines(data, size, 1, sink, threadCount);
+}
+
+size_t importOtpAuthFile(const std::string & path, OtpAuthSink * sink, size_t threadCount)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		throw std::runtime_error("cannot open " + path + ": " + std::strerror(errno));
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		int err = errno;
+		close(fd);
+		throw std::runtime_error("cannot stat " + path + ": " + std::strerror(err));
+	}
+	if (st.st_size == 0)
+	{
+		close(fd);
+		return 0;
+	}
+
+	size_t size = static_cast<size_t>(st.st_size);
+	void * map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	int err = errno;
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		throw std::runtime_error("cannot map " + path + ": " + std::strerror(err));
+	}
+	madvise(map, size, MADV_SEQUENTIAL);
+
+	size_t ret = importOtpAuth(static_cast<const char *>(map), size, sink, threadCount);
+	munmap(map, size);
+	return ret;
+}
+
+size_t importOtpAuthStream(std::istream & input, OtpAuthSink * sink, size_t threadCount)
+{
+	std::vector<char> buffer(StreamChunkSize);
+	size_t filled = 0;
+	size_t lineNumber = 1;
+	size_t accepted = 0;
+	bool atEnd = false;
+
+	while (!atEnd)
+	{
+		if (filled == buffer.size())
+		{
+			// a single line longer than the buffer
+			buffer.resize(buffer.size() * 2);
+		}
+
+		input.read(&buffer[filled], static_cast<std::streamsize>(buffer.size() - filled));
+		filled += static_cast<size_t>(input.gcount());
+		atEnd = !input;
+
+		// only pass on complete lines, unless nothing more will come
+		size_t usable = filled;
+		if (!atEnd)
+		{
+			while (usable > 0 && buffer[usable - 1] != '\n')
+			{
+				--usable;
+			}
+		}
+		if (usable == 0)
+		{
+			continue;
+		}
+
+		accepted += importLines(buffer.data(), usable, lineNumber, sink, threadCount);
+		lineNumber += static_cast<size_t>(std::count(buffer.begin(), buffer.begin() + usable, '\n'));
+
+		Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(buffer.data()), usable);
+		std::copy(buffer.begin() + usable, buffer.begin() + filled, buffer.begin());
+		filled -= usable;
+	}
+
+	Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(buffer.data()), buffer.size());
+	return accepted;
+}
+
+}
+
+#if TEST_OTPAUTH
+#include "otp.h"
+
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <sstream>
+
+using namespace CppTotp;
+
+class TestSink : public OtpAuthSink
+{
+public:
+	std::mutex mutex;
+	std::set<size_t> errorLines;
+	std::set<size_t> recordLines;
+	uint32_t firstCode = 0;
+	std::string firstIssuer;
+	uint8_t firstDigits = 0;
+
+	void record(size_t lineNumber, const OtpAuthRecord & record) override
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (lineNumber == 1)
+		{
+			firstCode = hotp(HmacSha1Key(record.secret, record.secretSize), 1, record.params.digits);
+			firstIssuer.assign(record.issuer, record.issuerSize);
+			firstDigits = record.params.digits;
+		}
+		recordLines.insert(lineNumber);
+	}
+
+	void error(size_t lineNumber, const char *) override
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		errorLines.insert(lineNumber);
+	}
+};
+
+int main(void)
+{
+	const std::string small =
+		"otpauth://totp/Example:alice@example.com?secret=gezd-gnbv-gy3t-qojq-gezd-gnbv-gy3t-qojq%3D%3D&issuer=Example&digits=8\n"
+		"\n"
+		"# comment\n"
+		"otpauth://hotp/x?secret=GEZDGNBVGY3TQOJQ&counter=3\r\n"
+		"otpauth://hotp/x?secret=GEZDGNBVGY3TQOJQ\n"
+		"otpauth://totp/x?secret=GEZDGNBVGY3TQOJ1\n"
+		"otpauth://totp/x?secret=GEZDGNBVGY3TQOJQ&algorithm=SHA256\n"
+		"http://example.com/\n"
+		"OTPAUTH://TOTP/x?SECRET=GEZDGNBVGY3TQOJQ&period=60&image=x"
+	;
+
+	TestSink sink;
+	size_t accepted = importOtpAuth(small.data(), small.size(), &sink, 1);
+
+	std::cout
+		<< (accepted == 3)
+		<< (sink.firstCode == 94287082) << (sink.firstIssuer == "Example") << (sink.firstDigits == 8)
+		<< (sink.recordLines == std::set<size_t>{ 1, 4, 9 })
+		<< (sink.errorLines == std::set<size_t>{ 5, 6, 7, 8 })
+	<< std::endl;
+
+	// many lines across threads and stream chunks; every 1000th is broken
+	std::string big;
+	std::set<size_t> expectedErrors;
+	for (size_t i = 1; i <= 100000; ++i)
+	{
+		if (i % 1000 == 0)
+		{
+			big += "otpauth://totp/broken?secret=1\n";
+			expectedErrors.insert(i);
+		}
+		else
+		{
+			big += "otpauth://totp/account" + std::to_string(i) + "?secret=GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ&issuer=Test\n";
+		}
+	}
+
+	TestSink parallelSink;
+	accepted = importOtpAuth(big.data(), big.size(), &parallelSink, 4);
+	std::cout << (accepted == 99900) << (parallelSink.errorLines == expectedErrors) << (parallelSink.recordLines.size() == 99900);
+
+	TestSink streamSink;
+	std::istringstream stream(big);
+	accepted = importOtpAuthStream(stream, &streamSink, 2);
+	std::cout << (accepted == 99900) << (streamSink.errorLines == expectedErrors) << std::endl;
+
+	return 0;
+}
+#endif
@@ -0,0 +1,114 @@
+/**
+ * @file otpauth.h
+ *
+ * @brief Bulk import of otpauth:// URIs.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#ifndef __CPPTOTP_OTPAUTH_H__
+#define __CPPTOTP_OTPAUTH_H__
+
+#include "bytes.h"
+#include "credstore.h"
+
+#include <istream>
+#include <string>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace CppTotp
+{
+
+/** The maximum size of a decoded secret, in bytes. */
+const size_t OtpAuthMaxSecretSize = 128;
+
+/**
+ * An account parsed from an otpauth:// URI.
+ *
+ * The label and the issuer are neither copied nor percent-decoded; they point
+ * into the input and are only valid as long as it is.
+ */
+struct OtpAuthRecord
+{
+	/** The parameters; the start time is always 0. */
+	CredentialParams params;
+
+	/** The decoded secret. */
+	Bytes::Byte secret[OtpAuthMaxSecretSize];
+	size_t secretSize;
+
+	/** The label (the path of the URI). */
+	const char * label;
+	size_t labelSize;
+
+	/** The issuer parameter; null if not given. */
+	const char * issuer;
+	size_t issuerSize;
+};
+
+/**
+ * Receives the results of an import.
+ *
+ * With more than one thread, both functions may be called concurrently and
+ * out of order; they must not throw.
+ */
+class OtpAuthSink
+{
+public:
+	virtual ~OtpAuthSink() {}
+
+	/**
+	 * Called for each valid URI. The secret is wiped once this returns.
+	 *
+	 * @param lineNumber The line number, starting at 1.
+	 */
+	virtual void record(size_t lineNumber, const OtpAuthRecord & record) = 0;
+
+	/** Called for each invalid URI; the import continues. */
+	virtual void error(size_t lineNumber, const char * message) = 0;
+};
+
+/**
+ * Parses a single otpauth:// URI of the form
+ * otpauth://TYPE/LABEL?secret=SECRET&PARAMETERS without allocating.
+ *
+ * Supported parameters are secret (Base32; case, separators, padding and
+ * percent-encoding are tolerated), issuer, algorithm (SHA1 only), digits,
+ * period and counter (required for HOTP); others are ignored.
+ *
+ * @return null on success or a description of the problem.
+ */
+const char * parseOtpAuthUri(const char * uri, size_t size, OtpAuthRecord * record);
+
+/**
+ * Imports newline-separated otpauth:// URIs from the given buffer. Empty lines
+ * and lines starting with '#' are skipped.
+ *
+ * @param threadCount The number of threads to use on large inputs; 0 means one
+ * per processor.
+ * @return The number of valid URIs.
+ */
+size_t importOtpAuth(const char * data, size_t size, OtpAuthSink * sink, size_t threadCount = 0);
+
+/**
+ * Imports otpauth:// URIs from a memory-mapped file.
+ *
+ * @throw std::runtime_error if the file cannot be mapped.
+ * @see importOtpAuth
+ */
+size_t importOtpAuthFile(const std::string & path, OtpAuthSink * sink, size_t threadCount = 0);
+
+/**
+ * Imports otpauth:// URIs from a stream, such as a pipe, reading it in large
+ * chunks.
+ *
+ * @see importOtpAuth
+ */
+size_t importOtpAuthStream(std::istream & input, OtpAuthSink * sink, size_t threadCount = 0);
+
+}
+
+#endif
@@ -0,0 +1,160 @@
+/**
+ * @file otptemplate.h
+ *
+ * @brief One-time-password generators specialized at compile time.
+ *
+ * With the hash, the digit count and the time step known at compile time, the
+ * power of ten and the division by the time step become constants and the
+ * HMAC is inlined instead of called through a function pointer. With constant
+ * inputs, a value can even be calculated at compile time.
+ *
+ * @note The inlined HMAC uses portable scalar code; on CPUs with the SHA
+ * extensions, the runtime hotp() using HmacSha1Key may still be faster.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#ifndef __CPPTOTP_OTPTEMPLATE_H__
+#define __CPPTOTP_OTPTEMPLATE_H__
+
+#include "consttime.h"
+#include "sha1.h"
+#include "sha1const.h"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace CppTotp
+{
+
+/** The HMAC-SHA-1 hash policy for Hotp and Totp. */
+struct HmacSha1Policy
+{
+	/** The prepared key. */
+	typedef ConstSha1::Key Key;
+
+	/** Prepares the given key. */
+	template <typename CharT>
+	static constexpr Key prepareKey(const CharT * key, size_t keySize)
+	{
+		return ConstSha1::prepareKey(key, keySize);
+	}
+
+	/** Takes over the midstates of a key prepared at runtime. */
+	static Key prepareKey(const HmacSha1Key & key)
+	{
+		Key ret = {};
+		for (size_t i = 0; i < 5; ++i)
+		{
+			ret.inner.h[i] = key.innerState()[i];
+			ret.outer.h[i] = key.outerState()[i];
+		}
+		return ret;
+	}
+
+	/**
+	 * Calculates the HMAC of the given counter and performs the dynamic
+	 * truncation on it, returning a 31-bit value.
+	 */
+	static constexpr uint32_t truncatedHmac(const Key & key, uint64_t counter)
+	{
+		return ConstSha1::truncate(ConstSha1::hmacCounter(key, counter));
+	}
+};
+
+/** Returns 10 to the power of the given exponent. */
+constexpr uint32_t pow10u32(unsigned exponent)
+{
+	return (exponent == 0) ? 1 : 10 * pow10u32(exponent - 1);
+}
+
+/** HOTP with the hash and the digit count fixed at compile time. */
+template <typename Hash, unsigned Digits>
+struct Hotp
+{
+	static_assert(Digits >= 1 && Digits <= 9, "the digit count must be between 1 and 9");
+
+	typedef typename Hash::Key Key;
+
+	/** The number of distinct values. */
+	static constexpr uint32_t modulus()
+	{
+		return pow10u32(Digits);
+	}
+
+	/** Calculates the HOTP value for the given counter. */
+	static constexpr uint32_t generate(const Key & key, uint64_t counter)
+	{
+		return Hash::truncatedHmac(key, counter) % modulus();
+	}
+};
+
+/**
+ * TOTP with the hash, the digit count, the time step and the start time fixed
+ * at compile time.
+ */
+template <typename Hash, unsigned Digits, uint64_t Step, uint64_t Start = 0>
+struct Totp
+{
+	static_assert(Step > 0, "the time step must not be zero");
+
+	typedef typename Hash::Key Key;
+
+	/** Returns the time step (the HOTP counter) at the given time. */
+	static constexpr uint64_t stepAt(uint64_t timeNow)
+	{
+		return (timeNow - Start) / Step;
+	}
+
+	/** Calculates the TOTP value at the given time. */
+	static constexpr uint32_t generate(const Key & key, uint64_t timeNow)
+	{
+		return Hotp<Hash, Digits>::generate(key, stepAt(timeNow));
+	}
+
+	/**
+	 * Checks a TOTP value against the current time step and the given number of
+	 * time steps before and after it, without exiting early.
+	 *
+	 * @see verifyTotp(const HmacSha1Key &, uint32_t, uint64_t, uint64_t, uint64_t, size_t, size_t, int64_t *)
+	 */
+	static bool verify(const Key & key, uint32_t code, uint64_t timeNow, size_t window = 1, int64_t * matchedOffset = nullptr)
+	{
+		const uint64_t timeValue = stepAt(timeNow);
+		uint32_t found = 0;
+		uint64_t foundOffset = 0;
+
+		// in order of preference: 0, -1, +1, -2, +2, ...
+		for (size_t i = 0; i < 2*window + 1; ++i)
+		{
+			int64_t distance = static_cast<int64_t>((i + 1) / 2);
+			int64_t offset = (i % 2 == 1) ? -distance : distance;
+			uint64_t counter = timeValue + static_cast<uint64_t>(offset);
+
+			uint32_t valid = (offset < 0)
+				? (timeValue >= static_cast<uint64_t>(-offset))
+				: (counter >= timeValue)
+			;
+
+			uint32_t take = ctEqual(Hotp<Hash, Digits>::generate(key, counter), code) & valid & (found ^ 1u);
+			uint64_t mask = 0u - static_cast<uint64_t>(take);
+
+			foundOffset |= mask & static_cast<uint64_t>(offset);
+			found |= take;
+		}
+
+		if (found && matchedOffset != nullptr)
+		{
+			*matchedOffset = static_cast<int64_t>(foundOffset);
+		}
+		return found != 0;
+	}
+};
+
+/** The most common configuration: HMAC-SHA-1, six digits, 30 seconds. */
+typedef Totp<HmacSha1Policy, 6, 30> StandardTotp;
+
+}
+
+#endif
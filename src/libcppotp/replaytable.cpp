@@ -0,0 +1,149 @@
+/**
+ * @file replaytable.cpp
+ *
+ * @brief Implementation of the replay-protection table.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#include "replaytable.h"
+
+namespace CppTotp
+{
+
+ReplayTable::ReplayTable(size_t size)
+	: m_steps(new std::atomic<uint64_t>[size]), m_size(size)
+{
+	for (size_t i = 0; i < size; ++i)
+	{
+		m_steps[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+ReplayTable::~ReplayTable()
+{
+	delete[] m_steps;
+}
+
+bool ReplayTable::tryAdvance(size_t index, uint64_t step)
+{
+	const uint64_t next = step + 1;
+	uint64_t current = m_steps[index].load(std::memory_order_relaxed);
+
+	// on failure, current is reloaded; give up once someone else got as far
+	while (current < next)
+	{
+		if (m_steps[index].compare_exchange_weak(current, next, std::memory_order_acq_rel, std::memory_order_relaxed))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+bool ReplayTable::lastAccepted(size_t index, uint64_t * step) const
+{
+	uint64_t stored = m_steps[index].load(std::memory_order_acquire);
+	if (stored == 0)
+	{
+		return false;
+	}
+	*step = stored - 1;
+	return true;
+}
+
+void ReplayTable::reset(size_t index)
+{
+	m_steps[index].store(0, std::memory_order_release);
+}
+
+bool verifyTotpOnce(
+	const CredentialStore & store, ReplayTable * replay, size_t index,
+	uint32_t code, uint64_t timeNow, size_t window, int64_t * matchedOffset
+)
+{
+	int64_t offset = 0;
+	if (!store.verifyTotp(index, code, timeNow, window, &offset))
+	{
+		return false;
+	}
+
+	const CredentialParams params = store.params(index);
+	const uint64_t step = (timeNow - params.timeStart) / params.timeStep + static_cast<uint64_t>(offset);
+	if (!replay->tryAdvance(index, step))
+	{
+		return false;
+	}
+
+	if (matchedOffset != nullptr)
+	{
+		*matchedOffset = offset;
+	}
+	return true;
+}
+
+}
+
+#if TEST_REPLAYTABLE
+#include <iostream>
+#include <thread>
+#include <vector>
+
+int main(void)
+{
+	using namespace CppTotp;
+
+	const Bytes::ByteString key = reinterpret_cast<const uint8_t *>("12345678901234567890");
+	CredentialStore store(1);
+	size_t index = store.add(1, HmacSha1Key(key), { OtpKind::Totp, 8, 30, 0, 0 });
+	ReplayTable replay(1);
+	uint64_t step = 0;
+
+	std::cout
+		<< !replay.lastAccepted(index, &step)
+		<< verifyTotpOnce(store, &replay, index, 94287082, 59)
+		<< !verifyTotpOnce(store, &replay, index, 94287082, 59)
+		<< (replay.lastAccepted(index, &step) && step == 1)
+		// the code of the previous step within the window is refused, too
+		<< !verifyTotpOnce(store, &replay, index, 94287082, 61)
+	;
+
+	// no step of any account may be accepted twice
+	const size_t Accounts = 1000;
+	const size_t Steps = 100;
+	ReplayTable shared(Accounts);
+	std::vector<std::atomic<uint32_t> > accepted(Accounts * Steps);
+	std::vector<std::thread> threads;
+
+	for (size_t t = 0; t < 4; ++t)
+	{
+		threads.emplace_back([&shared, &accepted]()
+		{
+			for (uint64_t s = 0; s < Steps; ++s)
+			{
+				for (size_t i = 0; i < Accounts; ++i)
+				{
+					if (shared.tryAdvance(i, s))
+					{
+						accepted[i * Steps + s].fetch_add(1);
+					}
+				}
+			}
+		});
+	}
+	for (std::thread & thread : threads)
+	{
+		thread.join();
+	}
+
+	bool once = true;
+	for (const std::atomic<uint32_t> & count : accepted)
+	{
+		once = once && count.load() <= 1;
+	}
+	std::cout << once << (shared.lastAccepted(0, &step) && step == Steps - 1) << std::endl;
+
+	return 0;
+}
+#endif
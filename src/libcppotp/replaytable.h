@@ -0,0 +1,83 @@
+/**
+ * @file replaytable.h
+ *
+ * @brief Lock-free tracking of the last accepted time step per account.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#ifndef __CPPTOTP_REPLAYTABLE_H__
+#define __CPPTOTP_REPLAYTABLE_H__
+
+#include "credstore.h"
+
+#include <atomic>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace CppTotp
+{
+
+/**
+ * Remembers the last accepted TOTP time step (or HOTP counter) of each account
+ * so that a value cannot be used twice (RFC 6238, section 5.2).
+ *
+ * The table is a single array of 64-bit atomics, indexed like the
+ * CredentialStore; all operations are lock-free and may be called from any
+ * number of threads at once.
+ */
+class ReplayTable
+{
+private:
+	/** The last accepted step + 1 for each account (0 = none yet). */
+	std::atomic<uint64_t> * m_steps;
+	size_t m_size;
+
+public:
+	/** Creates a table for the given number of accounts, none of them used. */
+	explicit ReplayTable(size_t size);
+	~ReplayTable();
+
+	ReplayTable(const ReplayTable &) = delete;
+	ReplayTable & operator=(const ReplayTable &) = delete;
+
+	/** The number of accounts. */
+	size_t size() const { return m_size; }
+
+	/**
+	 * Accepts the given step of the given account if it comes after the last
+	 * accepted one.
+	 *
+	 * @return false if the step (or a later one) has already been accepted.
+	 */
+	bool tryAdvance(size_t index, uint64_t step);
+
+	/**
+	 * Fetches the last accepted step of the given account.
+	 *
+	 * @return false if no step has been accepted yet.
+	 */
+	bool lastAccepted(size_t index, uint64_t * step) const;
+
+	/** Forgets the last accepted step of the given account. */
+	void reset(size_t index);
+};
+
+/**
+ * Checks a TOTP value of the account at the given index and accepts the
+ * matching time step at most once.
+ *
+ * @return true if the value is valid and its time step had not been accepted
+ * before.
+ * @see CredentialStore::verifyTotp
+ */
+bool verifyTotpOnce(
+	const CredentialStore & store, ReplayTable * replay, size_t index,
+	uint32_t code, uint64_t timeNow, size_t window = 1, int64_t * matchedOffset = nullptr
+);
+
+}
+
+#endif
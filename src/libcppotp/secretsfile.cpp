@@ -0,0 +1,360 @@
+/**
+ * @file secretsfile.cpp
+ *
+ * @brief Implementation of the memory-mapped secrets file.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#include "secretsfile.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace CppTotp
+{
+
+static const char FileMagic[8] = { 'C', 'P', 'O', 'T', 'P', 'S', 'E', 'C' };
+
+// header offsets
+static const size_t OffVersion = 8;
+static const size_t OffRecordSize = 12;
+static const size_t OffRecordCount = 16;
+static const size_t OffChecksum = 24;
+
+// record offsets
+static const size_t OffAccountId = 0;
+static const size_t OffInner = 8;
+static const size_t OffOuter = 28;
+static const size_t OffStartOrCounter = 48;
+static const size_t OffTimeStep = 56;
+static const size_t OffKind = 60;
+static const size_t OffDigits = 61;
+
+static std::runtime_error fileError(const std::string & what, const std::string & path)
+{
+	return std::runtime_error(what + " " + path + ": " + std::strerror(errno));
+}
+
+SecretsFile::SecretsFile(const std::string & path, bool verifyChecksum)
+	: m_map(nullptr), m_mapSize(0), m_records(nullptr), m_recordCount(0)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		throw fileError("cannot open secrets file", path);
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		close(fd);
+		throw fileError("cannot stat secrets file", path);
+	}
+	if (static_cast<size_t>(st.st_size) < HeaderSize)
+	{
+		close(fd);
+		throw std::runtime_error("secrets file too short: " + path);
+	}
+
+	m_mapSize = static_cast<size_t>(st.st_size);
+	void * map = mmap(nullptr, m_mapSize, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		throw fileError("cannot map secrets file", path);
+	}
+	m_map = static_cast<const uint8_t *>(map);
+
+	const char * problem = nullptr;
+	uint64_t recordCount = Bytes::u64leFromBytes(m_map + OffRecordCount);
+	if (std::memcmp(m_map, FileMagic, sizeof(FileMagic)) != 0)
+	{
+		problem = "not a secrets file";
+	}
+	else if (Bytes::u32leFromBytes(m_map + OffVersion) != Version)
+	{
+		problem = "unsupported secrets file version";
+	}
+	else if (Bytes::u32leFromBytes(m_map + OffRecordSize) != RecordSize)
+	{
+		problem = "unexpected secrets file record size";
+	}
+	else if (recordCount != (m_mapSize - HeaderSize) / RecordSize || (m_mapSize - HeaderSize) % RecordSize != 0)
+	{
+		problem = "secrets file size does not match record count";
+	}
+
+	m_records = m_map + HeaderSize;
+	m_recordCount = static_cast<size_t>(recordCount);
+
+	if (problem == nullptr && verifyChecksum)
+	{
+		Sha1Digest digest;
+		sha1(m_records, m_recordCount * RecordSize, &digest);
+		if (std::memcmp(digest.data(), m_map + OffChecksum, digest.size()) != 0)
+		{
+			problem = "secrets file checksum mismatch";
+		}
+	}
+
+	if (problem != nullptr)
+	{
+		munmap(const_cast<uint8_t *>(m_map), m_mapSize);
+		throw std::runtime_error(std::string(problem) + ": " + path);
+	}
+
+	// lookups jump around; don't bother reading ahead
+	madvise(const_cast<uint8_t *>(m_map), m_mapSize, MADV_RANDOM);
+}
+
+SecretsFile::~SecretsFile()
+{
+	munmap(const_cast<uint8_t *>(m_map), m_mapSize);
+}
+
+const uint8_t * SecretsFile::record(size_t index) const
+{
+	return m_records + index * RecordSize;
+}
+
+size_t SecretsFile::find(uint64_t accountId) const
+{
+	size_t lo = 0;
+	size_t hi = m_recordCount;
+
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		uint64_t midId = Bytes::u64leFromBytes(record(mid) + OffAccountId);
+
+		if (midId < accountId)
+		{
+			lo = mid + 1;
+		}
+		else if (midId > accountId)
+		{
+			hi = mid;
+		}
+		else
+		{
+			return mid;
+		}
+	}
+
+	return NotFound;
+}
+
+uint64_t SecretsFile::accountId(size_t index) const
+{
+	return Bytes::u64leFromBytes(record(index) + OffAccountId);
+}
+
+HmacSha1Key SecretsFile::key(size_t index) const
+{
+	const uint8_t * rec = record(index);
+	uint32_t inner[5];
+	uint32_t outer[5];
+
+	for (size_t i = 0; i < 5; ++i)
+	{
+		inner[i] = Bytes::u32leFromBytes(rec + OffInner + 4*i);
+		outer[i] = Bytes::u32leFromBytes(rec + OffOuter + 4*i);
+	}
+
+	HmacSha1Key ret(inner, outer);
+	Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(inner), sizeof(inner));
+	Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(outer), sizeof(outer));
+	return ret;
+}
+
+CredentialParams SecretsFile::params(size_t index) const
+{
+	const uint8_t * rec = record(index);
+	CredentialParams ret;
+
+	ret.kind = static_cast<OtpKind>(rec[OffKind]);
+	ret.digits = rec[OffDigits];
+	ret.timeStep = Bytes::u32leFromBytes(rec + OffTimeStep);
+	if (ret.kind == OtpKind::Hotp)
+	{
+		ret.timeStart = 0;
+		ret.counter = Bytes::u64leFromBytes(rec + OffStartOrCounter);
+	}
+	else
+	{
+		ret.timeStart = Bytes::u64leFromBytes(rec + OffStartOrCounter);
+		ret.counter = 0;
+	}
+
+	return ret;
+}
+
+void SecretsFile::loadInto(CredentialStore * store) const
+{
+	for (size_t i = 0; i < m_recordCount; ++i)
+	{
+		store->add(accountId(i), key(i), params(i));
+	}
+}
+
+static bool entryIdLess(const SecretsFileEntry & left, const SecretsFileEntry & right)
+{
+	return left.accountId < right.accountId;
+}
+
+/** Writes all of the buffer, retrying on partial writes. */
+static bool writeAll(int fd, const uint8_t * data, size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t written = ::write(fd, data, size);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return false;
+		}
+		data += written;
+		size -= static_cast<size_t>(written);
+	}
+	return true;
+}
+
+void SecretsFile::write(const std::string & path, std::vector<SecretsFileEntry> * entries)
+{
+	std::sort(entries->begin(), entries->end(), entryIdLess);
+	for (size_t i = 1; i < entries->size(); ++i)
+	{
+		if ((*entries)[i-1].accountId == (*entries)[i].accountId)
+		{
+			throw std::invalid_argument("duplicate account ID in secrets");
+		}
+	}
+
+	const std::string tempPath = path + ".tmp";
+	int fd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1)
+	{
+		throw fileError("cannot create secrets file", tempPath);
+	}
+
+	uint8_t header[HeaderSize] = {};
+	uint8_t rec[RecordSize];
+	Sha1Context checksum;
+	bool ok = true;
+
+	// reserve the header; it is rewritten once the checksum is known
+	ok = writeAll(fd, header, sizeof(header));
+
+	for (size_t i = 0; ok && i < entries->size(); ++i)
+	{
+		const SecretsFileEntry & entry = (*entries)[i];
+		std::memset(rec, 0, sizeof(rec));
+
+		Bytes::u64leToBytes(entry.accountId, rec + OffAccountId);
+		for (size_t j = 0; j < 5; ++j)
+		{
+			Bytes::u32leToBytes(entry.key.innerState()[j], rec + OffInner + 4*j);
+			Bytes::u32leToBytes(entry.key.outerState()[j], rec + OffOuter + 4*j);
+		}
+		Bytes::u64leToBytes((entry.params.kind == OtpKind::Hotp) ? entry.params.counter : entry.params.timeStart, rec + OffStartOrCounter);
+		Bytes::u32leToBytes(entry.params.timeStep, rec + OffTimeStep);
+		rec[OffKind] = static_cast<uint8_t>(entry.params.kind);
+		rec[OffDigits] = entry.params.digits;
+
+		checksum.update(rec, sizeof(rec));
+		ok = writeAll(fd, rec, sizeof(rec));
+	}
+	Bytes::clearBytes(rec, sizeof(rec));
+
+	Sha1Digest digest;
+	checksum.finish(&digest);
+
+	std::memcpy(header, FileMagic, sizeof(FileMagic));
+	Bytes::u32leToBytes(Version, header + OffVersion);
+	Bytes::u32leToBytes(RecordSize, header + OffRecordSize);
+	Bytes::u64leToBytes(entries->size(), header + OffRecordCount);
+	std::memcpy(header + OffChecksum, digest.data(), digest.size());
+
+	ok = ok
+		&& lseek(fd, 0, SEEK_SET) == 0
+		&& writeAll(fd, header, sizeof(header))
+		&& fsync(fd) == 0
+	;
+	if (close(fd) != 0)
+	{
+		ok = false;
+	}
+
+	if (!ok || rename(tempPath.c_str(), path.c_str()) != 0)
+	{
+		std::runtime_error err = fileError("cannot write secrets file", path);
+		unlink(tempPath.c_str());
+		throw err;
+	}
+}
+
+}
+
+#if TEST_SECRETSFILE
+#include "otp.h"
+
+#include <iostream>
+
+int main(void)
+{
+	using namespace CppTotp;
+
+	const Bytes::ByteString key = reinterpret_cast<const uint8_t *>("12345678901234567890");
+	const std::string path = "test_secrets.bin";
+
+	std::vector<SecretsFileEntry> entries;
+	for (uint64_t i = 0; i < 500; ++i)
+	{
+		SecretsFileEntry entry = { (i * 7919) % 1000, HmacSha1Key(key), { OtpKind::Totp, 8, 30, 0, 0 } };
+		if (i % 2 == 1)
+		{
+			entry.params.kind = OtpKind::Hotp;
+			entry.params.digits = 6;
+			entry.params.counter = i;
+		}
+		entries.push_back(entry);
+	}
+	SecretsFile::write(path, &entries);
+
+	SecretsFile file(path);
+	CredentialStore store(file.size());
+	file.loadInto(&store);
+
+	// i = 3 was stored as ID 757
+	size_t index = file.find(757);
+	size_t storeIndex = store.find(757);
+
+	std::cout
+		<< (file.size() == 500)
+		<< (file.find(1001) == SecretsFile::NotFound)
+		<< (index != SecretsFile::NotFound && file.accountId(index) == 757)
+		<< (file.params(index).kind == OtpKind::Hotp)
+		<< (file.params(index).counter == 3)
+		<< (hotp(file.key(index), 9, 6) == 520489)
+		<< store.verifyTotp(store.find(0), 94287082, 59)
+		<< (store.params(storeIndex).counter == file.params(index).counter)
+	<< std::endl;
+
+	unlink(path.c_str());
+	return 0;
+}
+#endif
@@ -0,0 +1,119 @@
+/**
+ * @file secretsfile.h
+ *
+ * @brief Memory-mapped binary file of prepared account secrets.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#ifndef __CPPTOTP_SECRETSFILE_H__
+#define __CPPTOTP_SECRETSFILE_H__
+
+#include "credstore.h"
+#include "sha1.h"
+
+#include <string>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace CppTotp
+{
+
+/**
+ * An account as written into a secrets file.
+ */
+struct SecretsFileEntry
+{
+	uint64_t accountId;
+	HmacSha1Key key;
+	CredentialParams params;
+};
+
+/**
+ * A read-only, memory-mapped secrets file.
+ *
+ * The file consists of a 64-byte header followed by 64-byte records sorted by
+ * account ID; all integers are little-endian. Keys are stored as their HMAC
+ * pad midstates, so nothing needs to be decoded or hashed when loading:
+ *
+ * - header: magic "CPOTPSEC", version (u32), record size (u32), record count
+ *   (u64), SHA-1 of all records (20 bytes), zero padding
+ * - record: account ID (u64), inner midstate (5 x u32), outer midstate
+ *   (5 x u32), start time for TOTP or initial counter for HOTP (u64), time
+ *   step (u32), kind (u8), digits (u8), zero padding (2 bytes)
+ *
+ * Lookups binary-search the mapping, so only the touched pages are read.
+ */
+class SecretsFile
+{
+private:
+	const uint8_t * m_map;
+	size_t m_mapSize;
+	const uint8_t * m_records;
+	size_t m_recordCount;
+
+	const uint8_t * record(size_t index) const;
+
+public:
+	/** The current version of the file format. */
+	static const uint32_t Version = 1;
+
+	/** The size of the header and of each record, in bytes. */
+	static const size_t HeaderSize = 64;
+	static const size_t RecordSize = 64;
+
+	/** Returned by find() if the account does not exist. */
+	static const size_t NotFound = static_cast<size_t>(-1);
+
+	/**
+	 * Maps the given file.
+	 *
+	 * Verifying the checksum reads the whole file; skip it for the fastest
+	 * startup if the file is trusted.
+	 *
+	 * @throw std::runtime_error if the file cannot be mapped or is malformed.
+	 */
+	explicit SecretsFile(const std::string & path, bool verifyChecksum = true);
+	~SecretsFile();
+
+	SecretsFile(const SecretsFile &) = delete;
+	SecretsFile & operator=(const SecretsFile &) = delete;
+
+	/** The number of accounts. */
+	size_t size() const { return m_recordCount; }
+
+	/** Returns the index of the given account, or NotFound. */
+	size_t find(uint64_t accountId) const;
+
+	/** The ID of the account at the given index. */
+	uint64_t accountId(size_t index) const;
+
+	/** The key of the account at the given index. */
+	HmacSha1Key key(size_t index) const;
+
+	/** The parameters of the account at the given index. */
+	CredentialParams params(size_t index) const;
+
+	/**
+	 * Adds all accounts to the given store.
+	 *
+	 * @see CredentialStore::add
+	 */
+	void loadInto(CredentialStore * store) const;
+
+	/**
+	 * Writes the given accounts into a new secrets file, replacing the given
+	 * path atomically. The entries are sorted in place.
+	 *
+	 * @throw std::invalid_argument on duplicate account IDs.
+	 * @throw std::runtime_error if the file cannot be written.
+	 */
+	static void write(const std::string & path, std::vector<SecretsFileEntry> * entries);
+};
+
+}
+
+#endif
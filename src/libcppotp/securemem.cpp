@@ -0,0 +1,319 @@
+/**
+ * @file securemem.cpp
+ *
+ * @brief Implementation of the secure arena.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#include "securemem.h"
+#include "bytes.h"
+
+#include <new>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace CppTotp
+{
+
+/** The size (and alignment) of a slab. */
+static const size_t SlabSize = 64 * 1024;
+
+/** The chunk size of the smallest size class; each further class doubles it. */
+static const size_t MinChunkSize = 16;
+
+/** The bookkeeping at the start of each slab. */
+struct SecureArena::Slab
+{
+	/** Neighbours in the list of partially used slabs of the size class. */
+	Slab * prev;
+	Slab * next;
+
+	/** Freed chunks, linked through their first bytes. */
+	void * freeList;
+
+	/** The first chunk that has never been handed out. */
+	uint8_t * untouched;
+
+	size_t sizeClass;
+	size_t usedChunks;
+	size_t chunkCount;
+};
+
+static size_t pageSize()
+{
+	static const size_t size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+	return size;
+}
+
+static inline size_t roundUp(size_t size, size_t multiple)
+{
+	return (size + multiple - 1) / multiple * multiple;
+}
+
+static inline size_t sizeClassOf(size_t size)
+{
+	size_t sizeClass = 0;
+	while ((MinChunkSize << sizeClass) < size)
+	{
+		++sizeClass;
+	}
+	return sizeClass;
+}
+
+SecureArena::SecureArena()
+{
+	for (size_t i = 0; i < SizeClassCount; ++i)
+	{
+		m_partial[i] = nullptr;
+	}
+	m_stats.bytesInUse = 0;
+	m_stats.bytesMapped = 0;
+	m_stats.lockFailures = 0;
+}
+
+SecureArena & SecureArena::instance()
+{
+	// never destroyed, as secrets may be freed during static destruction
+	static SecureArena * arena = new SecureArena();
+	return *arena;
+}
+
+void * SecureArena::mapLocked(size_t size, size_t alignment)
+{
+	// over-map to be able to trim to the alignment
+	size_t extra = (alignment > pageSize()) ? alignment : 0;
+	void * mapped = mmap(nullptr, size + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mapped == MAP_FAILED)
+	{
+		throw std::bad_alloc();
+	}
+
+	uint8_t * memory = static_cast<uint8_t *>(mapped);
+	if (extra > 0)
+	{
+		uint8_t * aligned = reinterpret_cast<uint8_t *>(roundUp(reinterpret_cast<uintptr_t>(memory), alignment));
+		if (aligned > memory)
+		{
+			munmap(memory, static_cast<size_t>(aligned - memory));
+		}
+		if (aligned + size < memory + size + extra)
+		{
+			munmap(aligned + size, static_cast<size_t>(memory + size + extra - (aligned + size)));
+		}
+		memory = aligned;
+	}
+
+	if (mlock(memory, size) != 0)
+	{
+		++m_stats.lockFailures;
+	}
+#ifdef MADV_DONTDUMP
+	madvise(memory, size, MADV_DONTDUMP);
+#endif
+
+	m_stats.bytesMapped += size;
+	return memory;
+}
+
+void SecureArena::unmapWiped(void * memory, size_t size)
+{
+	Bytes::clearBytes(static_cast<Bytes::Byte *>(memory), size);
+	munlock(memory, size);
+	munmap(memory, size);
+	m_stats.bytesMapped -= size;
+}
+
+void SecureArena::releaseSlab(Slab * slab)
+{
+	if (slab->prev != nullptr)
+	{
+		slab->prev->next = slab->next;
+	}
+	else
+	{
+		m_partial[slab->sizeClass] = slab->next;
+	}
+	if (slab->next != nullptr)
+	{
+		slab->next->prev = slab->prev;
+	}
+
+	unmapWiped(slab, SlabSize);
+}
+
+void * SecureArena::allocate(size_t size)
+{
+	if (size > MaxChunkSize)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		void * ret = mapLocked(roundUp(size, pageSize()), pageSize());
+		m_stats.bytesInUse += size;
+		return ret;
+	}
+
+	const size_t sizeClass = sizeClassOf(size);
+	const size_t chunkSize = MinChunkSize << sizeClass;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	Slab * slab = m_partial[sizeClass];
+	if (slab == nullptr)
+	{
+		uint8_t * memory = static_cast<uint8_t *>(mapLocked(SlabSize, SlabSize));
+		const size_t headerSize = roundUp(sizeof(Slab), chunkSize);
+
+		slab = new (memory) Slab();
+		slab->prev = nullptr;
+		slab->next = nullptr;
+		slab->freeList = nullptr;
+		slab->untouched = memory + headerSize;
+		slab->sizeClass = sizeClass;
+		slab->usedChunks = 0;
+		slab->chunkCount = (SlabSize - headerSize) / chunkSize;
+		m_partial[sizeClass] = slab;
+	}
+
+	void * ret;
+	if (slab->freeList != nullptr)
+	{
+		ret = slab->freeList;
+		slab->freeList = *static_cast<void **>(ret);
+		*static_cast<void **>(ret) = nullptr;
+	}
+	else
+	{
+		ret = slab->untouched;
+		slab->untouched += chunkSize;
+	}
+
+	// full slabs leave the list; deallocate() finds them by alignment
+	if (++slab->usedChunks == slab->chunkCount)
+	{
+		m_partial[sizeClass] = slab->next;
+		if (slab->next != nullptr)
+		{
+			slab->next->prev = nullptr;
+		}
+		slab->next = nullptr;
+	}
+
+	m_stats.bytesInUse += chunkSize;
+	return ret;
+}
+
+void SecureArena::deallocate(void * memory, size_t size)
+{
+	if (memory == nullptr)
+	{
+		return;
+	}
+
+	if (size > MaxChunkSize)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		unmapWiped(memory, roundUp(size, pageSize()));
+		m_stats.bytesInUse -= size;
+		return;
+	}
+
+	Slab * slab = reinterpret_cast<Slab *>(reinterpret_cast<uintptr_t>(memory) & ~(SlabSize - 1));
+	const size_t chunkSize = MinChunkSize << slab->sizeClass;
+
+	// the chunk still belongs to the caller; wipe it outside the lock
+	Bytes::clearBytes(static_cast<Bytes::Byte *>(memory), chunkSize);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_stats.bytesInUse -= chunkSize;
+
+	const bool wasFull = (slab->usedChunks == slab->chunkCount);
+	*static_cast<void **>(memory) = slab->freeList;
+	slab->freeList = memory;
+	--slab->usedChunks;
+
+	if (wasFull)
+	{
+		// back into the list of slabs with room
+		slab->prev = nullptr;
+		slab->next = m_partial[slab->sizeClass];
+		if (slab->next != nullptr)
+		{
+			slab->next->prev = slab;
+		}
+		m_partial[slab->sizeClass] = slab;
+	}
+
+	// return empty slabs, but keep one per size class around
+	if (slab->usedChunks == 0 && (slab->prev != nullptr || slab->next != nullptr))
+	{
+		releaseSlab(slab);
+	}
+}
+
+SecureArenaStats SecureArena::stats() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_stats;
+}
+
+}
+
+#if TEST_SECUREMEM
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <cstring>
+
+int main(void)
+{
+	using namespace CppTotp;
+
+	SecureArena & arena = SecureArena::instance();
+	std::vector<std::pair<uint8_t *, size_t> > blocks;
+
+	// enough small chunks to fill several slabs, plus a few large ones
+	for (size_t i = 0; i < 5000; ++i)
+	{
+		size_t size = (i % 97 == 0) ? 5000 + i : 1 + (i * 37) % SecureArena::MaxChunkSize;
+		uint8_t * block = static_cast<uint8_t *>(arena.allocate(size));
+		std::memset(block, 0xA5, size);
+		blocks.push_back(std::make_pair(block, size));
+	}
+	SecureArenaStats full = arena.stats();
+
+	bool aligned = true;
+	for (const auto & block : blocks)
+	{
+		aligned = aligned && (reinterpret_cast<uintptr_t>(block.first) % 16 == 0);
+		arena.deallocate(block.first, block.second);
+	}
+	SecureArenaStats empty = arena.stats();
+
+	// freed chunks come back wiped
+	uint8_t * again = static_cast<uint8_t *>(arena.allocate(64));
+	bool wiped = true;
+	for (size_t i = sizeof(void *); i < 64; ++i)
+	{
+		wiped = wiped && again[i] == 0;
+	}
+	arena.deallocate(again, 64);
+
+	typedef std::basic_string<uint8_t, std::char_traits<uint8_t>, SecureAllocator<uint8_t> > SecureString;
+	SecureString secret(100, 0x42);
+	secret += secret;
+
+	std::cout
+		<< (full.bytesInUse > 0) << (full.bytesMapped >= full.bytesInUse)
+		<< aligned
+		<< (empty.bytesInUse == 0) << (empty.bytesMapped <= 8 * 64 * 1024)
+		<< wiped
+		<< (secret.size() == 200 && secret[199] == 0x42)
+		<< (arena.stats().bytesInUse >= 200)
+	<< std::endl;
+
+	return 0;
+}
+#endif
@@ -0,0 +1,127 @@
+/**
+ * @file securemem.h
+ *
+ * @brief Locked, non-dumpable memory for secret material.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#ifndef __CPPTOTP_SECUREMEM_H__
+#define __CPPTOTP_SECUREMEM_H__
+
+#include <mutex>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace CppTotp
+{
+
+/** Usage statistics of the secure arena. */
+struct SecureArenaStats
+{
+	/** Bytes handed out and not yet returned. */
+	size_t bytesInUse;
+
+	/** Bytes mapped from the system, including slab overhead. */
+	size_t bytesMapped;
+
+	/** The number of mappings that could not be locked into memory. */
+	size_t lockFailures;
+};
+
+/**
+ * An allocator of memory that is locked into RAM (so it is never swapped out)
+ * and excluded from core dumps.
+ *
+ * Small allocations are carved out of 64 KiB slabs holding chunks of one size
+ * class each; larger ones get a mapping of their own. Freed chunks are wiped
+ * with explicit_bzero, and a slab is wiped as a whole before being returned
+ * to the system. If the memory cannot be locked (e.g. because of
+ * RLIMIT_MEMLOCK), it is used anyway and the failure is counted.
+ *
+ * All functions are thread-safe.
+ */
+class SecureArena
+{
+private:
+	struct Slab;
+
+	static const size_t SizeClassCount = 8;
+
+	/** Slabs with at least one free chunk, per size class. */
+	Slab * m_partial[SizeClassCount];
+
+	SecureArenaStats m_stats;
+	mutable std::mutex m_mutex;
+
+	SecureArena();
+
+	void * mapLocked(size_t size, size_t alignment);
+	void unmapWiped(void * memory, size_t size);
+	void releaseSlab(Slab * slab);
+
+public:
+	/** The largest allocation served from a slab. */
+	static const size_t MaxChunkSize = 2048;
+
+	/** The process-wide arena. */
+	static SecureArena & instance();
+
+	SecureArena(const SecureArena &) = delete;
+	SecureArena & operator=(const SecureArena &) = delete;
+
+	/**
+	 * Allocates the given number of bytes, aligned to at least 16 bytes (or to
+	 * the page size for allocations larger than MaxChunkSize).
+	 *
+	 * @throw std::bad_alloc if no memory can be mapped.
+	 */
+	void * allocate(size_t size);
+
+	/** Wipes and frees memory returned by allocate() with the same size. */
+	void deallocate(void * memory, size_t size);
+
+	/** Returns the current usage. */
+	SecureArenaStats stats() const;
+};
+
+/** A standard allocator drawing from the secure arena. */
+template <typename T>
+class SecureAllocator
+{
+public:
+	typedef T value_type;
+
+	SecureAllocator() {}
+
+	template <typename U>
+	SecureAllocator(const SecureAllocator<U> &) {}
+
+	T * allocate(size_t count)
+	{
+		return static_cast<T *>(SecureArena::instance().allocate(count * sizeof(T)));
+	}
+
+	void deallocate(T * memory, size_t count)
+	{
+		SecureArena::instance().deallocate(memory, count * sizeof(T));
+	}
+};
+
+template <typename T, typename U>
+inline bool operator==(const SecureAllocator<T> &, const SecureAllocator<U> &)
+{
+	return true;
+}
+
+template <typename T, typename U>
+inline bool operator!=(const SecureAllocator<T> &, const SecureAllocator<U> &)
+{
+	return false;
+}
+
+}
+
+#endif
@@ -7,189 +7,365 @@
  * see the file COPYING for more details.
  */
 
-#include "bytes.h"
+#include "sha1.h"
+#include "keycache.h"
+#include "metrics.h"
+#include "sha1backend.h"
 
 #include <iostream>
 
 #include <cassert>
+#include <cstring>
 
 namespace CppTotp
 {
 
-static inline uint32_t lrot32(uint32_t num, uint8_t rotcount)
+Sha1Context::Sha1Context()
 {
-	return (num << rotcount) | (num >> (32 - rotcount));
+	reset();
 }
 
-Bytes::ByteString sha1(const Bytes::ByteString & msg)
+Sha1Context::Sha1Context(const uint32_t state[5], uint64_t processedBytes)
+	: m_blockFill(0), m_totalBytes(processedBytes)
+{
+	assert(processedBytes % Sha1BlockSize == 0);
+	std::memcpy(m_state, state, sizeof(m_state));
+}
+
+Sha1Context::~Sha1Context()
+{
+	Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(m_state), sizeof(m_state));
+	Bytes::clearBytes(m_block, sizeof(m_block));
+}
+
+void Sha1Context::reset()
+{
+	// initialize the hash counters
+	m_state[0] = 0x67452301;
+	m_state[1] = 0xEFCDAB89;
+	m_state[2] = 0x98BADCFE;
+	m_state[3] = 0x10325476;
+	m_state[4] = 0xC3D2E1F0;
+
+	m_blockFill = 0;
+	m_totalBytes = 0;
+}
+
+/** Compresses blocks with the current backend. */
+static inline void compressBlocks(uint32_t state[5], const Bytes::Byte * blocks, size_t blockCount)
+{
+	CPPTOTP_METRIC_ADD(Sha1Blocks, blockCount);
+	sha1Backend().compress(state, blocks, blockCount);
+}
+
+void Sha1Context::update(const Bytes::Byte * data, size_t size)
+{
+	m_totalBytes += size;
+
+	// top up a partially filled block first
+	if (m_blockFill > 0)
+	{
+		size_t take = Sha1BlockSize - m_blockFill;
+		if (take > size)
+		{
+			take = size;
+		}
+
+		std::memcpy(m_block + m_blockFill, data, take);
+		m_blockFill += take;
+		data += take;
+		size -= take;
+
+		if (m_blockFill < Sha1BlockSize)
+		{
+			return;
+		}
+
+		compressBlocks(m_state, m_block, 1);
+		m_blockFill = 0;
+	}
+
+	// compress full blocks straight from the input
+	size_t fullBlocks = size / Sha1BlockSize;
+	if (fullBlocks > 0)
+	{
+		compressBlocks(m_state, data, fullBlocks);
+		data += fullBlocks * Sha1BlockSize;
+		size -= fullBlocks * Sha1BlockSize;
+	}
+
+	// keep the rest for later
+	if (size > 0)
+	{
+		std::memcpy(m_block, data, size);
+		m_blockFill = size;
+	}
+}
+
+void Sha1Context::update(const Sha1Chunk * chunks, size_t chunkCount)
 {
-	const size_t size_bytes = msg.size();
-	const uint64_t size_bits = size_bytes * 8;
-	Bytes::ByteString bstr = msg;
-	Bytes::ByteStringDestructor asplode(&bstr);
+	for (size_t i = 0; i < chunkCount; ++i)
+	{
+		update(chunks[i].data, chunks[i].size);
+	}
+}
+
+void Sha1Context::update(const Bytes::ByteString & bstr)
+{
+	update(bstr.data(), bstr.size());
+}
+
+void Sha1Context::finish(Bytes::Byte digest[Sha1DigestSize])
+{
+	const uint64_t size_bits = m_totalBytes * 8;
 
 	// the size of msg in bits is always even. adding the '1' bit will make
 	// it odd and therefore incongruent to 448 modulo 512, so we can get
 	// away with tacking on 0x80 and then the 0x00s.
-	bstr.push_back(0x80);
-	while (bstr.size() % (512/8) != (448/8))
+	m_block[m_blockFill++] = 0x80;
+	if (m_blockFill > (448/8))
 	{
-		bstr.push_back(0x00);
+		// no space for the length; spill into another block
+		std::memset(m_block + m_blockFill, 0x00, Sha1BlockSize - m_blockFill);
+		compressBlocks(m_state, m_block, 1);
+		m_blockFill = 0;
 	}
+	std::memset(m_block + m_blockFill, 0x00, (448/8) - m_blockFill);
 
 	// append the size in bits (uint64be)
-	bstr.append(Bytes::u64beToByteString(size_bits));
-
-	assert(bstr.size() % (512/8) == 0);
+	for (size_t i = 0; i < 8; ++i)
+	{
+		m_block[(448/8) + i] = static_cast<Bytes::Byte>((size_bits >> ((7-i)*8)) & 0xFF);
+	}
+	compressBlocks(m_state, m_block, 1);
 
-	// initialize the hash counters
-	uint32_t h0 = 0x67452301;
-	uint32_t h1 = 0xEFCDAB89;
-	uint32_t h2 = 0x98BADCFE;
-	uint32_t h3 = 0x10325476;
-	uint32_t h4 = 0xC3D2E1F0;
-
-	// for each 64-byte chunk
-	for (size_t i = 0; i < bstr.size()/64; ++i)
+	// assemble the digest
+	for (size_t i = 0; i < 5; ++i)
 	{
-		Bytes::ByteString chunk(bstr.begin() + i*64, bstr.begin() + (i+1)*64);
-		Bytes::ByteStringDestructor xplode(&chunk);
+		digest[4*i + 0] = static_cast<Bytes::Byte>((m_state[i] >> 24) & 0xFF);
+		digest[4*i + 1] = static_cast<Bytes::Byte>((m_state[i] >> 16) & 0xFF);
+		digest[4*i + 2] = static_cast<Bytes::Byte>((m_state[i] >>  8) & 0xFF);
+		digest[4*i + 3] = static_cast<Bytes::Byte>((m_state[i] >>  0) & 0xFF);
+	}
 
-		uint32_t words[80];
-		size_t j;
+	Bytes::clearBytes(m_block, sizeof(m_block));
+	reset();
+}
 
-		// 0-15: the chunk as a sequence of 32-bit big-endian integers
-		for (j = 0; j < 16; ++j)
-		{
-			words[j] =
-				(chunk[4*j + 0] << 24) |
-				(chunk[4*j + 1] << 16) |
-				(chunk[4*j + 2] <<  8) |
-				(chunk[4*j + 3] <<  0)
-			;
-		}
+void Sha1Context::midstate(uint32_t state[5]) const
+{
+	assert(m_blockFill == 0);
+	std::memcpy(state, m_state, sizeof(m_state));
+}
 
-		// 16-79: derivatives of 0-15
-		for (j = 16; j < 32; ++j)
+void sha1(const Bytes::Byte * msg, size_t size, Sha1Digest * digest)
+{
+	Sha1Context ctx;
+	ctx.update(msg, size);
+	ctx.finish(digest);
+}
+
+Bytes::ByteString sha1(const Bytes::ByteString & msg)
+{
+	Sha1Digest digest;
+	sha1(msg.data(), msg.size(), &digest);
+
+	Bytes::ByteString ret(digest.data(), digest.size());
+	Bytes::clearBytes(digest.data(), digest.size());
+	return ret;
+}
+
+/**
+ * Feeds the key, padded with zeroes to blockSize and XORed with the given pad
+ * byte, into the context.
+ */
+static void feedPadKey(Sha1Context * ctx, const Bytes::Byte * key, size_t keySize, size_t blockSize, Bytes::Byte pad)
+{
+	Bytes::Byte buf[Sha1BlockSize];
+
+	for (size_t done = 0; done < blockSize; )
+	{
+		size_t take = blockSize - done;
+		if (take > sizeof(buf))
 		{
-			// unoptimized
-			words[j] = lrot32(words[j-3] ^ words[j-8] ^ words[j-14] ^ words[j-16], 1);
+			take = sizeof(buf);
 		}
-		for (j = 32; j < 80; ++j)
+
+		for (size_t i = 0; i < take; ++i)
 		{
-			// Max Locktyuchin's optimization (SIMD)
-			words[j] = lrot32(words[j-6] ^ words[j-16] ^ words[j-28] ^ words[j-32], 2);
+			Bytes::Byte k = (done + i < keySize) ? key[done + i] : 0x00;
+			buf[i] = k ^ pad;
 		}
 
-		// initialize hash values for the round
-		uint32_t a = h0;
-		uint32_t b = h1;
-		uint32_t c = h2;
-		uint32_t d = h3;
-		uint32_t e = h4;
+		ctx->update(buf, take);
+		done += take;
+	}
+
+	Bytes::clearBytes(buf, sizeof(buf));
+}
+
+/** Calculates an HMAC from the midstates after the inner and outer pad blocks. */
+static void macFromStates(const uint32_t innerState[5], const uint32_t outerState[5], const Bytes::Byte * msg, size_t size, Bytes::Byte digest[Sha1DigestSize])
+{
+	Sha1Digest innerHash;
+
+	// sha1(outerPadKey + sha1(innerPadKey + msg)), skipping the pad blocks
+	Sha1Context inner(innerState, Sha1BlockSize);
+	inner.update(msg, size);
+	inner.finish(&innerHash);
+
+	Sha1Context outer(outerState, Sha1BlockSize);
+	outer.update(innerHash.data(), innerHash.size());
+	outer.finish(digest);
 
-		// the loop
-		for (j = 0; j < 80; ++j)
+	Bytes::clearBytes(innerHash.data(), innerHash.size());
+}
+
+void hmacSha1(const Bytes::Byte * key, size_t keySize, const Bytes::Byte * msg, size_t msgSize, Sha1Digest * digest, size_t blockSize)
+{
+	// the cache lookup (and key preparation on a miss) is part of the call
+	CPPTOTP_METRIC_ADD(HmacCalls, 1);
+	CPPTOTP_METRIC_TIMER(Hmac);
+
+	if (blockSize == Sha1BlockSize)
+	{
+		const HmacSha1Key * cached = cachedHmacSha1Key(key, keySize);
+		if (cached != nullptr)
 		{
-			uint32_t f = 0, k = 0;
-
-			if (j < 20)
-			{
-				f = (b & c) | ((~ b) & d);
-				k = 0x5A827999;
-			}
-			else if (j < 40)
-			{
-				f = b ^ c ^ d;
-				k = 0x6ED9EBA1;
-			}
-			else if (j < 60)
-			{
-				f = (b & c) | (b & d) | (c & d);
-				k = 0x8F1BBCDC;
-			}
-			else if (j < 80)
-			{
-				f = b ^ c ^ d;
-				k = 0xCA62C1D6;
-			}
-			else
-			{
-				assert(0 && "how did I get here?");
-			}
-
-			uint32_t tmp = lrot32(a, 5) + f + e + k + words[j];
-			e = d;
-			d = c;
-			c = lrot32(b, 30);
-			b = a;
-			a = tmp;
+			macFromStates(cached->innerState(), cached->outerState(), msg, msgSize, digest->data());
+			return;
 		}
+	}
+
+	Sha1Context ctx;
+	Sha1Digest hashedKey;
+	Sha1Digest innerHash;
 
-		// add that to the result so far
-		h0 += a;
-		h1 += b;
-		h2 += c;
-		h3 += d;
-		h4 += e;
+	if (keySize > blockSize)
+	{
+		// resize by calculating hash
+		ctx.update(key, keySize);
+		ctx.finish(&hashedKey);
+		key = hashedKey.data();
+		keySize = hashedKey.size();
 	}
 
-	// assemble the digest
-	Bytes::ByteString first  = Bytes::u32beToByteString(h0);
-	Bytes::ByteStringDestructor x1(&first);
-	Bytes::ByteString second = Bytes::u32beToByteString(h1);
-	Bytes::ByteStringDestructor x2(&second);
-	Bytes::ByteString third  = Bytes::u32beToByteString(h2);
-	Bytes::ByteStringDestructor x3(&third);
-	Bytes::ByteString fourth = Bytes::u32beToByteString(h3);
-	Bytes::ByteStringDestructor x4(&fourth);
-	Bytes::ByteString fifth  = Bytes::u32beToByteString(h4);
-	Bytes::ByteStringDestructor x5(&fifth);
+	// sha1(outerPadKey + sha1(innerPadKey + msg))
+	feedPadKey(&ctx, key, keySize, blockSize, 0x36);
+	ctx.update(msg, msgSize);
+	ctx.finish(&innerHash);
 
-	return first + second + third + fourth + fifth;
-}
+	feedPadKey(&ctx, key, keySize, blockSize, 0x5c);
+	ctx.update(innerHash.data(), innerHash.size());
+	ctx.finish(digest);
 
-Bytes::ByteString hmacSha1(const Bytes::ByteString & key, const Bytes::ByteString & msg, size_t blockSize = 64);
+	Bytes::clearBytes(hashedKey.data(), hashedKey.size());
+	Bytes::clearBytes(innerHash.data(), innerHash.size());
+}
 
 Bytes::ByteString hmacSha1(const Bytes::ByteString & key, const Bytes::ByteString & msg, size_t blockSize)
 {
-	Bytes::ByteString realKey = key;
-	Bytes::ByteStringDestructor asplode(&realKey);
+	Sha1Digest digest;
+	hmacSha1(key.data(), key.size(), msg.data(), msg.size(), &digest, blockSize);
+
+	Bytes::ByteString ret(digest.data(), digest.size());
+	Bytes::clearBytes(digest.data(), digest.size());
+	return ret;
+}
+
+HmacSha1Key::HmacSha1Key()
+	: HmacSha1Key(static_cast<const Bytes::Byte *>(nullptr), 0)
+{
+}
+
+HmacSha1Key::HmacSha1Key(const Bytes::ByteString & key)
+	: HmacSha1Key(key.data(), key.size())
+{
+}
 
-	if (realKey.size() > blockSize)
+HmacSha1Key::HmacSha1Key(const Bytes::Byte * key, size_t keySize)
+{
+	CPPTOTP_METRIC_ADD(KeySetups, 1);
+	CPPTOTP_METRIC_TIMER(KeySetup);
+
+	Sha1Context ctx;
+	Sha1Digest hashedKey;
+
+	if (keySize > Sha1BlockSize)
 	{
 		// resize by calculating hash
-		Bytes::ByteString newRealKey = sha1(realKey);
-		Bytes::swizzleByteStrings(&realKey, &newRealKey);
-	}
-	if (realKey.size() < blockSize)
-	{
-		// pad with zeroes
-		realKey.resize(blockSize, 0x00);
+		ctx.update(key, keySize);
+		ctx.finish(&hashedKey);
+		key = hashedKey.data();
+		keySize = hashedKey.size();
 	}
 
-	// prepare the pad keys
-	Bytes::ByteString innerPadKey = realKey;
-	Bytes::ByteStringDestructor xplodeI(&innerPadKey);
-	Bytes::ByteString outerPadKey = realKey;
-	Bytes::ByteStringDestructor xplodeO(&outerPadKey);
+	feedPadKey(&ctx, key, keySize, Sha1BlockSize, 0x36);
+	ctx.midstate(m_innerState);
+	ctx.reset();
 
-	// transform the pad keys
-	for (size_t i = 0; i < realKey.size(); ++i)
-	{
-		innerPadKey[i] = innerPadKey[i] ^ 0x36;
-		outerPadKey[i] = outerPadKey[i] ^ 0x5c;
-	}
+	feedPadKey(&ctx, key, keySize, Sha1BlockSize, 0x5c);
+	ctx.midstate(m_outerState);
 
-	// sha1(outerPadKey + sha1(innerPadKey + msg))
-	Bytes::ByteString innerMsg  = innerPadKey + msg;
-	Bytes::ByteStringDestructor xplodeIM(&innerMsg);
-	Bytes::ByteString innerHash = sha1(innerMsg);
-	Bytes::ByteStringDestructor xplodeIH(&innerHash);
-	Bytes::ByteString outerMsg  = outerPadKey + innerHash;
-	Bytes::ByteStringDestructor xplodeOM(&outerMsg);
+	Bytes::clearBytes(hashedKey.data(), hashedKey.size());
+}
 
-	return sha1(outerMsg);
+HmacSha1Key::HmacSha1Key(const uint32_t innerState[5], const uint32_t outerState[5])
+{
+	std::memcpy(m_innerState, innerState, sizeof(m_innerState));
+	std::memcpy(m_outerState, outerState, sizeof(m_outerState));
+}
+
+HmacSha1Key::HmacSha1Key(const HmacSha1Key & other)
+{
+	std::memcpy(m_innerState, other.m_innerState, sizeof(m_innerState));
+	std::memcpy(m_outerState, other.m_outerState, sizeof(m_outerState));
+}
+
+HmacSha1Key & HmacSha1Key::operator=(const HmacSha1Key & other)
+{
+	std::memmove(m_innerState, other.m_innerState, sizeof(m_innerState));
+	std::memmove(m_outerState, other.m_outerState, sizeof(m_outerState));
+	return *this;
+}
+
+HmacSha1Key::~HmacSha1Key()
+{
+	Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(m_innerState), sizeof(m_innerState));
+	Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(m_outerState), sizeof(m_outerState));
+}
+
+void HmacSha1Key::mac(const Bytes::Byte * msg, size_t size, Bytes::Byte digest[Sha1DigestSize]) const
+{
+	CPPTOTP_METRIC_ADD(HmacCalls, 1);
+	CPPTOTP_METRIC_TIMER(Hmac);
+
+	macFromStates(m_innerState, m_outerState, msg, size, digest);
+}
+
+Bytes::ByteString HmacSha1Key::mac(const Bytes::ByteString & msg) const
+{
+	Sha1Digest digest;
+	mac(msg.data(), msg.size(), &digest);
+
+	Bytes::ByteString ret(digest.data(), digest.size());
+	Bytes::clearBytes(digest.data(), digest.size());
+	return ret;
+}
+
+void HmacSha1Key::macCounter(uint64_t counter, Bytes::Byte digest[Sha1DigestSize]) const
+{
+	CPPTOTP_METRIC_ADD(HmacCalls, 1);
+	CPPTOTP_METRIC_ADD(Sha1Blocks, 2);
+	CPPTOTP_METRIC_TIMER(Hmac);
+
+	uint32_t words[5];
+	sha1Backend().counterMac(m_innerState, m_outerState, counter, words);
+	for (size_t i = 0; i < 5; ++i)
+	{
+		Bytes::u32beToBytes(words[i], &digest[4*i]);
+	}
+	Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(words), sizeof(words));
 }
 
 }
@@ -198,26 +374,74 @@ Bytes::ByteString hmacSha1(const Bytes::ByteString & key, const Bytes::ByteStrin
 int main(void)
 {
 	using namespace CppTotp;
-	const uint8_t * strEmpty = reinterpret_cast<const uint8_t *>("");
-	const uint8_t * strDog   = reinterpret_cast<const uint8_t *>("The quick brown fox jumps over the lazy dog");
-	const uint8_t * strCog   = reinterpret_cast<const uint8_t *>("The quick brown fox jumps over the lazy cog");
-	const uint8_t * strKey   = reinterpret_cast<const uint8_t *>("key");
-
-	Bytes::ByteString shaEmpty = sha1(Bytes::ByteString(strEmpty));
-	Bytes::ByteString shaDog   = sha1(Bytes::ByteString(strDog));
-	Bytes::ByteString shaCog   = sha1(Bytes::ByteString(strCog));
-
-	Bytes::ByteString hmacShaEmpty  = hmacSha1(Bytes::ByteString(), Bytes::ByteString());
-	Bytes::ByteString hmacShaKeyDog = hmacSha1(strKey, strDog);
-
-	std::cout
-		<< (Bytes::toHexString(shaEmpty) == "da39a3ee5e6b4b0d3255bfef95601890afd80709") << std::endl
-		<< (Bytes::toHexString(shaDog)   == "2fd4e1c67a2d28fced849ee1bb76e7391b93eb12") << std::endl
-		<< (Bytes::toHexString(shaCog)   == "de9f2c7fd25e1b3afad3e85a0bd17d9b100db4b3") << std::endl
-		<< std::endl
-		<< (Bytes::toHexString(hmacShaEmpty)  == "fbdb1d1b18aa6c08324b7d64b71fb76370690e1d") << std::endl
-		<< (Bytes::toHexString(hmacShaKeyDog) == "de7c9b85b8b78aa6bc8a7a36f70a90701c9db4d9") << std::endl
-	<< std::endl;
+
+	size_t backendCount;
+	const Sha1Backend * backends = sha1Backends(&backendCount);
+
+	for (size_t i = 0; i < backendCount; ++i)
+	{
+		if (!selectSha1Backend(backends[i].name))
+		{
+			std::cout << backends[i].name << ": unsupported" << std::endl << std::endl;
+			continue;
+		}
+		std::cout << backends[i].name << ":" << std::endl;
+
+		const uint8_t * strEmpty = reinterpret_cast<const uint8_t *>("");
+		const uint8_t * strDog   = reinterpret_cast<const uint8_t *>("The quick brown fox jumps over the lazy dog");
+		const uint8_t * strCog   = reinterpret_cast<const uint8_t *>("The quick brown fox jumps over the lazy cog");
+		const uint8_t * strKey   = reinterpret_cast<const uint8_t *>("key");
+
+		Bytes::ByteString shaEmpty = sha1(Bytes::ByteString(strEmpty));
+		Bytes::ByteString shaDog   = sha1(Bytes::ByteString(strDog));
+		Bytes::ByteString shaCog   = sha1(Bytes::ByteString(strCog));
+
+		Bytes::ByteString hmacShaEmpty  = hmacSha1(Bytes::ByteString(), Bytes::ByteString());
+		Bytes::ByteString hmacShaKeyDog = hmacSha1(strKey, strDog);
+
+		// a million 'a's, fed in uneven pieces
+		Sha1Context ctx;
+		Bytes::ByteString as(1000, 'a');
+		Bytes::Byte digestAs[Sha1DigestSize];
+		for (size_t j = 0; j < 1000; ++j)
+		{
+			Sha1Chunk chunks[3] = {
+				{ as.data(), 1 },
+				{ as.data(), 0 },
+				{ as.data(), 999 },
+			};
+			ctx.update(chunks, 3);
+		}
+		ctx.finish(digestAs);
+		Bytes::ByteString shaAs(digestAs, Sha1DigestSize);
+
+		// the counter kernel against the general HMAC
+		bool counterMacAgrees = true;
+		const HmacSha1Key dogKey(strDog, 43);
+		const uint64_t counters[] = { 0, 1, 0xFFFFFFFFu, 0x0123456789ABCDEFull, ~0ull };
+		for (uint64_t counter : counters)
+		{
+			Bytes::Byte message[8];
+			Sha1Digest expected;
+			Sha1Digest actual;
+			Bytes::u64beToBytes(counter, message);
+			dogKey.mac(message, sizeof(message), &expected);
+			dogKey.macCounter(counter, actual.data());
+			counterMacAgrees = counterMacAgrees && (expected == actual);
+		}
+
+		std::cout
+			<< (Bytes::toHexString(shaEmpty) == "da39a3ee5e6b4b0d3255bfef95601890afd80709") << std::endl
+			<< (Bytes::toHexString(shaDog)   == "2fd4e1c67a2d28fced849ee1bb76e7391b93eb12") << std::endl
+			<< (Bytes::toHexString(shaCog)   == "de9f2c7fd25e1b3afad3e85a0bd17d9b100db4b3") << std::endl
+			<< (Bytes::toHexString(shaAs)    == "34aa973cd4c4daa4f61eeb2bdbad27316534016f") << std::endl
+			<< std::endl
+			<< (Bytes::toHexString(hmacShaEmpty)  == "fbdb1d1b18aa6c08324b7d64b71fb76370690e1d") << std::endl
+			<< (Bytes::toHexString(hmacShaKeyDog) == "de7c9b85b8b78aa6bc8a7a36f70a90701c9db4d9") << std::endl
+			<< (HmacSha1Key(strKey).mac(strDog) == hmacShaKeyDog) << std::endl
+			<< counterMacAgrees << std::endl
+		<< std::endl;
+	}
 
 	return 0;
 }
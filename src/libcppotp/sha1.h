@@ -12,16 +12,115 @@
 
 #include "bytes.h"
 
+#include <array>
+
+#include <cstddef>
+#include <cstdint>
+
 namespace CppTotp
 {
 
 typedef Bytes::ByteString (*HmacFunc)(const Bytes::ByteString &, const Bytes::ByteString &);
 
+/** The largest digest an HmacIntoFunc is asked to produce. */
+const size_t HmacMaxDigestSize = 64;
+
+/**
+ * An HMAC function that writes the digest into a caller-provided buffer
+ * (whose capacity is passed) and returns the length of the digest.
+ */
+typedef size_t (*HmacIntoFunc)(const Bytes::Byte * key, size_t keySize, const Bytes::Byte * msg, size_t msgSize, Bytes::Byte * digest, size_t digestCapacity);
+
+/** The size of a SHA-1 digest, in bytes. */
+const size_t Sha1DigestSize = 20;
+
+/** The size of a SHA-1 message block, in bytes. */
+const size_t Sha1BlockSize = 64;
+
+/** A SHA-1 digest. */
+typedef std::array<Bytes::Byte, Sha1DigestSize> Sha1Digest;
+
+/** A piece of a message that is scattered across multiple buffers. */
+struct Sha1Chunk
+{
+	/** The start of the piece. */
+	const Bytes::Byte * data;
+
+	/** The length of the piece, in bytes. */
+	size_t size;
+};
+
+/**
+ * Incremental SHA-1 calculation.
+ *
+ * The context has a fixed size and never allocates; the message is fed to it
+ * in pieces of arbitrary length and only ever buffered up to one block.
+ */
+class Sha1Context
+{
+private:
+	/** The hash state (h0 to h4). */
+	uint32_t m_state[5];
+
+	/** The block currently being filled. */
+	Bytes::Byte m_block[Sha1BlockSize];
+
+	/** The number of bytes in m_block. */
+	size_t m_blockFill;
+
+	/** The number of bytes processed so far. */
+	uint64_t m_totalBytes;
+
+public:
+	Sha1Context();
+
+	/**
+	 * Resumes a calculation from a midstate that was taken after the given
+	 * number of bytes (which must be a multiple of the block size).
+	 */
+	Sha1Context(const uint32_t state[5], uint64_t processedBytes);
+
+	~Sha1Context();
+
+	/** Returns the context to the state before any data was processed. */
+	void reset();
+
+	/** Feeds the given bytes into the hash. */
+	void update(const Bytes::Byte * data, size_t size);
+
+	/** Feeds the given scattered pieces, in order, into the hash. */
+	void update(const Sha1Chunk * chunks, size_t chunkCount);
+
+	/** Feeds the given byte string into the hash. */
+	void update(const Bytes::ByteString & bstr);
+
+	/**
+	 * Pads the message, stores the digest in the given buffer and returns the
+	 * context to its initial state.
+	 */
+	void finish(Bytes::Byte digest[Sha1DigestSize]);
+
+	/** @see finish(Bytes::Byte *) */
+	void finish(Sha1Digest * digest) { finish(digest->data()); }
+
+	/**
+	 * Stores the current hash state in the given buffer.
+	 *
+	 * @note Only valid if a multiple of the block size has been processed.
+	 */
+	void midstate(uint32_t state[5]) const;
+};
+
 /**
  * Calculate the SHA-1 hash of the given message.
  */
 Bytes::ByteString sha1(const Bytes::ByteString & msg);
 
+/**
+ * Calculate the SHA-1 hash of the given message into the given digest.
+ */
+void sha1(const Bytes::Byte * msg, size_t size, Sha1Digest * digest);
+
 /**
  * Calculate the HMAC-SHA-1 hash of the given key/message pair.
  *
@@ -29,6 +128,70 @@ Bytes::ByteString sha1(const Bytes::ByteString & msg);
  */
 Bytes::ByteString hmacSha1(const Bytes::ByteString & key, const Bytes::ByteString & msg, size_t blockSize = 64);
 
+/**
+ * Calculate the HMAC-SHA-1 hash of the given key/message pair into the given
+ * digest.
+ *
+ * @note Most services assume a block size of 64.
+ */
+void hmacSha1(const Bytes::Byte * key, size_t keySize, const Bytes::Byte * msg, size_t msgSize, Sha1Digest * digest, size_t blockSize = 64);
+
+/**
+ * An HMAC-SHA-1 key (with a block size of 64) that has been prepared for
+ * repeated use.
+ *
+ * Only the hash states after the inner and outer pad blocks are kept; each
+ * HMAC calculation then starts from them instead of reprocessing the key.
+ */
+class HmacSha1Key
+{
+private:
+	/** The hash state after processing the inner pad block. */
+	uint32_t m_innerState[5];
+
+	/** The hash state after processing the outer pad block. */
+	uint32_t m_outerState[5];
+
+public:
+	/** Prepares the empty key. */
+	HmacSha1Key();
+
+	/** Prepares the given key. */
+	explicit HmacSha1Key(const Bytes::ByteString & key);
+
+	/** Prepares the given key. */
+	HmacSha1Key(const Bytes::Byte * key, size_t keySize);
+
+	/** Restores a key from previously obtained inner and outer states. */
+	HmacSha1Key(const uint32_t innerState[5], const uint32_t outerState[5]);
+
+	HmacSha1Key(const HmacSha1Key & other);
+	HmacSha1Key & operator=(const HmacSha1Key & other);
+	~HmacSha1Key();
+
+	/** The hash state after processing the inner pad block. */
+	const uint32_t * innerState() const { return m_innerState; }
+
+	/** The hash state after processing the outer pad block. */
+	const uint32_t * outerState() const { return m_outerState; }
+
+	/** Calculates the HMAC of the given message into the given buffer. */
+	void mac(const Bytes::Byte * msg, size_t size, Bytes::Byte digest[Sha1DigestSize]) const;
+
+	/** Calculates the HMAC of the given message into the given digest. */
+	void mac(const Bytes::Byte * msg, size_t size, Sha1Digest * digest) const { mac(msg, size, digest->data()); }
+
+	/** Calculates the HMAC of the given message. */
+	Bytes::ByteString mac(const Bytes::ByteString & msg) const;
+
+	/**
+	 * Calculates the HMAC of the given counter as an 8-byte big-endian message
+	 * (the HOTP input) into the given buffer, using the backend's kernel for
+	 * that fixed message layout.
+	 */
+	void macCounter(uint64_t counter, Bytes::Byte digest[Sha1DigestSize]) const;
+};
+
 }
 
 #endif
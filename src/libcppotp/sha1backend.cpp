@@ -0,0 +1,509 @@
+/**
+ * @file sha1backend.cpp
+ *
+ * @brief The SHA-1 block compression implementations and their selection.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#include "sha1backend.h"
+#include "sha1rounds.h"
+
+#include <atomic>
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#	define CPPTOTP_SHA1_X86 1
+#	include <immintrin.h>
+#endif
+
+namespace CppTotp
+{
+
+const char * const Sha1BackendEnvVar = "CPPTOTP_SHA1_BACKEND";
+
+static inline uint32_t lrot32(uint32_t num, uint8_t rotcount)
+{
+	return (num << rotcount) | (num >> (32 - rotcount));
+}
+
+static inline uint32_t loadU32be(const Bytes::Byte * bytes)
+{
+	return
+		(static_cast<uint32_t>(bytes[0]) << 24) |
+		(static_cast<uint32_t>(bytes[1]) << 16) |
+		(static_cast<uint32_t>(bytes[2]) <<  8) |
+		(static_cast<uint32_t>(bytes[3]) <<  0)
+	;
+}
+
+static bool alwaysSupported()
+{
+	return true;
+}
+
+// the straightforward implementation, kept as a reference
+
+static void compressGeneric(uint32_t state[5], const Bytes::Byte * blocks, size_t blockCount)
+{
+	for (size_t block = 0; block < blockCount; ++block)
+	{
+		const Bytes::Byte * chunk = blocks + block*64;
+		uint32_t words[80];
+		size_t j;
+
+		// 0-15: the chunk as a sequence of 32-bit big-endian integers
+		for (j = 0; j < 16; ++j)
+		{
+			words[j] = loadU32be(&chunk[4*j]);
+		}
+
+		// 16-79: derivatives of 0-15
+		for (j = 16; j < 32; ++j)
+		{
+			// unoptimized
+			words[j] = lrot32(words[j-3] ^ words[j-8] ^ words[j-14] ^ words[j-16], 1);
+		}
+		for (j = 32; j < 80; ++j)
+		{
+			// Max Locktyuchin's optimization (SIMD)
+			words[j] = lrot32(words[j-6] ^ words[j-16] ^ words[j-28] ^ words[j-32], 2);
+		}
+
+		// initialize hash values for the round
+		uint32_t a = state[0];
+		uint32_t b = state[1];
+		uint32_t c = state[2];
+		uint32_t d = state[3];
+		uint32_t e = state[4];
+
+		// the loop
+		for (j = 0; j < 80; ++j)
+		{
+			uint32_t f = 0, k = 0;
+
+			if (j < 20)
+			{
+				f = (b & c) | ((~ b) & d);
+				k = 0x5A827999;
+			}
+			else if (j < 40)
+			{
+				f = b ^ c ^ d;
+				k = 0x6ED9EBA1;
+			}
+			else if (j < 60)
+			{
+				f = (b & c) | (b & d) | (c & d);
+				k = 0x8F1BBCDC;
+			}
+			else if (j < 80)
+			{
+				f = b ^ c ^ d;
+				k = 0xCA62C1D6;
+			}
+			else
+			{
+				assert(0 && "how did I get here?");
+			}
+
+			uint32_t tmp = lrot32(a, 5) + f + e + k + words[j];
+			e = d;
+			d = c;
+			c = lrot32(b, 30);
+			b = a;
+			a = tmp;
+		}
+
+		// add that to the result so far
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+
+		Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(words), sizeof(words));
+	}
+}
+
+// fully unrolled, branch-free scalar rounds
+
+static void compressUnrolled(uint32_t state[5], const Bytes::Byte * blocks, size_t blockCount)
+{
+	uint32_t w[16];
+
+	for (size_t block = 0; block < blockCount; ++block)
+	{
+		for (size_t j = 0; j < 16; ++j)
+		{
+			w[j] = loadU32be(&blocks[block*64 + 4*j]);
+		}
+
+		sha1CompressWords(state, w);
+	}
+
+	Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(w), sizeof(w));
+}
+
+// the counter HMAC with scalar rounds: after the pad blocks, the inner block
+// holds only the counter and the padding of a 72-byte message, and the outer
+// block only the inner digest and the padding of an 84-byte message. With the
+// other words constant, the compiler folds the schedule words that depend on
+// them alone and simplifies the rest; no bytes are loaded or padded.
+
+static void counterMacScalar(const uint32_t innerState[5], const uint32_t outerState[5], uint64_t counter, uint32_t digest[5])
+{
+	uint32_t state[5];
+	uint32_t w[16] = {
+		static_cast<uint32_t>(counter >> 32), static_cast<uint32_t>(counter & 0xFFFFFFFF), 0x80000000u, 0,
+		0, 0, 0, 0,
+		0, 0, 0, 0,
+		0, 0, 0, (64 + 8) * 8,
+	};
+
+	std::memcpy(state, innerState, sizeof(state));
+	sha1CompressWords(state, w);
+
+	uint32_t v[16] = {
+		state[0], state[1], state[2], state[3],
+		state[4], 0x80000000u, 0, 0,
+		0, 0, 0, 0,
+		0, 0, 0, (64 + 20) * 8,
+	};
+
+	std::memcpy(state, outerState, sizeof(state));
+	sha1CompressWords(state, v);
+	std::memcpy(digest, state, sizeof(state));
+
+	Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(state), sizeof(state));
+	Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(w), sizeof(w));
+	Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(v), sizeof(v));
+}
+
+#if CPPTOTP_SHA1_X86
+
+// message schedule calculated four words at a time using SSSE3, unrolled
+// scalar rounds
+
+__attribute__((target("ssse3")))
+static void compressSsse3(uint32_t state[5], const Bytes::Byte * blocks, size_t blockCount)
+{
+	const __m128i byteSwap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	const __m128i k[4] = {
+		_mm_set1_epi32(static_cast<int>(SHA1_K1)),
+		_mm_set1_epi32(static_cast<int>(SHA1_K2)),
+		_mm_set1_epi32(static_cast<int>(SHA1_K3)),
+		_mm_set1_epi32(static_cast<int>(SHA1_K4)),
+	};
+	__m128i x[20];
+	alignas(16) uint32_t wk[80];
+
+	for (size_t block = 0; block < blockCount; ++block)
+	{
+		const Bytes::Byte * chunk = blocks + block*64;
+		size_t t;
+
+		// 0-15: the chunk, byte-swapped into big-endian words
+		for (t = 0; t < 4; ++t)
+		{
+			__m128i raw = _mm_loadu_si128(reinterpret_cast<const __m128i *>(chunk + 16*t));
+			x[t] = _mm_shuffle_epi8(raw, byteSwap);
+		}
+
+		// 16-31: w[t+3] depends on w[t], so the last lane is fixed up after
+		// the fact
+		for (t = 4; t < 8; ++t)
+		{
+			__m128i w3 = _mm_srli_si128(x[t-1], 4);
+			__m128i w8 = x[t-2];
+			__m128i w14 = _mm_alignr_epi8(x[t-3], x[t-4], 8);
+			__m128i w16 = x[t-4];
+
+			__m128i sum = _mm_xor_si128(_mm_xor_si128(w3, w8), _mm_xor_si128(w14, w16));
+			__m128i rot = _mm_or_si128(_mm_slli_epi32(sum, 1), _mm_srli_epi32(sum, 31));
+
+			// w[t+3] ^= rol1(w[t]) == rol2(sum[0])
+			__m128i fix = _mm_slli_si128(sum, 12);
+			fix = _mm_or_si128(_mm_slli_epi32(fix, 2), _mm_srli_epi32(fix, 30));
+			x[t] = _mm_xor_si128(rot, fix);
+		}
+
+		// 32-79: Max Locktyuchin's optimization
+		for (t = 8; t < 20; ++t)
+		{
+			__m128i w6 = _mm_alignr_epi8(x[t-1], x[t-2], 8);
+			__m128i sum = _mm_xor_si128(_mm_xor_si128(w6, x[t-4]), _mm_xor_si128(x[t-7], x[t-8]));
+			x[t] = _mm_or_si128(_mm_slli_epi32(sum, 2), _mm_srli_epi32(sum, 30));
+		}
+
+		for (t = 0; t < 20; ++t)
+		{
+			_mm_store_si128(reinterpret_cast<__m128i *>(&wk[4*t]), _mm_add_epi32(x[t], k[t/5]));
+		}
+
+		uint32_t a = state[0];
+		uint32_t b = state[1];
+		uint32_t c = state[2];
+		uint32_t d = state[3];
+		uint32_t e = state[4];
+
+#define SHA1_WK(j) wk[j]
+		SHA1_ROUNDS80(SHA1_WK, SHA1_WK, SHA1_WK, SHA1_WK);
+#undef SHA1_WK
+
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+	}
+
+	Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(wk), sizeof(wk));
+}
+
+static bool ssse3Supported()
+{
+	return __builtin_cpu_supports("ssse3");
+}
+
+// the SHA extensions
+
+#define SHA1_NI_STEP(eNext, eOther, mCur, mNext, mXor, mPrev, func) \
+	do \
+	{ \
+		eNext = _mm_sha1nexte_epu32(eNext, mCur); \
+		eOther = abcd; \
+		mNext = _mm_sha1msg2_epu32(mNext, mCur); \
+		abcd = _mm_sha1rnds4_epu32(abcd, eNext, func); \
+		mPrev = _mm_sha1msg1_epu32(mPrev, mCur); \
+		mXor = _mm_xor_si128(mXor, mCur); \
+	} \
+	while (0)
+
+/**
+ * Compresses one block, given as message words (word 0 in the highest
+ * element of m0), into the state; abcd holds a in its highest element, e0
+ * holds e in its highest element and zeroes below.
+ */
+__attribute__((target("sha,sse4.1")))
+static inline __attribute__((always_inline)) void shaNiBlock(__m128i & abcd, __m128i & e0, __m128i m0, __m128i m1, __m128i m2, __m128i m3)
+{
+	__m128i e1;
+	__m128i abcdSave = abcd;
+	__m128i e0Save = e0;
+
+	// rounds 0-15 while the message words trickle in
+	e0 = _mm_add_epi32(e0, m0);
+	e1 = abcd;
+	abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+	e1 = _mm_sha1nexte_epu32(e1, m1);
+	e0 = abcd;
+	abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+	m0 = _mm_sha1msg1_epu32(m0, m1);
+
+	e0 = _mm_sha1nexte_epu32(e0, m2);
+	e1 = abcd;
+	abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+	m1 = _mm_sha1msg1_epu32(m1, m2);
+	m0 = _mm_xor_si128(m0, m2);
+
+	SHA1_NI_STEP(e1, e0, m3, m0, m1, m2, 0);
+
+	// rounds 16-67: the steady state
+	SHA1_NI_STEP(e0, e1, m0, m1, m2, m3, 0);
+	SHA1_NI_STEP(e1, e0, m1, m2, m3, m0, 1);
+	SHA1_NI_STEP(e0, e1, m2, m3, m0, m1, 1);
+	SHA1_NI_STEP(e1, e0, m3, m0, m1, m2, 1);
+	SHA1_NI_STEP(e0, e1, m0, m1, m2, m3, 1);
+	SHA1_NI_STEP(e1, e0, m1, m2, m3, m0, 1);
+	SHA1_NI_STEP(e0, e1, m2, m3, m0, m1, 2);
+	SHA1_NI_STEP(e1, e0, m3, m0, m1, m2, 2);
+	SHA1_NI_STEP(e0, e1, m0, m1, m2, m3, 2);
+	SHA1_NI_STEP(e1, e0, m1, m2, m3, m0, 2);
+	SHA1_NI_STEP(e0, e1, m2, m3, m0, m1, 2);
+	SHA1_NI_STEP(e1, e0, m3, m0, m1, m2, 3);
+	SHA1_NI_STEP(e0, e1, m0, m1, m2, m3, 3);
+
+	// rounds 68-79 while the schedule runs out
+	e1 = _mm_sha1nexte_epu32(e1, m1);
+	e0 = abcd;
+	m2 = _mm_sha1msg2_epu32(m2, m1);
+	abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+	m3 = _mm_xor_si128(m3, m1);
+
+	e0 = _mm_sha1nexte_epu32(e0, m2);
+	e1 = abcd;
+	m3 = _mm_sha1msg2_epu32(m3, m2);
+	abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+	e1 = _mm_sha1nexte_epu32(e1, m3);
+	e0 = abcd;
+	abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+	// add that to the result so far
+	e0 = _mm_sha1nexte_epu32(e0, e0Save);
+	abcd = _mm_add_epi32(abcd, abcdSave);
+}
+
+__attribute__((target("sha,sse4.1")))
+static void compressShaNi(uint32_t state[5], const Bytes::Byte * blocks, size_t blockCount)
+{
+	const __m128i byteSwap = _mm_set_epi64x(0x0001020304050607LL, 0x08090a0b0c0d0e0fLL);
+
+	__m128i abcd = _mm_loadu_si128(reinterpret_cast<const __m128i *>(state));
+	__m128i e0 = _mm_set_epi32(static_cast<int>(state[4]), 0, 0, 0);
+	abcd = _mm_shuffle_epi32(abcd, 0x1B);
+
+	for (size_t block = 0; block < blockCount; ++block)
+	{
+		const __m128i * chunk = reinterpret_cast<const __m128i *>(blocks + block*64);
+		shaNiBlock(
+			abcd, e0,
+			_mm_shuffle_epi8(_mm_loadu_si128(chunk + 0), byteSwap),
+			_mm_shuffle_epi8(_mm_loadu_si128(chunk + 1), byteSwap),
+			_mm_shuffle_epi8(_mm_loadu_si128(chunk + 2), byteSwap),
+			_mm_shuffle_epi8(_mm_loadu_si128(chunk + 3), byteSwap)
+		);
+	}
+
+	abcd = _mm_shuffle_epi32(abcd, 0x1B);
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(state), abcd);
+	state[4] = static_cast<uint32_t>(_mm_extract_epi32(e0, 3));
+}
+
+#undef SHA1_NI_STEP
+
+// the counter HMAC with the SHA extensions: the message words are built in
+// registers, and the inner digest goes straight into the outer block
+
+__attribute__((target("sha,sse4.1")))
+static void counterMacShaNi(const uint32_t innerState[5], const uint32_t outerState[5], uint64_t counter, uint32_t digest[5])
+{
+	const __m128i zero = _mm_setzero_si128();
+
+	__m128i abcd = _mm_set_epi32(
+		static_cast<int>(innerState[0]), static_cast<int>(innerState[1]),
+		static_cast<int>(innerState[2]), static_cast<int>(innerState[3])
+	);
+	__m128i e0 = _mm_set_epi32(static_cast<int>(innerState[4]), 0, 0, 0);
+	shaNiBlock(
+		abcd, e0,
+		_mm_set_epi32(static_cast<int>(counter >> 32), static_cast<int>(counter & 0xFFFFFFFF), static_cast<int>(0x80000000u), 0),
+		zero, zero,
+		_mm_set_epi32(0, 0, 0, (64 + 8) * 8)
+	);
+
+	// a to d are already in message word order; e goes on top of the padding
+	__m128i m0 = abcd;
+	__m128i m1 = _mm_or_si128(
+		_mm_and_si128(e0, _mm_set_epi32(-1, 0, 0, 0)),
+		_mm_set_epi32(0, static_cast<int>(0x80000000u), 0, 0)
+	);
+
+	abcd = _mm_set_epi32(
+		static_cast<int>(outerState[0]), static_cast<int>(outerState[1]),
+		static_cast<int>(outerState[2]), static_cast<int>(outerState[3])
+	);
+	e0 = _mm_set_epi32(static_cast<int>(outerState[4]), 0, 0, 0);
+	shaNiBlock(abcd, e0, m0, m1, zero, _mm_set_epi32(0, 0, 0, (64 + 20) * 8));
+
+	abcd = _mm_shuffle_epi32(abcd, 0x1B);
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(digest), abcd);
+	digest[4] = static_cast<uint32_t>(_mm_extract_epi32(e0, 3));
+}
+
+static bool shaNiSupported()
+{
+	return __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1");
+}
+
+#endif
+
+// in order of preference; the scalar rounds are the bottleneck of the SSSE3
+// kernel, which therefore tends to lose against the unrolled one
+static const Sha1Backend backends[] = {
+#if CPPTOTP_SHA1_X86
+	{ "shani", compressShaNi, counterMacShaNi, shaNiSupported },
+#endif
+	{ "unrolled", compressUnrolled, counterMacScalar, alwaysSupported },
+#if CPPTOTP_SHA1_X86
+	{ "ssse3", compressSsse3, counterMacScalar, ssse3Supported },
+#endif
+	{ "generic", compressGeneric, counterMacScalar, alwaysSupported },
+};
+static const size_t backendCount = sizeof(backends) / sizeof(backends[0]);
+
+static std::atomic<const Sha1Backend *> currentBackend(nullptr);
+
+static const Sha1Backend * findBackend(const char * name)
+{
+	for (size_t i = 0; i < backendCount; ++i)
+	{
+		if (std::strcmp(backends[i].name, name) == 0 && backends[i].supported())
+		{
+			return &backends[i];
+		}
+	}
+	return nullptr;
+}
+
+static const Sha1Backend * chooseBackend()
+{
+	const char * forced = std::getenv(Sha1BackendEnvVar);
+	if (forced != nullptr)
+	{
+		const Sha1Backend * backend = findBackend(forced);
+		if (backend != nullptr)
+		{
+			return backend;
+		}
+	}
+
+	for (size_t i = 0; i < backendCount; ++i)
+	{
+		if (backends[i].supported())
+		{
+			return &backends[i];
+		}
+	}
+
+	assert(0 && "the portable backends are always supported");
+	return &backends[backendCount - 1];
+}
+
+const Sha1Backend & sha1Backend()
+{
+	const Sha1Backend * backend = currentBackend.load(std::memory_order_acquire);
+	if (backend == nullptr)
+	{
+		// racing threads all come to the same conclusion
+		backend = chooseBackend();
+		currentBackend.store(backend, std::memory_order_release);
+	}
+	return *backend;
+}
+
+const Sha1Backend * sha1Backends(size_t * count)
+{
+	*count = backendCount;
+	return backends;
+}
+
+bool selectSha1Backend(const char * name)
+{
+	const Sha1Backend * backend = findBackend(name);
+	if (backend == nullptr)
+	{
+		return false;
+	}
+
+	currentBackend.store(backend, std::memory_order_release);
+	return true;
+}
+
+}
@@ -0,0 +1,79 @@
+/**
+ * @file sha1backend.h
+ *
+ * @brief Selection of the SHA-1 block compression implementation.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#ifndef __CPPTOTP_SHA1BACKEND_H__
+#define __CPPTOTP_SHA1BACKEND_H__
+
+#include "bytes.h"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace CppTotp
+{
+
+/**
+ * Compresses the given number of consecutive 64-byte blocks into the hash
+ * state.
+ */
+typedef void (*Sha1CompressFunc)(uint32_t state[5], const Bytes::Byte * blocks, size_t blockCount);
+
+/**
+ * Calculates the HMAC-SHA-1 of a 64-bit counter (as used by HOTP) from the
+ * midstates of a key, returning the digest as five big-endian words.
+ */
+typedef void (*Sha1CounterMacFunc)(const uint32_t innerState[5], const uint32_t outerState[5], uint64_t counter, uint32_t digest[5]);
+
+/** An implementation of the SHA-1 block compression. */
+struct Sha1Backend
+{
+	/** The name by which the backend can be selected. */
+	const char * name;
+
+	/** The compression function. */
+	Sha1CompressFunc compress;
+
+	/**
+	 * The counter HMAC, specialized for the single fixed-layout block hashed
+	 * after each pad block.
+	 */
+	Sha1CounterMacFunc counterMac;
+
+	/** Whether the current CPU can run this backend. */
+	bool (*supported)();
+};
+
+/**
+ * The name of the environment variable that forces a specific backend (if
+ * supported by the CPU) instead of the automatically chosen one.
+ */
+extern const char * const Sha1BackendEnvVar;
+
+/**
+ * Returns the backend in use.
+ *
+ * On first use, the backend named in the environment variable is chosen if
+ * the CPU supports it; otherwise, the fastest supported one is.
+ */
+const Sha1Backend & sha1Backend();
+
+/** Returns all backends compiled into the library, supported or not. */
+const Sha1Backend * sha1Backends(size_t * count);
+
+/**
+ * Switches to the backend with the given name.
+ *
+ * @return false (leaving the current backend in place) if no backend of that
+ * name exists or the CPU does not support it.
+ */
+bool selectSha1Backend(const char * name);
+
+}
+
+#endif
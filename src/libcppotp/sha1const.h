@@ -0,0 +1,239 @@
+/**
+ * @file sha1const.h
+ *
+ * @brief A SHA-1 and HMAC-SHA-1 core that can be evaluated at compile time.
+ *
+ * The functions are slower than the runtime kernels when processing long
+ * messages, but they are inlined into their callers and fold away completely
+ * when their inputs are constant.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#ifndef __CPPTOTP_SHA1CONST_H__
+#define __CPPTOTP_SHA1CONST_H__
+
+#include <cstddef>
+#include <cstdint>
+
+namespace CppTotp
+{
+namespace ConstSha1
+{
+
+/** A SHA-1 hash state or digest, as words. */
+struct State
+{
+	uint32_t h[5];
+};
+
+/** A message block, as big-endian words. */
+struct Block
+{
+	uint32_t w[16];
+};
+
+/**
+ * The inner and outer pad midstates of an HMAC-SHA-1 key.
+ *
+ * @note Unlike HmacSha1Key, this type is not wiped on destruction, as that
+ * would keep it from being used at compile time.
+ */
+struct Key
+{
+	State inner;
+	State outer;
+};
+
+constexpr uint32_t lrot32(uint32_t num, unsigned rotcount)
+{
+	return (num << rotcount) | (num >> (32 - rotcount));
+}
+
+constexpr State initialState()
+{
+	return State{{ 0x67452301u, 0xEFCDAB89u, 0x98BADCFEu, 0x10325476u, 0xC3D2E1F0u }};
+}
+
+/** Returns word j (>= 16) of the message schedule, kept in a ring buffer. */
+constexpr uint32_t schedule(uint32_t (&w)[16], size_t j)
+{
+	return w[j & 15] = lrot32(w[(j-3) & 15] ^ w[(j-8) & 15] ^ w[(j-14) & 15] ^ w[j & 15], 1);
+}
+
+/** Compresses one block into the state. */
+constexpr State compress(State state, const Block & block)
+{
+	uint32_t w[16] = {};
+	size_t j = 0;
+
+	for (j = 0; j < 16; ++j)
+	{
+		w[j] = block.w[j];
+	}
+
+	uint32_t a = state.h[0];
+	uint32_t b = state.h[1];
+	uint32_t c = state.h[2];
+	uint32_t d = state.h[3];
+	uint32_t e = state.h[4];
+	uint32_t tmp = 0;
+
+	for (j = 0; j < 16; ++j)
+	{
+		tmp = lrot32(a, 5) + (d ^ (b & (c ^ d))) + e + 0x5A827999u + w[j];
+		e = d; d = c; c = lrot32(b, 30); b = a; a = tmp;
+	}
+	for (j = 16; j < 20; ++j)
+	{
+		tmp = lrot32(a, 5) + (d ^ (b & (c ^ d))) + e + 0x5A827999u + schedule(w, j);
+		e = d; d = c; c = lrot32(b, 30); b = a; a = tmp;
+	}
+	for (j = 20; j < 40; ++j)
+	{
+		tmp = lrot32(a, 5) + (b ^ c ^ d) + e + 0x6ED9EBA1u + schedule(w, j);
+		e = d; d = c; c = lrot32(b, 30); b = a; a = tmp;
+	}
+	for (j = 40; j < 60; ++j)
+	{
+		tmp = lrot32(a, 5) + ((b & c) | (d & (b | c))) + e + 0x8F1BBCDCu + schedule(w, j);
+		e = d; d = c; c = lrot32(b, 30); b = a; a = tmp;
+	}
+	for (j = 60; j < 80; ++j)
+	{
+		tmp = lrot32(a, 5) + (b ^ c ^ d) + e + 0xCA62C1D6u + schedule(w, j);
+		e = d; d = c; c = lrot32(b, 30); b = a; a = tmp;
+	}
+
+	state.h[0] += a;
+	state.h[1] += b;
+	state.h[2] += c;
+	state.h[3] += d;
+	state.h[4] += e;
+	return state;
+}
+
+/** Returns byte i of the message including the SHA-1 padding. */
+template <typename CharT>
+constexpr uint8_t paddedByte(const CharT * msg, size_t size, size_t i)
+{
+	const uint64_t sizeBits = static_cast<uint64_t>(size) * 8;
+	const size_t paddedSize = ((size + 8) / 64 + 1) * 64;
+
+	if (i < size)
+	{
+		return static_cast<uint8_t>(msg[i]);
+	}
+	else if (i == size)
+	{
+		return 0x80;
+	}
+	else if (i >= paddedSize - 8)
+	{
+		return static_cast<uint8_t>((sizeBits >> ((paddedSize - 1 - i) * 8)) & 0xFF);
+	}
+	return 0x00;
+}
+
+/** Calculates the SHA-1 hash of the given message. */
+template <typename CharT>
+constexpr State sha1(const CharT * msg, size_t size)
+{
+	State state = initialState();
+	const size_t paddedSize = ((size + 8) / 64 + 1) * 64;
+
+	for (size_t offset = 0; offset < paddedSize; offset += 64)
+	{
+		Block block = {};
+		for (size_t i = 0; i < 64; ++i)
+		{
+			block.w[i/4] |= static_cast<uint32_t>(paddedByte(msg, size, offset + i)) << ((3 - i%4) * 8);
+		}
+		state = compress(state, block);
+	}
+
+	return state;
+}
+
+/** Returns byte i (0 to 19) of the given digest. */
+constexpr uint8_t digestByte(const State & digest, size_t i)
+{
+	return static_cast<uint8_t>((digest.h[i/4] >> ((3 - i%4) * 8)) & 0xFF);
+}
+
+/** Prepares an HMAC-SHA-1 key (with a block size of 64). */
+template <typename CharT>
+constexpr Key prepareKey(const CharT * key, size_t keySize)
+{
+	uint8_t realKey[64] = {};
+
+	if (keySize > 64)
+	{
+		// resize by calculating hash
+		State hashedKey = sha1(key, keySize);
+		for (size_t i = 0; i < 20; ++i)
+		{
+			realKey[i] = digestByte(hashedKey, i);
+		}
+	}
+	else
+	{
+		for (size_t i = 0; i < keySize; ++i)
+		{
+			realKey[i] = static_cast<uint8_t>(key[i]);
+		}
+	}
+
+	Block innerPad = {};
+	Block outerPad = {};
+	for (size_t i = 0; i < 64; ++i)
+	{
+		innerPad.w[i/4] |= static_cast<uint32_t>(realKey[i] ^ 0x36) << ((3 - i%4) * 8);
+		outerPad.w[i/4] |= static_cast<uint32_t>(realKey[i] ^ 0x5c) << ((3 - i%4) * 8);
+	}
+
+	return Key{ compress(initialState(), innerPad), compress(initialState(), outerPad) };
+}
+
+/** Calculates the HMAC-SHA-1 of an 8-byte big-endian counter. */
+constexpr State hmacCounter(const Key & key, uint64_t counter)
+{
+	// the counter and the padding for a 72-byte message
+	const Block innerBlock = {{
+		static_cast<uint32_t>(counter >> 32), static_cast<uint32_t>(counter & 0xFFFFFFFF), 0x80000000u, 0,
+		0, 0, 0, 0,
+		0, 0, 0, 0,
+		0, 0, 0, (64 + 8) * 8,
+	}};
+	const State innerHash = compress(key.inner, innerBlock);
+
+	// the inner hash and the padding for an 84-byte message
+	const Block outerBlock = {{
+		innerHash.h[0], innerHash.h[1], innerHash.h[2], innerHash.h[3],
+		innerHash.h[4], 0x80000000u, 0, 0,
+		0, 0, 0, 0,
+		0, 0, 0, (64 + 20) * 8,
+	}};
+	return compress(key.outer, outerBlock);
+}
+
+/** Performs the dynamic truncation of a digest (without the modulo). */
+constexpr uint32_t truncate(const State & digest)
+{
+	// fetch the offset (from the last nibble)
+	const size_t offset = digest.h[4] & 0x0F;
+
+	// snip off the MSB (to alleviate signed/unsigned troubles)
+	return (
+		(static_cast<uint32_t>(digestByte(digest, offset + 0)) << 24) |
+		(static_cast<uint32_t>(digestByte(digest, offset + 1)) << 16) |
+		(static_cast<uint32_t>(digestByte(digest, offset + 2)) <<  8) |
+		(static_cast<uint32_t>(digestByte(digest, offset + 3)) <<  0)
+	) & 0x7fffffff;
+}
+
+}
+}
+
+#endif
@@ -0,0 +1,201 @@
+/**
+ * @file sha1lanes.cpp
+ *
+ * @brief Implementation of the lane-parallel SHA-1.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#include "sha1lanes.h"
+#include "metrics.h"
+#include "sha1.h"
+#include "sha1backend.h"
+#include "sha1rounds.h"
+
+#include <cstring>
+
+#if defined(__GNUC__)
+#	define CPPTOTP_LANES_VECTORS 1
+#	if defined(__x86_64__) || defined(__i386__)
+#		define CPPTOTP_LANES_X86 1
+#	endif
+#endif
+
+namespace CppTotp
+{
+
+#if CPPTOTP_LANES_VECTORS
+typedef uint32_t LaneVec4  __attribute__((vector_size(16)));
+typedef uint32_t LaneVec8  __attribute__((vector_size(32)));
+typedef uint32_t LaneVec16 __attribute__((vector_size(64)));
+#endif
+
+/**
+ * Calculates the counter HMACs of the W lanes starting at firstLane; V holds
+ * W words.
+ */
+template <typename V, size_t W>
+static CPPTOTP_SHA1_INLINE void hmacCounterGroup(const Sha1LaneStates & inner, const Sha1LaneStates & outer, const uint64_t * counters, size_t firstLane, Sha1LaneStates * digests)
+{
+	V state[5];
+	V w[16];
+	uint32_t hi[W];
+	uint32_t lo[W];
+
+	for (size_t i = 0; i < W; ++i)
+	{
+		hi[i] = static_cast<uint32_t>(counters[firstLane + i] >> 32);
+		lo[i] = static_cast<uint32_t>(counters[firstLane + i] & 0xFFFFFFFF);
+	}
+
+	// inner hash: ipad block (already in the midstate), then the counter and
+	// the padding for a 72-byte message
+	for (size_t i = 0; i < 5; ++i)
+	{
+		std::memcpy(&state[i], &inner.h[i][firstLane], sizeof(V));
+	}
+	std::memcpy(&w[0], hi, sizeof(V));
+	std::memcpy(&w[1], lo, sizeof(V));
+	w[2] = V() + 0x80000000u;
+	for (size_t i = 3; i < 15; ++i)
+	{
+		w[i] = V() + 0u;
+	}
+	w[15] = V() + static_cast<uint32_t>((Sha1BlockSize + 8) * 8);
+	sha1CompressWords(state, w);
+
+	// outer hash: opad block (already in the midstate), then the inner digest
+	// and the padding for an 84-byte message
+	for (size_t i = 0; i < 5; ++i)
+	{
+		w[i] = state[i];
+		std::memcpy(&state[i], &outer.h[i][firstLane], sizeof(V));
+	}
+	w[5] = V() + 0x80000000u;
+	for (size_t i = 6; i < 15; ++i)
+	{
+		w[i] = V() + 0u;
+	}
+	w[15] = V() + static_cast<uint32_t>((Sha1BlockSize + Sha1DigestSize) * 8);
+	sha1CompressWords(state, w);
+
+	for (size_t i = 0; i < 5; ++i)
+	{
+		std::memcpy(&digests->h[i][firstLane], &state[i], sizeof(V));
+	}
+}
+
+#if !CPPTOTP_LANES_VECTORS
+static void hmacCounterLanes1(const Sha1LaneStates & inner, const Sha1LaneStates & outer, const uint64_t * counters, size_t laneCount, Sha1LaneStates * digests)
+{
+	for (size_t lane = 0; lane < laneCount; ++lane)
+	{
+		hmacCounterGroup<uint32_t, 1>(inner, outer, counters, lane, digests);
+	}
+}
+#endif
+
+#if CPPTOTP_LANES_VECTORS
+static void hmacCounterLanes4(const Sha1LaneStates & inner, const Sha1LaneStates & outer, const uint64_t * counters, size_t laneCount, Sha1LaneStates * digests)
+{
+	for (size_t lane = 0; lane < laneCount; lane += 4)
+	{
+		hmacCounterGroup<LaneVec4, 4>(inner, outer, counters, lane, digests);
+	}
+}
+#endif
+
+#if CPPTOTP_LANES_X86
+__attribute__((target("avx2")))
+static void hmacCounterLanes8(const Sha1LaneStates & inner, const Sha1LaneStates & outer, const uint64_t * counters, size_t laneCount, Sha1LaneStates * digests)
+{
+	for (size_t lane = 0; lane < laneCount; lane += 8)
+	{
+		hmacCounterGroup<LaneVec8, 8>(inner, outer, counters, lane, digests);
+	}
+}
+
+__attribute__((target("avx512f")))
+static void hmacCounterLanes16(const Sha1LaneStates & inner, const Sha1LaneStates & outer, const uint64_t * counters, size_t laneCount, Sha1LaneStates * digests)
+{
+	(void)laneCount;
+	hmacCounterGroup<LaneVec16, 16>(inner, outer, counters, 0, digests);
+}
+
+static bool cpuHasAvx2()
+{
+	static const bool has = __builtin_cpu_supports("avx2");
+	return has;
+}
+
+static bool cpuHasAvx512()
+{
+	static const bool has = __builtin_cpu_supports("avx512f");
+	return has;
+}
+#endif
+
+void hmacSha1CounterLanes(const Sha1LaneStates & inner, const Sha1LaneStates & outer, const uint64_t callerCounters[], size_t laneCount, Sha1LaneStates * digests)
+{
+	if (laneCount == 0)
+	{
+		return;
+	}
+	if (laneCount > Sha1MaxLanes)
+	{
+		laneCount = Sha1MaxLanes;
+	}
+
+	// the groups read whole vectors of counters; the caller's may be shorter
+	uint64_t counters[Sha1MaxLanes] = {};
+	std::memcpy(counters, callerCounters, laneCount * sizeof(uint64_t));
+
+	CPPTOTP_METRIC_ADD(LaneBatches, 1);
+	CPPTOTP_METRIC_ADD(LanesUsed, laneCount);
+	CPPTOTP_METRIC_TIMER(Lanes);
+	CPPTOTP_PROBE1(lanes, laneCount);
+
+	if (laneCount == 1)
+	{
+		// a single lane is better served by the backend's own kernel
+		uint32_t innerState[5];
+		uint32_t outerState[5];
+		uint32_t digest[5];
+		for (size_t i = 0; i < 5; ++i)
+		{
+			innerState[i] = inner.h[i][0];
+			outerState[i] = outer.h[i][0];
+		}
+		sha1Backend().counterMac(innerState, outerState, counters[0], digest);
+		for (size_t i = 0; i < 5; ++i)
+		{
+			digests->h[i][0] = digest[i];
+		}
+		Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(innerState), sizeof(innerState));
+		Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(outerState), sizeof(outerState));
+		Bytes::clearBytes(reinterpret_cast<Bytes::Byte *>(digest), sizeof(digest));
+		return;
+	}
+
+#if CPPTOTP_LANES_X86
+	if (laneCount > 8 && cpuHasAvx512())
+	{
+		hmacCounterLanes16(inner, outer, counters, laneCount, digests);
+		return;
+	}
+	if (laneCount > 4 && cpuHasAvx2())
+	{
+		hmacCounterLanes8(inner, outer, counters, laneCount, digests);
+		return;
+	}
+#endif
+
+#if CPPTOTP_LANES_VECTORS
+	hmacCounterLanes4(inner, outer, counters, laneCount, digests);
+#else
+	hmacCounterLanes1(inner, outer, counters, laneCount, digests);
+#endif
+}
+
+}
@@ -0,0 +1,50 @@
+/**
+ * @file sha1lanes.h
+ *
+ * @brief Lane-parallel SHA-1 for many independent short messages.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#ifndef __CPPTOTP_SHA1LANES_H__
+#define __CPPTOTP_SHA1LANES_H__
+
+#include <cstddef>
+#include <cstdint>
+
+namespace CppTotp
+{
+
+/** The maximum number of lanes processed by one call. */
+const size_t Sha1MaxLanes = 16;
+
+/**
+ * The SHA-1 states of up to Sha1MaxLanes independent calculations.
+ *
+ * The states are stored word-major (h[word][lane]) so that the same word of
+ * consecutive lanes can be loaded into a SIMD register in one go.
+ */
+struct Sha1LaneStates
+{
+	uint32_t h[5][Sha1MaxLanes];
+};
+
+/**
+ * Calculates the HMAC-SHA-1 of an 8-byte big-endian counter in each lane,
+ * starting from the inner and outer pad midstates of each lane's key (see
+ * HmacSha1Key).
+ *
+ * The resulting digests are stored as big-endian words in digests.
+ *
+ * Only laneCount counters are read.
+ *
+ * @note Lanes are processed in groups of the SIMD width; the midstates of
+ * lanes past laneCount but within the last group are hashed as well and must
+ * therefore be initialized (e.g. zeroed).
+ */
+void hmacSha1CounterLanes(const Sha1LaneStates & inner, const Sha1LaneStates & outer, const uint64_t counters[], size_t laneCount, Sha1LaneStates * digests);
+
+}
+
+#endif
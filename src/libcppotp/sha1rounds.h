@@ -0,0 +1,127 @@
+/**
+ * @file sha1rounds.h
+ *
+ * @brief Building blocks shared by the SHA-1 compression kernels.
+ *
+ * The macros work on plain uint32_t values as well as on GCC vectors of them;
+ * this header is internal to the library.
+ *
+ * @copyright The contents of this file have been placed into the public domain;
+ * see the file COPYING for more details.
+ */
+
+#ifndef __CPPTOTP_SHA1ROUNDS_H__
+#define __CPPTOTP_SHA1ROUNDS_H__
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__GNUC__)
+#	define CPPTOTP_SHA1_INLINE inline __attribute__((always_inline))
+#else
+#	define CPPTOTP_SHA1_INLINE inline
+#endif
+
+#define SHA1_LROT(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define SHA1_K1 0x5A827999u
+#define SHA1_K2 0x6ED9EBA1u
+#define SHA1_K3 0x8F1BBCDCu
+#define SHA1_K4 0xCA62C1D6u
+
+#define SHA1_F1(b, c, d) ((d) ^ ((b) & ((c) ^ (d))))
+#define SHA1_F2(b, c, d) ((b) ^ (c) ^ (d))
+#define SHA1_F3(b, c, d) (((b) & (c)) | ((d) & ((b) | (c))))
+#define SHA1_F4(b, c, d) SHA1_F2(b, c, d)
+
+/** Word j (>= 16) of the message schedule, kept in a 16-word ring buffer. */
+#define SHA1_SCHEDULE(w, j) \
+	(w[(j) & 15] = SHA1_LROT(w[((j)-3) & 15] ^ w[((j)-8) & 15] ^ w[((j)-14) & 15] ^ w[(j) & 15], 1))
+
+/** One round; wk is the message word with the round constant already added. */
+#define SHA1_ROUND(a, b, c, d, e, f, wk) \
+	do \
+	{ \
+		e += SHA1_LROT(a, 5) + (f) + (wk); \
+		b = SHA1_LROT(b, 30); \
+	} \
+	while (0)
+
+/**
+ * Five rounds starting at round j, rotating the roles of the variables a to e
+ * instead of moving the values around. WK(j) must evaluate to the message word
+ * plus round constant of round j.
+ */
+#define SHA1_ROUNDS5(F, WK, j) \
+	do \
+	{ \
+		SHA1_ROUND(a, b, c, d, e, F(b, c, d), WK((j)+0)); \
+		SHA1_ROUND(e, a, b, c, d, F(a, b, c), WK((j)+1)); \
+		SHA1_ROUND(d, e, a, b, c, F(e, a, b), WK((j)+2)); \
+		SHA1_ROUND(c, d, e, a, b, F(d, e, a), WK((j)+3)); \
+		SHA1_ROUND(b, c, d, e, a, F(c, d, e), WK((j)+4)); \
+	} \
+	while (0)
+
+/** All 80 rounds, fully unrolled; WK1 to WK4 serve the four stages. */
+#define SHA1_ROUNDS80(WK1, WK2, WK3, WK4) \
+	do \
+	{ \
+		SHA1_ROUNDS5(SHA1_F1, WK1,  0); \
+		SHA1_ROUNDS5(SHA1_F1, WK1,  5); \
+		SHA1_ROUNDS5(SHA1_F1, WK1, 10); \
+		SHA1_ROUNDS5(SHA1_F1, WK1, 15); \
+		SHA1_ROUNDS5(SHA1_F2, WK2, 20); \
+		SHA1_ROUNDS5(SHA1_F2, WK2, 25); \
+		SHA1_ROUNDS5(SHA1_F2, WK2, 30); \
+		SHA1_ROUNDS5(SHA1_F2, WK2, 35); \
+		SHA1_ROUNDS5(SHA1_F3, WK3, 40); \
+		SHA1_ROUNDS5(SHA1_F3, WK3, 45); \
+		SHA1_ROUNDS5(SHA1_F3, WK3, 50); \
+		SHA1_ROUNDS5(SHA1_F3, WK3, 55); \
+		SHA1_ROUNDS5(SHA1_F4, WK4, 60); \
+		SHA1_ROUNDS5(SHA1_F4, WK4, 65); \
+		SHA1_ROUNDS5(SHA1_F4, WK4, 70); \
+		SHA1_ROUNDS5(SHA1_F4, WK4, 75); \
+	} \
+	while (0)
+
+namespace CppTotp
+{
+
+/**
+ * Compresses one block, given as 16 message words, into the state. V is either
+ * uint32_t or a GCC vector of uint32_t (one block per element); w is
+ * overwritten with the message schedule.
+ */
+template <typename V>
+static CPPTOTP_SHA1_INLINE void sha1CompressWords(V * state, V * w)
+{
+	V a = state[0];
+	V b = state[1];
+	V c = state[2];
+	V d = state[3];
+	V e = state[4];
+
+#define SHA1_WORD(j) (((j) < 16) ? w[(j) & 15] : SHA1_SCHEDULE(w, j))
+#define SHA1_WK1(j) (SHA1_WORD(j) + SHA1_K1)
+#define SHA1_WK2(j) (SHA1_SCHEDULE(w, j) + SHA1_K2)
+#define SHA1_WK3(j) (SHA1_SCHEDULE(w, j) + SHA1_K3)
+#define SHA1_WK4(j) (SHA1_SCHEDULE(w, j) + SHA1_K4)
+	SHA1_ROUNDS80(SHA1_WK1, SHA1_WK2, SHA1_WK3, SHA1_WK4);
+#undef SHA1_WK4
+#undef SHA1_WK3
+#undef SHA1_WK2
+#undef SHA1_WK1
+#undef SHA1_WORD
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+}
+
+}
+
+#endif